@@ -0,0 +1,339 @@
+#include "checksums.h"
+#include "fs.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef FSBENCH_REVISION
+#define FSBENCH_REVISION "unknown"
+#endif
+
+using namespace std;
+
+/**
+ * @brief The BenchConfig struct describes a benchmark run, quick runs use
+ * smaller files and fewer operations
+ */
+struct BenchConfig {
+    string image = "fsbench.img";               // device file, it is formatted by the run
+    int deviceMb = 256;
+    bool useMmap = true;
+    bool checksums = true;                      // the device is formatted with block checksums
+    bool quick = false;
+    string output;                              // JSON file, stdout if empty
+};
+
+/**
+ * @brief The BenchResult struct describes one measured workload
+ */
+struct BenchResult {
+    string name;
+    int ioSize;                                 // bytes per operation, 0 for metadata workloads
+    long ops;
+    long bytes;
+    double seconds;
+};
+
+typedef chrono::steady_clock Clock;
+
+static double since(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// file system errors and listings go to cout, they must not get into the results
+static streambuf* silenced = NULL;
+
+static void silence() {
+    static ofstream null("/dev/null");
+    silenced = cout.rdbuf(null.rdbuf());
+}
+
+static void unsilence() {
+    if (silenced != NULL) cout.rdbuf(silenced);
+    silenced = NULL;
+}
+
+static bool makeImage(const BenchConfig& config) {
+    int fd = ::open(config.image.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return false;
+
+    bool sized = ftruncate(fd, static_cast<off_t>(config.deviceMb) << 20) == 0;
+    ::close(fd);
+
+    return sized;
+}
+
+static bool mountImage(const BenchConfig& config, int dentryEntries = fs::DEFAULT_DENTRY_ENTRIES) {
+    fs::MountOptions options;
+    options.useMmap = config.useMmap;
+    options.checksums = config.checksums;
+    options.dentryEntries = dentryEntries;
+
+    return fs::mount(config.image.c_str(), options);
+}
+
+static void createUnlink(vector<BenchResult>& results, int files) {
+    fs::mkdir("/cu");
+    char name[fs::FNAME_LEN + 8];
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/cu/f%d", i);
+        fs::create(name);
+    }
+    results.push_back({"create", 0, files, 0, since(start)});
+
+    start = Clock::now();
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/cu/f%d", i);
+        fs::unlink(name);
+    }
+    results.push_back({"unlink", 0, files, 0, since(start)});
+
+    fs::rmdir("/cu");
+}
+
+static string deepPath(int depth) {
+    string path;
+    for (int i = 0; i < depth; i++) path += "/d" + to_string(i);
+    return path;
+}
+
+static void deepLookup(vector<BenchResult>& results, const BenchConfig& config, int depth, int lookups) {
+    for (int i = 1; i <= depth; i++) fs::mkdir(deepPath(i).c_str());
+
+    string file = deepPath(depth) + "/file";
+    fs::create(file.c_str());
+
+    // warm dentry cache, then every lookup walks the directories
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            fs::umount();
+            mountImage(config, 0);
+        }
+
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < lookups; i++) fs::close(fs::open(file.c_str()));
+        results.push_back({pass == 0 ? "deep_lookup" : "deep_lookup_uncached", 0, lookups, 0, since(start)});
+    }
+
+    fs::umount();
+    mountImage(config);
+}
+
+static void largeDirLs(vector<BenchResult>& results, int entries, int listings) {
+    fs::mkdir("/big");
+
+    char name[fs::FNAME_LEN + 8];
+    for (int i = 0; i < entries; i++) {
+        snprintf(name, sizeof(name), "/big/e%d", i);
+        fs::create(name);
+    }
+
+    // an operation is a listed entry
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < listings; i++) fs::ls("/big");
+    results.push_back({"large_dir_ls", 0, static_cast<long>(entries) * listings, 0, since(start)});
+}
+
+static void fileIo(vector<BenchResult>& results, const BenchConfig& config, int ioSize, int fileSize) {
+    string fileName = "/io" + to_string(ioSize);
+    fs::create(fileName.c_str());
+
+    vector<char> buffer(ioSize);
+    mt19937 random(ioSize);
+    for (size_t i = 0; i < buffer.size(); i++) buffer[i] = static_cast<char>(random());
+
+    int ops = fileSize / ioSize;
+
+    // sequential write, then reads from a cold block cache
+    int fd = fs::open(fileName.c_str());
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < ops; i++) fs::write(fd, buffer.data(), ioSize, i * ioSize);
+    fs::close(fd);
+    fs::sync();
+    results.push_back({"seq_write", ioSize, ops, static_cast<long>(ops) * ioSize, since(start)});
+
+    fs::umount();
+    mountImage(config);
+
+    fd = fs::open(fileName.c_str());
+    start = Clock::now();
+    for (int i = 0; i < ops; i++) fs::read(fd, buffer.data(), ioSize, i * ioSize);
+    results.push_back({"seq_read", ioSize, ops, static_cast<long>(ops) * ioSize, since(start)});
+
+    // random aligned offsets of the same file
+    vector<int> offsets(ops);
+    for (int i = 0; i < ops; i++) offsets[i] = static_cast<int>(random() % ops) * ioSize;
+
+    start = Clock::now();
+    for (int i = 0; i < ops; i++) fs::write(fd, buffer.data(), ioSize, offsets[i]);
+    fs::close(fd);
+    fs::sync();
+    results.push_back({"random_write", ioSize, ops, static_cast<long>(ops) * ioSize, since(start)});
+
+    fs::umount();
+    mountImage(config);
+
+    fd = fs::open(fileName.c_str());
+    start = Clock::now();
+    for (int i = 0; i < ops; i++) fs::read(fd, buffer.data(), ioSize, offsets[i]);
+    results.push_back({"random_read", ioSize, ops, static_cast<long>(ops) * ioSize, since(start)});
+    fs::close(fd);
+
+    fs::unlink(fileName.c_str());
+}
+
+// block checksums alone, reads and writes of a device with checksums pay it
+static void checksumSpeed(vector<BenchResult>& results, int size, int rounds) {
+    vector<char> data(size);
+    mt19937 random(size);
+    for (size_t i = 0; i < data.size(); i++) data[i] = static_cast<char>(random());
+
+    int blocks = size / fs::BLOCK_SIZE;
+    vector<unsigned> sums(blocks);
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < rounds; i++) fs::crc32cBlocks(data.data(), blocks, sums.data());
+
+    results.push_back({"crc32c", fs::BLOCK_SIZE, static_cast<long>(rounds) * blocks,
+                       static_cast<long>(rounds) * size, since(start)});
+}
+
+static void mountTime(vector<BenchResult>& results, const BenchConfig& config, int mounts) {
+    double seconds = 0;
+
+    for (int i = 0; i < mounts; i++) {
+        fs::umount();
+
+        Clock::time_point start = Clock::now();
+        mountImage(config);
+        seconds += since(start);
+    }
+
+    results.push_back({"mount", 0, mounts, 0, seconds});
+}
+
+static string escape(const string& text) {
+    string escaped;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '"' || text[i] == '\\') escaped += '\\';
+        escaped += text[i];
+    }
+    return escaped;
+}
+
+static void writeJson(ostream& out, const BenchConfig& config, const vector<BenchResult>& results,
+                      const string& stats) {
+    out << "{\n";
+    out << "  \"revision\": \"" << escape(FSBENCH_REVISION) << "\",\n";
+    out << "  \"fs_version\": " << fs::FS_VERSION << ",\n";
+    out << "  \"block_size\": " << fs::BLOCK_SIZE << ",\n";
+    out << "  \"device_mb\": " << config.deviceMb << ",\n";
+    out << "  \"mmap\": " << (config.useMmap ? "true" : "false") << ",\n";
+    out << "  \"checksums\": " << (config.checksums ? "true" : "false") << ",\n";
+    out << "  \"crc32c_hardware\": " << (fs::crc32cHardware() ? "true" : "false") << ",\n";
+    out << "  \"quick\": " << (config.quick ? "true" : "false") << ",\n";
+
+    // latencies and counters of the whole run, if the library records them
+    if (!stats.empty()) out << "  \"stats\": " << stats << ",\n";
+
+    out << "  \"results\": [\n";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& result = results[i];
+        double seconds = result.seconds > 0 ? result.seconds : 1e-9;
+
+        out << "    {\"name\": \"" << result.name << "\"";
+        out << ", \"io_size\": " << result.ioSize;
+        out << ", \"ops\": " << result.ops;
+        out << ", \"seconds\": " << result.seconds;
+        out << ", \"ops_per_sec\": " << result.ops / seconds;
+        out << ", \"us_per_op\": " << seconds * 1e6 / result.ops;
+        if (result.bytes > 0) out << ", \"mb_per_sec\": " << result.bytes / seconds / (1 << 20);
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    out << "  ]\n";
+    out << "}\n";
+}
+
+static void usage() {
+    cerr << "usage: fsbench [--image FILE] [--size MB] [--no-mmap] [--no-checksums] [--quick] [--output FILE]" << endl;
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (arg == "--image" && i + 1 < argc) {
+            config.image = argv[++i];
+        } else if (arg == "--size" && i + 1 < argc) {
+            config.deviceMb = atoi(argv[++i]);
+        } else if (arg == "--no-mmap") {
+            config.useMmap = false;
+        } else if (arg == "--no-checksums") {
+            config.checksums = false;
+        } else if (arg == "--quick") {
+            config.quick = true;
+        } else if (arg == "--output" && i + 1 < argc) {
+            config.output = argv[++i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    int fileSize = (config.quick ? 8 : 64) << 20;
+    if (config.deviceMb < 2 * (fileSize >> 20)) {
+        cerr << "Error: the device must be at least " << 2 * (fileSize >> 20) << " MB" << endl;
+        return 2;
+    }
+
+    if (!makeImage(config) || !mountImage(config)) {
+        cerr << "Error: can't create the device " << config.image << endl;
+        return 1;
+    }
+
+    vector<BenchResult> results;
+    silence();
+
+    createUnlink(results, config.quick ? 2000 : 20000);
+    deepLookup(results, config, 32, config.quick ? 2000 : 20000);
+    largeDirLs(results, config.quick ? 2000 : 10000, config.quick ? 20 : 100);
+
+    const int ioSizes[] = {512, 4096, 65536, 1 << 20};
+    for (size_t i = 0; i < sizeof(ioSizes) / sizeof(ioSizes[0]); i++) {
+        fileIo(results, config, ioSizes[i], fileSize);
+    }
+
+    mountTime(results, config, config.quick ? 5 : 20);
+    checksumSpeed(results, 1 << 20, config.quick ? 64 : 1024);
+
+    // cache counters are kept by the mounted device
+    string stats = fs::stats().enabled ? fs::statsJson() : "";
+    fs::umount();
+
+    unsilence();
+
+    if (config.output.empty()) {
+        writeJson(cout, config, results, stats);
+    } else {
+        ofstream out(config.output.c_str());
+        writeJson(out, config, results, stats);
+    }
+
+    ::unlink(config.image.c_str());
+    return 0;
+}
@@ -0,0 +1,248 @@
+#include "bitmap.h"
+#include "stats.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace fs {
+
+const int BITS_PER_WORD = 64;
+const int WORDS_PER_BLOCK = BLOCK_SIZE / sizeof(uint64_t);
+const uint64_t FULL_WORD = ~0ULL;
+
+Bitmap::Bitmap() : maskBlockId(0), firstBlockId(0), blocksNumber(0), usedBlocks(0), hint(0), heldBlocks(0) {}
+
+bool Bitmap::load(BlockCache& cache, int maskBlockId, int firstBlockId, int blocksNumber) {
+    this->maskBlockId = maskBlockId;
+    this->firstBlockId = firstBlockId;
+    this->blocksNumber = blocksNumber;
+    hint = firstBlockId;
+
+    int wordsNumber = (blocksNumber + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    int maskBlocks = (wordsNumber + WORDS_PER_BLOCK - 1) / WORDS_PER_BLOCK;
+
+    words.assign(maskBlocks * WORDS_PER_BLOCK, 0);
+    dirtyBlocks.assign(maskBlocks, false);
+
+    unsigned char block[BLOCK_SIZE];
+    bool verified = true;
+    for (int b = 0; b < maskBlocks; b++) {
+        if (!cache.read(maskBlockId + b, reinterpret_cast<char*>(block))) verified = false;
+
+        // byte order on the device is fixed, bit i lives in byte i / 8
+        for (int w = 0; w < WORDS_PER_BLOCK; w++) {
+            uint64_t word = 0;
+            for (int i = 7; i >= 0; i--) word = (word << 8) | block[w * 8 + i];
+            words[b * WORDS_PER_BLOCK + w] = word;
+        }
+    }
+
+    usedBlocks = 0;
+    for (size_t w = 0; w < words.size(); w++) usedBlocks += __builtin_popcountll(words[w]);
+
+    // bits past the end of the device are never free
+    for (int bit = blocksNumber; bit < static_cast<int>(words.size()) * BITS_PER_WORD; bit++) {
+        words[bit / BITS_PER_WORD] |= 1ULL << (bit % BITS_PER_WORD);
+    }
+
+    freed.clear();
+    flushed.clear();
+    heldBlocks = 0;
+
+    freeExtents.clear();
+    for (int bit = blocksNumber > 0 ? nextFree(0, blocksNumber) : -1; bit != -1; ) {
+        int runEnd = nextUsed(bit, blocksNumber);
+        freeExtents.insert(firstBlockId + bit, runEnd - bit);
+
+        bit = runEnd < blocksNumber ? nextFree(runEnd, blocksNumber) : -1;
+    }
+
+    return verified;
+}
+
+void Bitmap::flush(Journal& journal) {
+    unsigned char block[BLOCK_SIZE];
+
+    for (int b = 0; b < static_cast<int>(dirtyBlocks.size()); b++) {
+        if (!dirtyBlocks[b]) continue;
+
+        for (int w = 0; w < WORDS_PER_BLOCK; w++) {
+            uint64_t word = words[b * WORDS_PER_BLOCK + w];
+            for (int i = 0; i < 8; i++) block[w * 8 + i] = static_cast<unsigned char>(word >> (8 * i));
+        }
+
+        // padding bits are kept zero on the device
+        int lastBit = blocksNumber - b * BLOCK_SIZE * 8;
+        for (int bit = lastBit; bit >= 0 && bit < BLOCK_SIZE * 8; bit++) {
+            block[bit / 8] &= ~(1 << (bit % 8));
+        }
+
+        journal.write(maskBlockId + b, reinterpret_cast<const char*>(block));
+        dirtyBlocks[b] = false;
+    }
+
+    // the runs freed so far are free in the images written
+    flushed.insert(flushed.end(), freed.begin(), freed.end());
+    freed.clear();
+}
+
+void Bitmap::release() {
+    for (size_t r = 0; r < flushed.size(); r++) {
+        heldBlocks -= flushed[r].second;
+
+        // a block may be taken by a repair meanwhile, only clear bits go to the index
+        int first = flushed[r].first - firstBlockId;
+        int end = first + flushed[r].second;
+
+        for (int bit = nextFree(first, end); bit != -1; ) {
+            int runEnd = nextUsed(bit, end);
+            freeExtents.insert(firstBlockId + bit, runEnd - bit);
+
+            bit = runEnd < end ? nextFree(runEnd, end) : -1;
+        }
+    }
+
+    flushed.clear();
+}
+
+void Bitmap::clear() {
+    words.clear();
+    dirtyBlocks.clear();
+    blocksNumber = 0;
+    usedBlocks = 0;
+    hint = 0;
+    freeExtents.clear();
+    freed.clear();
+    flushed.clear();
+    heldBlocks = 0;
+}
+
+bool Bitmap::isUsed(int blockId) const {
+    FS_STAT_ADD(STAT_BITMAP_PROBES, 1);
+
+    int bit = blockId - firstBlockId;
+    return (words[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+void Bitmap::setUsed(int blockId) {
+    int bit = blockId - firstBlockId;
+    uint64_t mask = 1ULL << (bit % BITS_PER_WORD);
+
+    if ((words[bit / BITS_PER_WORD] & mask) == 0) {
+        usedBlocks++;
+        freeExtents.remove(blockId, 1);
+    }
+
+    words[bit / BITS_PER_WORD] |= mask;
+    markDirty(bit);
+}
+
+void Bitmap::setUnused(int blockId) {
+    int bit = blockId - firstBlockId;
+    uint64_t mask = 1ULL << (bit % BITS_PER_WORD);
+
+    if ((words[bit / BITS_PER_WORD] & mask) != 0) {
+        usedBlocks--;
+        heldBlocks++;
+
+        if (!freed.empty() && freed.back().first + freed.back().second == blockId) {
+            freed.back().second++;
+        } else {
+            freed.push_back(make_pair(blockId, 1));
+        }
+    }
+
+    words[bit / BITS_PER_WORD] &= ~mask;
+    markDirty(bit);
+}
+
+int Bitmap::freeBlocks() const {
+    return blocksNumber - usedBlocks - heldBlocks;
+}
+
+int Bitmap::heldBlocksNumber() const {
+    return heldBlocks;
+}
+
+int Bitmap::freeExtentsNumber() const {
+    return freeExtents.extentsNumber();
+}
+
+int Bitmap::findFree() {
+    int length;
+    return findRun(1, -1, length);
+}
+
+int Bitmap::findRun(int wanted, int goal, int& length) {
+    FS_STAT_ADD(STAT_BITMAP_PROBES, 1);
+
+    if (goal < firstBlockId || goal >= firstBlockId + blocksNumber) goal = hint;
+
+    int blockId = freeExtents.find(wanted, goal, length);
+    if (blockId != -1) hint = blockId + length;
+
+    return blockId;
+}
+
+void Bitmap::markDirty(int bit) {
+    dirtyBlocks[bit / (BLOCK_SIZE * 8)] = true;
+}
+
+int Bitmap::nextFree(int bit, int to) const {
+    int w = bit / BITS_PER_WORD;
+
+    // rest of the first word
+    uint64_t freeBits = ~words[w] & (FULL_WORD << (bit % BITS_PER_WORD));
+
+    if (freeBits == 0) {
+        int lastWord = (to + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+        w = findInWords(w + 1, lastWord);
+        if (w == -1) return -1;
+
+        freeBits = ~words[w];
+    }
+
+    int found = w * BITS_PER_WORD + __builtin_ctzll(freeBits);
+    return found < to ? found : -1;
+}
+
+int Bitmap::nextUsed(int bit, int to) const {
+    int w = bit / BITS_PER_WORD;
+    int lastWord = (to + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    uint64_t usedBits = words[w] & (FULL_WORD << (bit % BITS_PER_WORD));
+
+    while (usedBits == 0) {
+        if (++w >= lastWord) return to;
+        usedBits = words[w];
+    }
+
+    int found = w * BITS_PER_WORD + __builtin_ctzll(usedBits);
+    return found < to ? found : to;
+}
+
+// index of the first not full word in [from, to), -1 if all are full
+int Bitmap::findInWords(int from, int to) const {
+    int w = from;
+
+#ifdef __SSE2__
+    // skip two full words per compare
+    const __m128i full = _mm_set1_epi32(-1);
+    for (; w + 1 < to; w += 2) {
+        __m128i pair = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&words[w]));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(pair, full)) != 0xFFFF) break;
+    }
+#endif
+
+    for (; w < to; w++) {
+        if (words[w] != FULL_WORD) return w;
+    }
+
+    return -1;
+}
+
+}       // fs::namespace end
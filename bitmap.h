@@ -0,0 +1,67 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "blockcache.h"
+#include "freeextents.h"
+#include "journal.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace fs {
+
+/**
+ * @brief The Bitmap class keeps the device free-space bitmask in memory,
+ * the bitmask is stored from block maskBlockId on, bit i describes block
+ * (firstBlockId + i), set bit means the block is used. Free runs are also
+ * indexed by offset and size, searches don't scan the bitmask. Freed blocks
+ * are held out of the index, until the transaction, that frees them, is on
+ * the device, so no other file gets them while the old owner may come back
+ * by recovery
+ */
+class Bitmap {
+public:
+    Bitmap();
+
+    // false, if some bitmask blocks are damaged, they are taken as free
+    bool load(BlockCache& cache, int maskBlockId, int firstBlockId, int blocksNumber);
+    void flush(Journal& journal);               // writes dirty bitmask blocks back
+    void release();                             // blocks freed before the last flush may be found again
+    void clear();
+
+    bool isUsed(int blockId) const;
+    void setUsed(int blockId);
+    void setUnused(int blockId);                // the block is held until release()
+    int findFree();                             // next-fit search, -1 if device is full
+    int freeBlocks() const;                     // held blocks aren't counted
+    int heldBlocksNumber() const;
+    int freeExtentsNumber() const;
+
+    // free run of wanted blocks at goal or close after it (after the last
+    // search, if goal is -1), else the best fitting or the longest run;
+    // length is set to the run size, -1 if device is full
+    int findRun(int wanted, int goal, int& length);
+
+private:
+    void markDirty(int bit);
+    int findInWords(int from, int to) const;
+    int nextFree(int bit, int to) const;        // first free bit in [bit, to) or -1
+    int nextUsed(int bit, int to) const;        // first used bit in [bit, to) or to
+
+    std::vector<uint64_t> words;                // bitmask, 64 blocks per word
+    std::vector<bool> dirtyBlocks;              // bitmask blocks changed since flush
+    int maskBlockId;                            // first block of the bitmask
+    int firstBlockId;                           // block described by bit 0
+    int blocksNumber;                           // number of meaningful bits
+    int usedBlocks;                             // set meaningful bits
+    int hint;                                   // block after the last found run
+    FreeExtents freeExtents;                    // runs of clear meaningful bits, but the held ones
+    std::vector<std::pair<int, int> > freed;    // held runs (first block, length) freed since flush
+    std::vector<std::pair<int, int> > flushed;  // held runs, that went with the last flush
+    int heldBlocks;
+};
+
+}       // fs::namespace end
+
+#endif // BITMAP_H
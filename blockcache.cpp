@@ -0,0 +1,451 @@
+#include "blockcache.h"
+#include "checksums.h"
+#include "stats.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace fs {
+
+BlockCache::BlockCache() : device(NULL), checksums(NULL), image(NULL), imageSize(0), capacity(0), writeEpoch(0),
+                           writesInFlight(0) {
+    resetStats();
+}
+
+BlockCache::~BlockCache() {
+    detach();
+}
+
+void BlockCache::attach(BlockDevice* device, int capacity) {
+    detach();
+
+    this->device = device;
+    this->capacity = capacity < 0 ? 0 : capacity;
+
+    // mapped device is as fast as the cache itself
+    image = device->map();
+    imageSize = device->capacity();
+    if (image != NULL) this->capacity = 0;
+
+    int shardsNumber = min(CACHE_SHARDS, this->capacity);
+    for (int i = 0; i < shardsNumber; i++) {
+        Shard* shard = new Shard();
+        shard->capacity = (this->capacity + shardsNumber - 1) / shardsNumber;
+        shard->entries.reserve(shard->capacity);
+        memset(&shard->counters, 0, sizeof(shard->counters));
+        shards.push_back(unique_ptr<Shard>(shard));
+    }
+}
+
+void BlockCache::detach() {
+    if (device == NULL) return;
+
+    sync();
+    shards.clear();
+    device = NULL;
+    checksums = NULL;
+    image = NULL;
+    imageSize = 0;
+    capacity = 0;
+}
+
+bool BlockCache::read(int blockId, char* data, int size, int shift) {
+    FS_STAT_ADD(STAT_BLOCKS_READ, 1);
+
+    long offset = static_cast<long>(blockId) * BLOCK_SIZE + shift;
+    bool part = size != BLOCK_SIZE;
+    char block[BLOCK_SIZE];                     // the whole block of a part, that is verified
+    bool verified = true;
+
+    if (image != NULL && offset + size <= imageSize) {
+        directReads++;
+
+        if (checksums == NULL || offset - shift + BLOCK_SIZE > imageSize) {
+            memcpy(data, &image[offset], size);
+        } else if (part) {
+            verified = checksums->verify(blockId, 1, block, true, &image[offset - shift]);
+            memcpy(data, &block[shift], size);
+        } else {
+            verified = checksums->verify(blockId, 1, data, true, &image[offset]);
+        }
+        return verified;
+    }
+
+    // caching is disabled, go straight to the device
+    if (capacity == 0) {
+        bypassReads++;
+
+        if (checksums == NULL) {
+            device->read(offset, data, size);
+        } else if (part) {
+            device->read(offset - shift, block, BLOCK_SIZE);
+            verified = checksums->verify(blockId, 1, block);
+            memcpy(data, &block[shift], size);
+        } else {
+            device->read(offset, data, size);
+            verified = checksums->verify(blockId, 1, data);
+        }
+        return verified;
+    }
+
+    Shard& shard = shardOf(blockId);
+    lock_guard<mutex> guard(shard.lock);
+
+    bool damaged;
+    Entry* entry = getEntry(shard, blockId, true, damaged);
+    memcpy(data, &entry->data[shift], size);
+
+    // the next read goes to the device again and fails the same way
+    if (damaged) {
+        shard.entries.erase(blockId);
+        shard.lru.pop_front();
+    }
+
+    return !damaged;
+}
+
+void BlockCache::write(int blockId, const char* data, int size, int shift) {
+    FS_STAT_ADD(STAT_BLOCKS_WRITTEN, 1);
+
+    // imaginary block, which isn't presented on the device
+    if (blockId < 0) return;
+
+    long offset = static_cast<long>(blockId) * BLOCK_SIZE + shift;
+
+    if (image != NULL && offset + size <= imageSize) {
+        directWrites++;
+        memcpy(&image[offset], data, size);
+
+        if (checksums != NULL && offset - shift + BLOCK_SIZE <= imageSize) {
+            checksums->seal(blockId, 1, &image[offset - shift]);
+        }
+        return;
+    }
+
+    if (capacity == 0) {
+        bypassWrites++;
+        device->write(offset, data, size);
+
+        // the sum is taken over the whole block
+        if (checksums != NULL && size != BLOCK_SIZE) {
+            char block[BLOCK_SIZE];
+            device->read(offset - shift, block, BLOCK_SIZE);
+            checksums->seal(blockId, 1, block);
+        } else if (checksums != NULL) {
+            checksums->seal(blockId, 1, data);
+        }
+        return;
+    }
+
+    Shard& shard = shardOf(blockId);
+    lock_guard<mutex> guard(shard.lock);
+
+    // the whole block is overwritten, no need to fetch it from the device;
+    // the part is written over the zeros of a damaged block, it was reported
+    bool fetch = size != BLOCK_SIZE;
+    bool damaged;
+
+    Entry* entry = getEntry(shard, blockId, fetch, damaged);
+    memcpy(&entry->data[shift], data, size);
+    entry->dirty = true;
+}
+
+bool BlockCache::readBlocks(int firstBlockId, int count, char* data) {
+    FS_STAT_ADD(STAT_BLOCKS_READ, count);
+
+    long offset = static_cast<long>(firstBlockId) * BLOCK_SIZE;
+
+    vector<bool> cached;
+    bool damaged;
+    if (readCached(firstBlockId, count, data, cached, damaged)) return !damaged;
+
+    // read the rest by runs without polluting the cache
+    for (int i = 0; i < count; ) {
+        if (cached[i]) {
+            i++;
+            continue;
+        }
+
+        int j = i;
+        while (j < count && !cached[j]) j++;
+
+        bypassReads++;
+        device->read(offset + static_cast<long>(i) * BLOCK_SIZE, &data[i * BLOCK_SIZE], (j - i) * BLOCK_SIZE);
+        if (checksums != NULL && !checksums->verify(firstBlockId + i, j - i, &data[i * BLOCK_SIZE])) {
+            damaged = true;
+        }
+        i = j;
+    }
+
+    return !damaged;
+}
+
+bool BlockCache::readCached(int firstBlockId, int count, char* data, vector<bool>& cached, bool& damaged) {
+    long offset = static_cast<long>(firstBlockId) * BLOCK_SIZE;
+    int size = count * BLOCK_SIZE;
+    damaged = false;
+
+    if (image != NULL && offset + size <= imageSize) {
+        directReads++;
+
+        if (checksums == NULL) {
+            memcpy(data, &image[offset], size);
+        } else {
+            damaged = !checksums->verify(firstBlockId, count, data, true, &image[offset]);
+        }
+        cached.assign(count, true);
+        return true;
+    }
+
+    cached.assign(count, false);
+    if (capacity == 0) return false;
+
+    // cached copies are the newest ones, take them first
+    bool all = true;
+    for (int i = 0; i < count; i++) {
+        Shard& shard = shardOf(firstBlockId + i);
+        lock_guard<mutex> guard(shard.lock);
+
+        unordered_map<int, list<Entry>::iterator>::iterator found = shard.entries.find(firstBlockId + i);
+        if (found == shard.entries.end()) {
+            all = false;
+            continue;
+        }
+
+        shard.counters.hits++;
+        memcpy(&data[i * BLOCK_SIZE], found->second->data, BLOCK_SIZE);
+        cached[i] = true;
+    }
+
+    return all;
+}
+
+void BlockCache::writeBlocks(int firstBlockId, int count, const char* data) {
+    FS_STAT_ADD(STAT_BLOCKS_WRITTEN, count);
+
+    if (!writeCached(firstBlockId, count, data)) return;
+
+    bypassWrites++;
+    device->write(static_cast<long>(firstBlockId) * BLOCK_SIZE, data, count * BLOCK_SIZE);
+    writeDone();
+}
+
+bool BlockCache::writeCached(int firstBlockId, int count, const char* data) {
+    long offset = static_cast<long>(firstBlockId) * BLOCK_SIZE;
+    int size = count * BLOCK_SIZE;
+
+    if (checksums != NULL) checksums->seal(firstBlockId, count, data);
+
+    if (image != NULL && offset + size <= imageSize) {
+        directWrites++;
+        memcpy(&image[offset], data, size);
+        return false;
+    }
+
+    writesInFlight++;
+    writeEpoch++;
+
+    // refresh cached copies before the device, so no stale dirty block is written back over it
+    for (int i = 0; i < count && capacity != 0; i++) {
+        Shard& shard = shardOf(firstBlockId + i);
+        lock_guard<mutex> guard(shard.lock);
+
+        unordered_map<int, list<Entry>::iterator>::iterator found = shard.entries.find(firstBlockId + i);
+        if (found == shard.entries.end()) continue;
+
+        memcpy(found->second->data, &data[i * BLOCK_SIZE], BLOCK_SIZE);
+        found->second->dirty = false;
+    }
+
+    return true;
+}
+
+void BlockCache::writeDone() {
+    writeEpoch++;
+    writesInFlight--;
+}
+
+void BlockCache::prefetch(int firstBlockId, int count) {
+    if (device == NULL || count <= 0) return;
+
+    // the device has its own page cache, just give it a hint
+    if (image != NULL || capacity == 0) {
+        device->prefetch(static_cast<long>(firstBlockId) * BLOCK_SIZE, count * BLOCK_SIZE);
+        return;
+    }
+
+    // never push out more than half of the cache
+    count = min(count, max(capacity / 2, 1));
+
+    // skip the cached head of the run
+    while (count > 0) {
+        Shard& shard = shardOf(firstBlockId);
+        lock_guard<mutex> guard(shard.lock);
+
+        if (shard.entries.find(firstBlockId) == shard.entries.end()) break;
+
+        firstBlockId++;
+        count--;
+    }
+    if (count == 0) return;
+
+    // the device is read without locks, a block written meanwhile would be stale;
+    // writers bump the epoch both before and after the device call
+    if (writesInFlight != 0) return;
+    long epoch = writeEpoch;
+
+    vector<char> data(static_cast<size_t>(count) * BLOCK_SIZE);
+    bypassReads++;
+    device->read(static_cast<long>(firstBlockId) * BLOCK_SIZE, data.data(), count * BLOCK_SIZE);
+
+    // damaged blocks aren't cached, their readers get the error
+    if (checksums != NULL && !checksums->verify(firstBlockId, count, data.data())) return;
+
+    for (int i = 0; i < count; i++) {
+        Shard& shard = shardOf(firstBlockId + i);
+        lock_guard<mutex> guard(shard.lock);
+
+        if (writeEpoch != epoch || writesInFlight != 0) return;
+        if (shard.entries.find(firstBlockId + i) != shard.entries.end()) continue;
+
+        if (static_cast<int>(shard.entries.size()) >= shard.capacity) evict(shard);
+        if (writeEpoch != epoch) return;        // evict() could write a dirty block back
+
+        shard.lru.emplace_front();
+        Entry& entry = shard.lru.front();
+        entry.blockId = firstBlockId + i;
+        entry.dirty = false;
+        memcpy(entry.data, &data[i * BLOCK_SIZE], BLOCK_SIZE);
+
+        shard.entries[entry.blockId] = shard.lru.begin();
+        prefetched++;
+    }
+}
+
+void BlockCache::setChecksums(Checksums* checksums) {
+    this->checksums = checksums;
+}
+
+void BlockCache::writeBack() {
+    if (device == NULL) return;
+
+    for (size_t i = 0; i < shards.size(); i++) {
+        Shard& shard = *shards[i];
+        lock_guard<mutex> guard(shard.lock);
+
+        for (list<Entry>::iterator it = shard.lru.begin(); it != shard.lru.end(); it++) {
+            if (it->dirty) flushEntry(shard, *it);
+        }
+    }
+}
+
+void BlockCache::sync() {
+    if (device == NULL) return;
+
+    writeBack();
+    device->sync();
+}
+
+bool BlockCache::verify(int firstBlockId, int count, char* data) {
+    return checksums == NULL || checksums->verify(firstBlockId, count, data);
+}
+
+CacheStats BlockCache::stats() const {
+    CacheStats total;
+    memset(&total, 0, sizeof(total));
+
+    for (size_t i = 0; i < shards.size(); i++) {
+        Shard& shard = *shards[i];
+        lock_guard<mutex> guard(shard.lock);
+
+        total.hits += shard.counters.hits;
+        total.misses += shard.counters.misses;
+        total.evictions += shard.counters.evictions;
+        total.writebacks += shard.counters.writebacks;
+        total.deviceReads += shard.counters.deviceReads;
+        total.deviceWrites += shard.counters.deviceWrites;
+    }
+
+    total.directAccesses = directReads + directWrites;
+    total.misses += bypassReads + bypassWrites;
+    total.deviceReads += bypassReads;
+    total.deviceWrites += bypassWrites;
+    total.prefetched = prefetched;
+
+    return total;
+}
+
+void BlockCache::resetStats() {
+    for (size_t i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        memset(&shards[i]->counters, 0, sizeof(CacheStats));
+    }
+
+    directReads = 0;
+    directWrites = 0;
+    bypassReads = 0;
+    bypassWrites = 0;
+    prefetched = 0;
+}
+
+BlockCache::Shard& BlockCache::shardOf(int blockId) {
+    return *shards[blockId % shards.size()];
+}
+
+BlockCache::Entry* BlockCache::getEntry(Shard& shard, int blockId, bool fetch, bool& damaged) {
+    unordered_map<int, list<Entry>::iterator>::iterator found = shard.entries.find(blockId);
+    damaged = false;
+
+    if (found != shard.entries.end()) {
+        shard.counters.hits++;
+
+        // move block to the head of the lru list
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+        return &*found->second;
+    }
+
+    shard.counters.misses++;
+
+    if (static_cast<int>(shard.entries.size()) >= shard.capacity) evict(shard);
+
+    shard.lru.emplace_front();
+    Entry& entry = shard.lru.front();
+    entry.blockId = blockId;
+    entry.dirty = false;
+
+    if (fetch) {
+        shard.counters.deviceReads++;
+        device->read(static_cast<long>(blockId) * BLOCK_SIZE, entry.data, BLOCK_SIZE);
+        if (checksums != NULL) damaged = !checksums->verify(blockId, 1, entry.data);
+    } else {
+        memset(entry.data, 0, BLOCK_SIZE);
+    }
+
+    shard.entries[blockId] = shard.lru.begin();
+    return &entry;
+}
+
+void BlockCache::evict(Shard& shard) {
+    Entry& victim = shard.lru.back();
+
+    if (victim.dirty) flushEntry(shard, victim);
+
+    shard.counters.evictions++;
+    shard.entries.erase(victim.blockId);
+    shard.lru.pop_back();
+}
+
+void BlockCache::flushEntry(Shard& shard, Entry& entry) {
+    writeEpoch++;
+    shard.counters.deviceWrites++;
+    shard.counters.writebacks++;
+
+    device->write(static_cast<long>(entry.blockId) * BLOCK_SIZE, entry.data, BLOCK_SIZE);
+    entry.dirty = false;
+    writeEpoch++;
+
+    if (checksums != NULL) checksums->seal(entry.blockId, 1, entry.data);
+}
+
+}       // fs::namespace end
@@ -0,0 +1,102 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "blockdevice.h"
+#include "fs.h"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace fs {
+
+const int CACHE_SHARDS = 16;                    // independently locked parts of the cache
+
+class Checksums;
+
+/**
+ * @brief The BlockCache class is a write-back LRU cache of device blocks,
+ * all the block reads and writes of fs go through it. Devices that are
+ * addressable in memory are accessed directly, without caching.
+ * Blocks are spread over shards by id, each shard has its own lock and lru.
+ * Blocks get their checksums sealed, when they are written to the device, and
+ * verified, when they are read from it
+ */
+class BlockCache {
+public:
+    BlockCache();
+    ~BlockCache();
+
+    void attach(BlockDevice* device, int capacity);
+    void detach();                              // flushes dirty blocks and forgets the device
+    void setChecksums(Checksums* checksums);    // NULL - blocks have no checksums
+
+    // reads are false, if a block doesn't match its checksum, it is zeroed and isn't cached
+    bool read(int blockId, char* data, int size = BLOCK_SIZE, int shift = 0);
+    void write(int blockId, const char* data, int size = BLOCK_SIZE, int shift = 0);
+
+    // whole blocks [firstBlockId, firstBlockId + count) with one device call
+    bool readBlocks(int firstBlockId, int count, char* data);
+    void writeBlocks(int firstBlockId, int count, const char* data);
+
+    // parts of readBlocks/writeBlocks for callers, that transfer the rest themselves:
+    // readCached copies the cached blocks and marks them, true if nothing is left to read,
+    // damaged is set, if a block copied doesn't match its checksum;
+    // writeCached refreshes cached copies, false if the write is already done in memory,
+    // else the device write must be followed by writeDone()
+    bool readCached(int firstBlockId, int count, char* data, std::vector<bool>& cached, bool& damaged);
+    bool writeCached(int firstBlockId, int count, const char* data);
+    void writeDone();
+    // reads blocks into the cache ahead of use, blocks already cached are kept
+    void prefetch(int firstBlockId, int count);
+    void writeBack();                           // writes all dirty blocks to the device
+    void sync();                                // writes them and waits for the device
+    // blocks read from the device around the cache, by the engine; false, if some are damaged
+    bool verify(int firstBlockId, int count, char* data);
+
+    CacheStats stats() const;
+    void resetStats();
+
+private:
+    struct Entry {
+        int blockId;
+        bool dirty;
+        char data[BLOCK_SIZE];
+    };
+
+    struct Shard {
+        std::mutex lock;
+        int capacity;                           // max number of cached blocks
+        std::list<Entry> lru;                   // most recently used block first
+        std::unordered_map<int, std::list<Entry>::iterator> entries;
+        CacheStats counters;
+    };
+
+    Shard& shardOf(int blockId);
+    // damaged is set, if the block fetched doesn't match its checksum
+    Entry* getEntry(Shard& shard, int blockId, bool fetch, bool& damaged);
+    void evict(Shard& shard);
+    void flushEntry(Shard& shard, Entry& entry);
+
+    BlockDevice* device;
+    Checksums* checksums;
+    char* image;                                // mapped device memory or NULL
+    long imageSize;
+    int capacity;                               // max number of cached blocks
+
+    std::vector<std::unique_ptr<Shard> > shards;
+    std::atomic<long> directReads;              // accesses of the mapped device
+    std::atomic<long> directWrites;
+    std::atomic<long> bypassReads;              // device calls, that bypass the cache
+    std::atomic<long> bypassWrites;
+    std::atomic<long> prefetched;
+    std::atomic<long> writeEpoch;               // changes with every device write
+    std::atomic<int> writesInFlight;            // device writes started by writeCached()
+};
+
+}       // fs::namespace end
+
+#endif // BLOCKCACHE_H
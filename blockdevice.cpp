@@ -0,0 +1,176 @@
+#include "blockdevice.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace fs {
+
+// copies [offset, offset + size) out of memory image, zeros past its end
+static bool readImage(const char* image, long length, long offset, char* data, int size) {
+    if (offset < 0) return false;
+
+    long available = offset < length ? min<long>(size, length - offset) : 0;
+    if (available > 0) memcpy(data, &image[offset], available);
+    if (available < size) memset(&data[available], 0, size - available);
+
+    return true;
+}
+
+static bool writeImage(char* image, long length, long offset, const char* data, int size) {
+    if (offset < 0 || offset + size > length) return false;
+
+    memcpy(&image[offset], data, size);
+    return true;
+}
+
+FileDevice::FileDevice() : fd(-1), length(0) {}
+
+FileDevice::~FileDevice() {
+    if (fd != -1) ::close(fd);
+}
+
+bool FileDevice::open(const char* fileName) {
+    fd = ::open(fileName, O_RDWR);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) return false;
+
+    length = st.st_size;
+    return true;
+}
+
+bool FileDevice::read(long offset, char* data, int size) {
+    int done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(fd, &data[done], size - done, offset + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+
+    // read past the end of the device
+    if (done < size) memset(&data[done], 0, size - done);
+
+    return offset >= 0;
+}
+
+bool FileDevice::write(long offset, const char* data, int size) {
+    int done = 0;
+
+    while (done < size) {
+        ssize_t n = pwrite(fd, &data[done], size - done, offset + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+
+    long end = offset + size;
+    long old = length;
+    while (end > old && !length.compare_exchange_weak(old, end)) {}
+
+    return true;
+}
+
+long FileDevice::capacity() const {
+    return length;
+}
+
+void FileDevice::sync() {
+    fdatasync(fd);
+}
+
+void FileDevice::prefetch(long offset, int size) {
+    posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+}
+
+int FileDevice::descriptor() const {
+    return fd;
+}
+
+MmapDevice::MmapDevice() : fd(-1), image(NULL), length(0) {}
+
+MmapDevice::~MmapDevice() {
+    if (image != NULL) {
+        msync(image, length, MS_SYNC);
+        munmap(image, length);
+    }
+
+    if (fd != -1) ::close(fd);
+}
+
+bool MmapDevice::open(const char* fileName) {
+    fd = ::open(fileName, O_RDWR);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) return false;
+    length = st.st_size;
+
+    void* addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) return false;
+
+    image = static_cast<char*>(addr);
+    return true;
+}
+
+bool MmapDevice::read(long offset, char* data, int size) {
+    return readImage(image, length, offset, data, size);
+}
+
+bool MmapDevice::write(long offset, const char* data, int size) {
+    return writeImage(image, length, offset, data, size);
+}
+
+long MmapDevice::capacity() const {
+    return length;
+}
+
+void MmapDevice::sync() {
+    if (image != NULL) msync(image, length, MS_SYNC);
+}
+
+char* MmapDevice::map() {
+    return image;
+}
+
+void MmapDevice::prefetch(long offset, int size) {
+    if (image == NULL || offset >= length) return;
+
+    // madvise wants the range to start at a page
+    long page = sysconf(_SC_PAGESIZE);
+    long start = offset / page * page;
+    long end = min(offset + size, length);
+
+    madvise(image + start, end - start, MADV_WILLNEED);
+}
+
+RamDevice::RamDevice(long capacity) : image(capacity, 0) {}
+
+bool RamDevice::read(long offset, char* data, int size) {
+    return readImage(image.data(), image.size(), offset, data, size);
+}
+
+bool RamDevice::write(long offset, const char* data, int size) {
+    return writeImage(image.data(), image.size(), offset, data, size);
+}
+
+long RamDevice::capacity() const {
+    return image.size();
+}
+
+void RamDevice::sync() {}
+
+char* RamDevice::map() {
+    return image.data();
+}
+
+}       // fs::namespace end
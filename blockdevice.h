@@ -0,0 +1,98 @@
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace fs {
+
+/**
+ * @brief The BlockDevice class describes storage a file system is mounted on,
+ * read() and write() are positional and may be called from several threads
+ */
+class BlockDevice {
+public:
+    virtual ~BlockDevice() {}
+
+    // bytes past the end of the device are read as zeros
+    virtual bool read(long offset, char* data, int size) = 0;
+    virtual bool write(long offset, const char* data, int size) = 0;
+    virtual long capacity() const = 0;
+    virtual void sync() = 0;
+
+    // memory the whole device is addressable through, NULL if there is none
+    virtual char* map() { return NULL; }
+
+    // hint, that the range is going to be read soon
+    virtual void prefetch(long, int) {}
+
+    // file descriptor for asynchronous I/O on the device, -1 if there is none
+    virtual int descriptor() const { return -1; }
+};
+
+/**
+ * @brief The FileDevice class is a device on top of a regular file, accessed with pread/pwrite
+ */
+class FileDevice : public BlockDevice {
+public:
+    FileDevice();
+    ~FileDevice();
+
+    bool open(const char* fileName);
+
+    bool read(long offset, char* data, int size);
+    bool write(long offset, const char* data, int size);
+    long capacity() const;
+    void sync();
+    void prefetch(long offset, int size);       // posix_fadvise(2) of the range
+    int descriptor() const;
+
+private:
+    int fd;
+    std::atomic<long> length;
+};
+
+/**
+ * @brief The MmapDevice class is a device on top of a regular file mapped with mmap(2)
+ */
+class MmapDevice : public BlockDevice {
+public:
+    MmapDevice();
+    ~MmapDevice();
+
+    bool open(const char* fileName);
+
+    bool read(long offset, char* data, int size);
+    bool write(long offset, const char* data, int size);
+    long capacity() const;
+    void sync();                                // msync(2) of the whole image
+    char* map();
+    void prefetch(long offset, int size);       // madvise(2) of the range
+
+private:
+    int fd;
+    char* image;
+    long length;
+};
+
+/**
+ * @brief The RamDevice class is a device that lives in memory only
+ */
+class RamDevice : public BlockDevice {
+public:
+    explicit RamDevice(long capacity);
+
+    bool read(long offset, char* data, int size);
+    bool write(long offset, const char* data, int size);
+    long capacity() const;
+    void sync();
+    char* map();
+
+private:
+    std::vector<char> image;
+};
+
+}       // fs::namespace end
+
+#endif // BLOCKDEVICE_H
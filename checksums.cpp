@@ -0,0 +1,464 @@
+#include "checksums.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define FS_CRC32C_SSE42
+#endif
+
+using namespace std;
+
+namespace fs {
+
+const unsigned POLYNOMIAL = 0x82f63b78u;        // Castagnoli polynomial, bits reversed
+const int VERIFY_BATCH = 64;                    // blocks summed by one call
+
+static inline uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief The SumTables struct keeps the tables of the software CRC, 8 bytes
+ * are taken at once (slicing by 8): table[k][b] is the sum of byte b followed
+ * by k zero bytes
+ */
+struct SumTables {
+    SumTables() {
+        for (unsigned b = 0; b < 256; b++) {
+            unsigned crc = b;
+            for (int bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+            table[0][b] = crc;
+        }
+
+        for (int k = 1; k < 8; k++) {
+            for (int b = 0; b < 256; b++) table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    }
+
+    unsigned table[8][256];
+};
+
+static const SumTables tables;
+
+static unsigned updateTables(unsigned crc, const unsigned char* p, int size) {
+    const unsigned (*t)[256] = tables.table;
+
+    for (; size >= 8; size -= 8, p += 8) {
+        uint32_t low = read32(p) ^ crc;
+        uint32_t high = read32(p + 4);
+
+        crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24]
+            ^ t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+    }
+
+    for (; size > 0; size--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+/**
+ * @brief The ShiftTable struct moves a raw sum over a run of zero bytes, so
+ * sums of parts of a block are combined: sum(a + b) = shift(sum(a), |b|) ^ sum(b),
+ * when b is summed from 0. The shift is linear, a byte of the sum takes one table
+ */
+struct ShiftTable {
+    explicit ShiftTable(int bytes) {
+        unsigned bits[32];
+
+        for (int bit = 0; bit < 32; bit++) {
+            unsigned crc = 1u << bit;
+            for (int i = 0; i < bytes; i++) crc = (crc >> 8) ^ tables.table[0][crc & 0xff];
+            bits[bit] = crc;
+        }
+
+        for (int k = 0; k < 4; k++) {
+            for (int b = 0; b < 256; b++) {
+                table[k][b] = 0;
+                for (int bit = 0; bit < 8; bit++) {
+                    if (b & (1 << bit)) table[k][b] ^= bits[k * 8 + bit];
+                }
+            }
+        }
+    }
+
+    unsigned shift(unsigned crc) const {
+        return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+    }
+
+    unsigned table[4][256];
+};
+
+#ifdef FS_CRC32C_SSE42
+
+// may be called by static constructors, before the CPU model is taken by the runtime
+static bool detectHardware() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static const bool hardware = detectHardware();
+
+// the instruction has a latency of 3 cycles, a block is summed by three independent
+// parts to keep it busy, the last one takes the rest of the block
+const int PART_BYTES = BLOCK_SIZE / 8 / 3 * 8;
+const int LAST_BYTES = BLOCK_SIZE - 2 * PART_BYTES;
+
+static const ShiftTable overTwo(BLOCK_SIZE - PART_BYTES);
+static const ShiftTable overLast(LAST_BYTES);
+
+__attribute__((target("sse4.2")))
+static unsigned updateHardware(unsigned crc, const unsigned char* p, int size) {
+    uint64_t wide = crc;
+    for (; size >= 8; size -= 8, p += 8) wide = _mm_crc32_u64(wide, read64(p));
+
+    crc = static_cast<unsigned>(wide);
+    for (; size > 0; size--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+// to - the block is copied there, while it is summed
+__attribute__((target("sse4.2")))
+static unsigned blockHardware(const unsigned char* p, unsigned char* to) {
+    uint64_t a = 0xffffffffu, b = 0, c = 0;
+    int j = 0;
+
+    if (to == NULL) {
+        for (; j < PART_BYTES; j += 8) {
+            a = _mm_crc32_u64(a, read64(p + j));
+            b = _mm_crc32_u64(b, read64(p + PART_BYTES + j));
+            c = _mm_crc32_u64(c, read64(p + 2 * PART_BYTES + j));
+        }
+        for (; j < LAST_BYTES; j += 8) c = _mm_crc32_u64(c, read64(p + 2 * PART_BYTES + j));
+    } else {
+        for (; j < PART_BYTES; j += 8) {
+            uint64_t first = read64(p + j);
+            uint64_t second = read64(p + PART_BYTES + j);
+            uint64_t third = read64(p + 2 * PART_BYTES + j);
+
+            a = _mm_crc32_u64(a, first);
+            b = _mm_crc32_u64(b, second);
+            c = _mm_crc32_u64(c, third);
+
+            memcpy(to + j, &first, 8);
+            memcpy(to + PART_BYTES + j, &second, 8);
+            memcpy(to + 2 * PART_BYTES + j, &third, 8);
+        }
+        for (; j < LAST_BYTES; j += 8) {
+            uint64_t third = read64(p + 2 * PART_BYTES + j);
+            c = _mm_crc32_u64(c, third);
+            memcpy(to + 2 * PART_BYTES + j, &third, 8);
+        }
+    }
+
+    return ~(overTwo.shift(static_cast<unsigned>(a)) ^ overLast.shift(static_cast<unsigned>(b)) ^ static_cast<unsigned>(c));
+}
+
+#else
+
+static const bool hardware = false;
+
+#endif
+
+unsigned crc32c(const char* data, int size, unsigned sum) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+#ifdef FS_CRC32C_SSE42
+    if (hardware) return ~updateHardware(~sum, p, size);
+#endif
+    return ~updateTables(~sum, p, size);
+}
+
+void crc32cBlocks(const char* data, int count, unsigned* sums, char* to) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+
+#ifdef FS_CRC32C_SSE42
+    if (hardware) {
+        unsigned char* copy = reinterpret_cast<unsigned char*>(to);
+        for (int i = 0; i < count; i++) {
+            long offset = static_cast<long>(i) * BLOCK_SIZE;
+            sums[i] = blockHardware(&p[offset], copy != NULL ? &copy[offset] : NULL);
+        }
+        return;
+    }
+#endif
+    if (to != NULL) memcpy(to, data, static_cast<size_t>(count) * BLOCK_SIZE);
+    for (int i = 0; i < count; i++) sums[i] = ~updateTables(~0u, &p[static_cast<long>(i) * BLOCK_SIZE], BLOCK_SIZE);
+}
+
+bool crc32cHardware() {
+    return hardware;
+}
+
+// 0 is kept for blocks without a sum
+static unsigned entryOf(unsigned sum, bool metadata) {
+    sum &= ~SUM_METADATA;
+    if (sum == 0) sum = 1;
+
+    return metadata ? sum | SUM_METADATA : sum;
+}
+
+Checksums::Checksums() : tableBlockId(0), firstBlockId(0), blocksNumber(0), unverified(false) {}
+
+void Checksums::load(BlockCache& cache, int tableBlockId, int firstBlockId, int blocksNumber) {
+    lock_guard<mutex> guard(lock);
+
+    this->tableBlockId = tableBlockId;
+    this->firstBlockId = firstBlockId;
+    this->blocksNumber = blocksNumber;
+
+    int tableBlocks = (blocksNumber + SUMS_PER_BLOCK - 1) / SUMS_PER_BLOCK;
+
+    sums.assign(static_cast<long>(tableBlocks) * SUMS_PER_BLOCK, 0);
+    dirtyBlocks.assign(tableBlocks, false);
+    pending.clear();
+    checked = vector<atomic<unsigned long> >((blocksNumber + 63) / 64);
+
+    if (tableBlocks > 0) cache.readBlocks(tableBlockId, tableBlocks, reinterpret_cast<char*>(sums.data()));
+    sums.resize(blocksNumber);
+
+    // the table can't keep its own sums
+    excluded.clear();
+    excluded.push_back(make_pair(tableBlockId, tableBlocks));
+}
+
+void Checksums::exclude(int firstBlockId, int count) {
+    lock_guard<mutex> guard(lock);
+    excluded.push_back(make_pair(firstBlockId, count));
+}
+
+void Checksums::flush(Journal& journal) {
+    vector<pair<int, vector<char> > > blocks;
+
+    // the journal is written without the lock, readers of the device take it under journal's one
+    {
+        lock_guard<mutex> guard(lock);
+
+        for (int b = 0; b < static_cast<int>(dirtyBlocks.size()); b++) {
+            if (!dirtyBlocks[b]) continue;
+
+            // entries past the end of the device are kept zero
+            long first = static_cast<long>(b) * SUMS_PER_BLOCK;
+            long count = min(static_cast<long>(SUMS_PER_BLOCK), blocksNumber - first);
+
+            vector<char> block(BLOCK_SIZE, 0);
+            memcpy(block.data(), &sums[first], count * sizeof(unsigned));
+
+            blocks.push_back(make_pair(tableBlockId + b, move(block)));
+            dirtyBlocks[b] = false;
+        }
+    }
+
+    for (size_t i = 0; i < blocks.size(); i++) journal.write(blocks[i].first, blocks[i].second.data());
+}
+
+void Checksums::clear() {
+    lock_guard<mutex> guard(lock);
+
+    sums.clear();
+    dirtyBlocks.clear();
+    pending.clear();
+    checked.clear();
+    excluded.clear();
+    blocksNumber = 0;
+    unverified = false;
+}
+
+void Checksums::setUnverified(bool unverified) {
+    lock_guard<mutex> guard(lock);
+    this->unverified = unverified;
+}
+
+void Checksums::sealImage(int blockId, const char* data) {
+    if (blocksNumber == 0) return;
+
+    unsigned sum = entryOf(crc32c(data, BLOCK_SIZE), true);
+
+    lock_guard<mutex> guard(lock);
+    if (!covered(blockId)) return;
+
+    int i = blockId - firstBlockId;
+    if (sums[i] != sum) {
+        sums[i] = sum;
+        markDirty(i);
+    }
+
+    pending[blockId] = sum;
+}
+
+void Checksums::seal(int firstBlockId, int count, const char* data) {
+    if (blocksNumber == 0) return;
+
+    unsigned batch[VERIFY_BATCH];
+
+    for (int done = 0; done < count; done += VERIFY_BATCH) {
+        int size = min(VERIFY_BATCH, count - done);
+        crc32cBlocks(&data[static_cast<long>(done) * BLOCK_SIZE], size, batch);
+
+        lock_guard<mutex> guard(lock);
+
+        for (int j = 0; j < size; j++) {
+            int blockId = firstBlockId + done + j;
+            if (!covered(blockId)) continue;
+
+            int i = blockId - this->firstBlockId;
+            unsigned sum = entryOf(batch[j], false);
+
+            // the journal writes home an image of metadata, the sum of the newest one is kept
+            if (sums[i] & SUM_METADATA) {
+                unordered_map<int, unsigned>::iterator it = pending.find(blockId);
+                if (it != pending.end()) {
+                    if ((it->second & ~SUM_METADATA) == sum) pending.erase(it);
+                    continue;
+                }
+
+                if ((sums[i] & ~SUM_METADATA) == sum) continue;
+            }
+
+            if (sums[i] != sum) {
+                sums[i] = sum;
+                markDirty(i);
+            }
+            setChecked(i);
+        }
+    }
+}
+
+void Checksums::forget(int firstBlockId, int count) {
+    if (blocksNumber == 0) return;
+
+    lock_guard<mutex> guard(lock);
+
+    for (int blockId = firstBlockId; blockId < firstBlockId + count; blockId++) {
+        if (!covered(blockId)) continue;
+
+        int i = blockId - this->firstBlockId;
+        if (sums[i] != 0) {
+            sums[i] = 0;
+            markDirty(i);
+        }
+
+        if (!pending.empty()) pending.erase(blockId);
+    }
+}
+
+bool Checksums::verify(int firstBlockId, int count, char* data, bool once, const char* from) {
+    if (blocksNumber == 0) {
+        if (from != NULL) memcpy(data, from, static_cast<size_t>(count) * BLOCK_SIZE);
+        return true;
+    }
+
+    unsigned batch[VERIFY_BATCH];
+    vector<int> damaged;
+
+    for (int done = 0; done < count; done += VERIFY_BATCH) {
+        int size = min(VERIFY_BATCH, count - done);
+        int first = firstBlockId + done - this->firstBlockId;
+        long offset = static_cast<long>(done) * BLOCK_SIZE;
+
+        // blocks of a mapped device stay as they were verified
+        if (once) {
+            bool all = true;
+            for (int j = 0; j < size && all; j++) {
+                all = first + j < 0 || first + j >= blocksNumber || isChecked(first + j);
+            }
+            if (all) {
+                if (from != NULL) memcpy(&data[offset], &from[offset], size * BLOCK_SIZE);
+                continue;
+            }
+        }
+
+        if (from != NULL) {
+            crc32cBlocks(&from[offset], size, batch, &data[offset]);
+        } else {
+            crc32cBlocks(&data[offset], size, batch);
+        }
+
+        lock_guard<mutex> guard(lock);
+
+        for (int j = 0; j < size; j++) {
+            int blockId = firstBlockId + done + j;
+            if (!covered(blockId)) continue;
+
+            int i = blockId - this->firstBlockId;
+            unsigned sum = entryOf(batch[j], false);
+            FS_STAT_ADD(STAT_BLOCKS_VERIFIED, 1);
+
+            // the device has an older image, than the one sealed
+            bool home = (sums[i] & SUM_METADATA) == 0 || pending.empty() || pending.count(blockId) == 0;
+
+            if (sums[i] == 0 || !home || (sums[i] & ~SUM_METADATA) == sum) {
+                setChecked(i);
+            } else {
+                damaged.push_back(blockId);
+                memset(&data[offset + static_cast<long>(j) * BLOCK_SIZE], 0, BLOCK_SIZE);
+            }
+        }
+    }
+
+    // file data written just before a crash can't be told from a damaged one, fsck decides
+    for (size_t i = 0; i < damaged.size(); i++) {
+        cout << "Error: block " << damaged[i] << " is damaged, it doesn't match its checksum"
+             << (unverified ? ", run fsck after the crash" : "") << endl;
+    }
+    FS_STAT_ADD(STAT_CHECKSUM_ERRORS, damaged.size());
+
+    return damaged.empty();
+}
+
+bool Checksums::matches(int blockId, unsigned sum, bool& metadata) const {
+    lock_guard<mutex> guard(lock);
+
+    metadata = false;
+    if (!covered(blockId)) return true;
+
+    unsigned entry = sums[blockId - firstBlockId];
+    metadata = (entry & SUM_METADATA) != 0;
+
+    if (entry == 0 || (metadata && pending.count(blockId) != 0)) return true;
+    return (entry & ~SUM_METADATA) == entryOf(sum, false);
+}
+
+void Checksums::reseal(int blockId, unsigned sum) {
+    lock_guard<mutex> guard(lock);
+    if (!covered(blockId)) return;
+
+    int i = blockId - firstBlockId;
+    sums[i] = entryOf(sum, (sums[i] & SUM_METADATA) != 0);
+    markDirty(i);
+    FS_STAT_ADD(STAT_CHECKSUMS_RESEALED, 1);
+}
+
+bool Checksums::covered(int blockId) const {
+    if (blockId < firstBlockId || blockId >= firstBlockId + blocksNumber) return false;
+
+    for (size_t i = 0; i < excluded.size(); i++) {
+        if (blockId >= excluded[i].first && blockId < excluded[i].first + excluded[i].second) return false;
+    }
+
+    return true;
+}
+
+bool Checksums::isChecked(int index) const {
+    return (checked[index / 64].load(memory_order_relaxed) >> (index % 64)) & 1;
+}
+
+void Checksums::setChecked(int index) {
+    if (!isChecked(index)) checked[index / 64].fetch_or(1UL << (index % 64), memory_order_relaxed);
+}
+
+void Checksums::markDirty(int index) {
+    dirtyBlocks[index / SUMS_PER_BLOCK] = true;
+}
+
+}       // fs::namespace end
@@ -0,0 +1,78 @@
+#ifndef CHECKSUMS_H
+#define CHECKSUMS_H
+
+#include "blockcache.h"
+#include "journal.h"
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fs {
+
+const int SUMS_PER_BLOCK = BLOCK_SIZE / sizeof(unsigned);
+const unsigned SUM_METADATA = 0x80000000u;      // the block is sealed by a journal commit
+
+// CRC32C (Castagnoli) by the SSE4.2 crc32 instruction, if the CPU has it, by tables otherwise;
+// sum of the preceding bytes is continued
+unsigned crc32c(const char* data, int size, unsigned sum = 0);
+// sums of count whole blocks; to - the blocks are copied there, while they are summed
+void crc32cBlocks(const char* data, int count, unsigned* sums, char* to = NULL);
+bool crc32cHardware();
+
+/**
+ * @brief The Checksums class keeps the device table of block checksums in memory,
+ * the table is stored from block tableBlockId on, entry i holds 31 bits of the
+ * CRC32C of block (firstBlockId + i) and SUM_METADATA, 0 if the block has no sum.
+ * Metadata is sealed by the images of a transaction and is committed with them,
+ * its sum runs ahead of the device until the journal writes the image home
+ * (pending). File data is sealed, when the block cache writes it to the device.
+ * Blocks are verified, when they are read from the device; blocks of a mapped
+ * device are verified once, as they are copied out of the mapping. After a crash file data may
+ * be newer than its committed sum, such blocks are reported like damaged ones
+ * and fsck reseals them
+ */
+class Checksums {
+public:
+    Checksums();
+
+    void load(BlockCache& cache, int tableBlockId, int firstBlockId, int blocksNumber);
+    void exclude(int firstBlockId, int count);  // blocks, that have no sums, the journal log
+    void flush(Journal& journal);               // writes dirty table blocks back
+    void clear();
+    void setUnverified(bool unverified);        // file data may be newer than its sums, fsck is due
+
+    void sealImage(int blockId, const char* data);              // metadata committed by the journal
+    void seal(int firstBlockId, int count, const char* data);   // blocks written to the device
+    void forget(int firstBlockId, int count);   // blocks are freed
+    // blocks read from the device, damaged ones are reported and zeroed; once - blocks
+    // verified before are skipped, from - the blocks are copied to data, while they are summed
+    bool verify(int firstBlockId, int count, char* data, bool once = false, const char* from = NULL);
+
+    // fsck: true for blocks without a sum, metadata tells the kind of the block
+    bool matches(int blockId, unsigned sum, bool& metadata) const;
+    void reseal(int blockId, unsigned sum);     // damaged block is taken as it is
+
+private:
+    bool covered(int blockId) const;
+    bool isChecked(int index) const;
+    void setChecked(int index);
+    void markDirty(int index);
+
+    std::vector<unsigned> sums;                 // entries by block, from firstBlockId on
+    std::vector<bool> dirtyBlocks;              // table blocks changed since flush
+    std::unordered_map<int, unsigned> pending;  // metadata entries, whose images aren't home yet
+    std::vector<std::atomic<unsigned long> > checked;   // blocks verified since load, 64 per word
+    std::vector<std::pair<int, int> > excluded; // first block and count
+    int tableBlockId;                           // first block of the table
+    int firstBlockId;                           // block described by entry 0
+    int blocksNumber;                           // 0 - the device has no sums
+    bool unverified;
+    mutable std::mutex lock;                    // guards everything, but checked
+};
+
+}       // fs::namespace end
+
+#endif // CHECKSUMS_H
@@ -0,0 +1,211 @@
+#include "compression.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace fs {
+
+const int MIN_MATCH = 4;
+const int HASH_BITS = 12;                       // positions kept by the compressor
+const int LAST_LITERALS = 5;                    // the stream ends with literals
+const int MATCH_LIMIT = 12;                     // no match starts closer to the end
+const int MAX_LENGTH = 1 << 24;                 // longer ones are from a damaged stream
+
+static inline uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline unsigned hash4(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline void copy16(unsigned char* dst, const unsigned char* src) {
+#ifdef __SSE2__
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+#else
+    memcpy(dst, src, 16);
+#endif
+}
+
+// copies by 16 bytes, so up to 15 bytes past dst + length are written and past src + length are read
+static inline void wildCopy(unsigned char* dst, const unsigned char* src, int length) {
+    unsigned char* end = dst + length;
+
+    while (dst < end) {
+        copy16(dst, src);
+        dst += 16;
+        src += 16;
+    }
+}
+
+// lengths of 15 and more go on in bytes of 255
+static void putLength(unsigned char*& op, int length) {
+    for (; length >= 255; length -= 255) *op++ = 255;
+    *op++ = length;
+}
+
+static bool getLength(const unsigned char*& ip, const unsigned char* iend, int& length) {
+    unsigned char byte;
+
+    do {
+        if (ip >= iend || length > MAX_LENGTH) return false;
+
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+// writes a sequence, false if there is no space for it
+static bool putSequence(unsigned char*& op, const unsigned char* oend, const unsigned char* literals,
+                        int literalsNumber, int offset, int matchLength) {
+    int space = 1 + literalsNumber / 255 + 1 + literalsNumber + 2 + matchLength / 255 + 1;
+    if (space > oend - op) return false;
+
+    unsigned char* token = op++;
+    *token = min(literalsNumber, 15) << 4;
+
+    if (literalsNumber >= 15) putLength(op, literalsNumber - 15);
+    memcpy(op, literals, literalsNumber);
+    op += literalsNumber;
+
+    // the last sequence has no match
+    if (offset == 0) return true;
+
+    *token |= min(matchLength, 15);
+    *op++ = offset & 255;
+    *op++ = offset >> 8;
+
+    if (matchLength >= 15) putLength(op, matchLength - 15);
+    return true;
+}
+
+int lzCompress(const char* src, int size, char* dst, int capacity) {
+    const unsigned char* base = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* iend = base + size;
+    const unsigned char* anchor = base;             // the first literal, that isn't written yet
+    unsigned char* op = reinterpret_cast<unsigned char*>(dst);
+    const unsigned char* oend = op + capacity;
+
+    uint16_t table[1 << HASH_BITS] = {0};           // last positions by hash of 4 bytes
+
+    if (size > MATCH_LIMIT) {
+        const unsigned char* ip = base + 1;
+        const unsigned char* matchLimit = iend - MATCH_LIMIT;
+        const unsigned char* extendLimit = iend - LAST_LITERALS;
+        int misses = 0;
+
+        while (ip <= matchLimit) {
+            unsigned hash = hash4(read32(ip));
+            const unsigned char* match = base + table[hash];
+            table[hash] = ip - base;
+
+            // incompressible data is skipped faster and faster
+            if (match >= ip || read32(match) != read32(ip)) {
+                ip += 1 + (misses++ >> 5);
+                continue;
+            }
+
+            misses = 0;
+            while (ip > anchor && match > base && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+
+            // 8 bytes are compared at once, the difference is found by bytes
+            const unsigned char* end = ip + MIN_MATCH;
+            const unsigned char* matchEnd = match + MIN_MATCH;
+
+            while (end + 8 <= extendLimit && read64(end) == read64(matchEnd)) {
+                end += 8;
+                matchEnd += 8;
+            }
+
+            while (end < extendLimit && *end == *matchEnd) {
+                end++;
+                matchEnd++;
+            }
+
+            if (!putSequence(op, oend, anchor, ip - anchor, ip - match, end - ip - MIN_MATCH)) return 0;
+
+            ip = end;
+            anchor = ip;
+            if (ip <= matchLimit) table[hash4(read32(ip - 2))] = ip - 2 - base;
+        }
+    }
+
+    if (!putSequence(op, oend, anchor, iend - anchor, 0, 0)) return 0;
+
+    return op - reinterpret_cast<unsigned char*>(dst);
+}
+
+bool lzDecompress(const char* src, int srcSize, char* dst, int size) {
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* iend = ip + srcSize;
+    unsigned char* first = reinterpret_cast<unsigned char*>(dst);
+    unsigned char* op = first;
+    unsigned char* oend = op + size;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        int literals = token >> 4;
+        if (literals == 15 && !getLength(ip, iend, literals)) return false;
+        if (literals > iend - ip || literals > oend - op) return false;
+
+        // whole 16 bytes registers are moved, while both buffers have room for them
+        if (literals + 15 <= iend - ip && literals + 15 <= oend - op) {
+            wildCopy(op, ip, literals);
+        } else {
+            memcpy(op, ip, literals);
+        }
+
+        op += literals;
+        ip += literals;
+
+        // the last sequence has no match
+        if (ip == iend) break;
+        if (iend - ip < 2) return false;
+
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - first) return false;
+
+        int length = token & 15;
+        if (length == 15 && !getLength(ip, iend, length)) return false;
+        length += MIN_MATCH;
+        if (length > oend - op) return false;
+
+        const unsigned char* match = op - offset;
+
+        if (offset >= 16 && length + 15 <= oend - op) {
+            // every 16 bytes read are written already
+            wildCopy(op, match, length);
+        } else if (offset == 1) {
+            memset(op, *match, length);
+        } else {
+            for (int i = 0; i < length; i++) op[i] = match[i];
+        }
+
+        op += length;
+    }
+
+    return op == oend;
+}
+
+}       // fs::namespace end
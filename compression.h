@@ -0,0 +1,28 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include "fs.h"
+
+namespace fs {
+
+const int CLUSTER_BLOCKS = 16;                  // file blocks compressed together
+const int CLUSTER_SIZE = CLUSTER_BLOCKS * BLOCK_SIZE;
+const int CLUSTER_HEADER = sizeof(int);         // a compressed cluster starts with the stream size
+
+/*
+ * LZ codec of the file clusters, an LZ4-like block format: a sequence is a token
+ * (literals number in the high 4 bits, match length - MIN_MATCH in the low ones,
+ * 15 - the number goes on in the next bytes, 255 each), the literals and the
+ * 2 bytes offset of the match back in the output. The last sequence has no match.
+ */
+
+// compressed size of src in dst or 0, if it doesn't fit into capacity bytes;
+// size is up to 64 KB
+int lzCompress(const char* src, int size, char* dst, int capacity);
+
+// false, if src isn't a stream of exactly size bytes
+bool lzDecompress(const char* src, int srcSize, char* dst, int size);
+
+}       // fs::namespace end
+
+#endif // COMPRESSION_H
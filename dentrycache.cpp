@@ -0,0 +1,91 @@
+#include "dentrycache.h"
+
+using namespace std;
+
+namespace fs {
+
+DentryCache::DentryCache() : capacity(0), invalidations(0) {
+}
+
+void DentryCache::setCapacity(int capacity) {
+    lock_guard<mutex> guard(lock);
+
+    this->capacity = capacity < 0 ? 0 : capacity;
+    while (static_cast<int>(lru.size()) > this->capacity) erase(entries.find(lru.back().key));
+}
+
+bool DentryCache::lookup(int dirId, const string& name, Dentry& dentry) {
+    lock_guard<mutex> guard(lock);
+
+    map<Key, list<Entry>::iterator>::iterator it = entries.find(Key(dirId, name));
+    if (it == entries.end()) return false;
+
+    // move to the front of lru
+    lru.splice(lru.begin(), lru, it->second);
+
+    dentry = it->second->dentry;
+    return true;
+}
+
+long DentryCache::generation() {
+    lock_guard<mutex> guard(lock);
+    return invalidations;
+}
+
+void DentryCache::insert(int dirId, const string& name, const Dentry& dentry, long seenGeneration) {
+    lock_guard<mutex> guard(lock);
+
+    // lookup result may be outdated already
+    if (capacity == 0 || seenGeneration != invalidations) return;
+
+    Key key(dirId, name);
+    map<Key, list<Entry>::iterator>::iterator it = entries.find(key);
+
+    if (it != entries.end()) {
+        it->second->dentry = dentry;
+        lru.splice(lru.begin(), lru, it->second);
+        return;
+    }
+
+    if (static_cast<int>(lru.size()) >= capacity) erase(entries.find(lru.back().key));
+
+    Entry entry;
+    entry.key = key;
+    entry.dentry = dentry;
+    lru.push_front(entry);
+    entries[key] = lru.begin();
+}
+
+void DentryCache::invalidate(int dirId, const string& name) {
+    lock_guard<mutex> guard(lock);
+
+    invalidations++;
+
+    map<Key, list<Entry>::iterator>::iterator it = entries.find(Key(dirId, name));
+    if (it != entries.end()) erase(it);
+}
+
+void DentryCache::invalidateDir(int dirId) {
+    lock_guard<mutex> guard(lock);
+
+    invalidations++;
+
+    map<Key, list<Entry>::iterator>::iterator it = entries.lower_bound(Key(dirId, string()));
+    while (it != entries.end() && it->first.first == dirId) erase(it++);
+}
+
+void DentryCache::clear() {
+    lock_guard<mutex> guard(lock);
+
+    invalidations++;
+
+    entries.clear();
+    lru.clear();
+}
+
+void DentryCache::erase(map<Key, list<Entry>::iterator>::iterator it) {
+    lru.erase(it->second);
+    entries.erase(it);
+}
+
+}       // fs::namespace end
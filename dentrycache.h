@@ -0,0 +1,63 @@
+#ifndef DENTRYCACHE_H
+#define DENTRYCACHE_H
+
+#include "fs.h"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace fs {
+
+/**
+ * @brief The Dentry struct describes a cached result of a name lookup
+ */
+struct Dentry {
+    int inodeId;                                // -1 if the name doesn't exist (negative entry)
+    char type;                                  // type of the inode, if it exists
+    std::string target;                         // path the symlink points to
+};
+
+/**
+ * @brief The DentryCache class is an LRU cache of name lookups keyed by
+ * (parent dir, name). Entries must be invalidated by whoever changes the
+ * dir records, while holding the dir lock exclusively
+ */
+class DentryCache {
+public:
+    DentryCache();
+
+    void setCapacity(int capacity);             // 0 disables the cache
+
+    bool lookup(int dirId, const std::string& name, Dentry& dentry);
+
+    // generation is taken before the lookup on the device, insert is skipped
+    // if anything was invalidated since then
+    long generation();
+    void insert(int dirId, const std::string& name, const Dentry& dentry, long seenGeneration);
+    void invalidate(int dirId, const std::string& name);
+    void invalidateDir(int dirId);              // drops all the names in the dir
+    void clear();
+
+private:
+    typedef std::pair<int, std::string> Key;
+
+    struct Entry {
+        Key key;
+        Dentry dentry;
+    };
+
+    void erase(std::map<Key, std::list<Entry>::iterator>::iterator it);
+
+    std::mutex lock;
+    int capacity;                               // max number of cached names
+    long invalidations;                         // generation of the cache
+    std::list<Entry> lru;                       // most recently used name first
+    std::map<Key, std::list<Entry>::iterator> entries;  // ordered, so names of a dir are adjacent
+};
+
+}       // fs::namespace end
+
+#endif // DENTRYCACHE_H
@@ -0,0 +1,288 @@
+#include "dirindex.h"
+#include "volume.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace fs {
+
+static void readNode(int blockId, IndexNode& node) {
+    readBlock(blockId, reinterpret_cast<char*>(&node), sizeof(IndexNode));
+}
+
+static void writeNode(int blockId, const IndexNode& node) {
+    writeBlock(blockId, reinterpret_cast<const char*>(&node), sizeof(IndexNode));
+}
+
+static void initNode(IndexNode& node, int level) {
+    memset(&node, 0, sizeof(IndexNode));
+    node.level = level;
+}
+
+// position of the child of the node, which may keep the hash
+static int childIndex(const IndexNode& node, unsigned hash) {
+    int child = 0;
+    while (child + 1 < node.count && node.entries[child + 1].hash < hash) child++;
+
+    return child;
+}
+
+// first entry of the leaf with not less hash
+static int lowerBound(const IndexNode& node, unsigned hash) {
+    int i = 0;
+    while (i < node.count && node.entries[i].hash < hash) i++;
+
+    return i;
+}
+
+// descends to the leftmost leaf, which may keep the hash
+static int findLeaf(int rootBlock, unsigned hash, IndexNode& node, vector<int>* path, vector<int>* positions) {
+    int blockId = rootBlock;
+    readNode(blockId, node);
+
+    while (node.level > 0) {
+        int child = childIndex(node, hash);
+
+        if (path != NULL) {
+            path->push_back(blockId);
+            positions->push_back(child);
+        }
+
+        blockId = node.entries[child].value;
+        readNode(blockId, node);
+    }
+
+    return blockId;
+}
+
+unsigned nameHash(const char* fileName) {
+    // FNV-1a
+    unsigned hash = 2166136261u;
+
+    for (int i = 0; i < FNAME_LEN && fileName[i] != '\0'; i++) {
+        hash ^= static_cast<unsigned char>(fileName[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+int buildIndex(const Link* links, int linksNumber) {
+    int rootBlock = allocateBlock();
+    if (rootBlock == -1) return 0;
+
+    IndexNode root;
+    initNode(root, 0);
+    writeNode(rootBlock, root);
+
+    for (int i = 0; i < linksNumber; i++) {
+        if (!insertIndexEntry(rootBlock, nameHash(links[i].fileName), i)) {
+            freeIndex(rootBlock);
+            return 0;
+        }
+    }
+
+    return rootBlock;
+}
+
+void freeIndex(int rootBlock) {
+    IndexNode node;
+    readNode(rootBlock, node);
+
+    if (node.level > 0) {
+        for (int i = 0; i < node.count; i++) freeIndex(node.entries[i].value);
+    }
+
+    setBlockUnused(rootBlock);
+}
+
+void findIndexSlots(int rootBlock, unsigned hash, vector<int>& slots) {
+    IndexNode node;
+    findLeaf(rootBlock, hash, node, NULL, NULL);
+
+    int i = lowerBound(node, hash);
+
+    // equal hashes may continue in the next leaves
+    while (true) {
+        if (i == node.count) {
+            if (node.next == 0) return;
+
+            readNode(node.next, node);
+            i = 0;
+            continue;
+        }
+
+        if (node.entries[i].hash != hash) return;
+
+        slots.push_back(node.entries[i].value);
+        i++;
+    }
+}
+
+bool insertIndexEntry(int rootBlock, unsigned hash, int slot) {
+    vector<int> path;                        // nodes from the root to the leaf
+    vector<int> positions;                   // child taken in every node of the path
+
+    IndexNode node;
+    int blockId = findLeaf(rootBlock, hash, node, &path, &positions);
+
+    // reserve blocks for all the splits first, so a full device leaves the index intact
+    int splits = 0;
+    if (node.count == INDEX_ENTRIES) {
+        splits = 1;
+
+        IndexNode parent;
+        for (int i = path.size() - 1; i >= 0; i--) {
+            readNode(path[i], parent);
+            if (parent.count < INDEX_ENTRIES) break;
+            splits++;
+        }
+    }
+
+    vector<int> spare;                       // blocks for new nodes
+    for (int i = 0; i < splits + 1 && splits > 0; i++) {
+        int spareBlock = allocateBlock();
+
+        if (spareBlock == -1) {
+            for (size_t j = 0; j < spare.size(); j++) setBlockUnused(spare[j]);
+            return false;
+        }
+
+        spare.push_back(spareBlock);
+    }
+
+    IndexEntry entry;
+    entry.hash = hash;
+    entry.value = slot;
+
+    // keep entries with equal hashes in the insertion order
+    int position = lowerBound(node, hash);
+    while (position < node.count && node.entries[position].hash == hash) position++;
+
+    while (true) {
+        if (node.count < INDEX_ENTRIES) {
+            memmove(&node.entries[position + 1], &node.entries[position],
+                    (node.count - position) * sizeof(IndexEntry));
+            node.entries[position] = entry;
+            node.count++;
+
+            writeNode(blockId, node);
+            break;
+        }
+
+        // node is full, split it into two halves
+        IndexEntry entries[INDEX_ENTRIES + 1];
+        memcpy(entries, node.entries, position * sizeof(IndexEntry));
+        entries[position] = entry;
+        memcpy(&entries[position + 1], &node.entries[position], (node.count - position) * sizeof(IndexEntry));
+
+        int total = node.count + 1;
+        int leftCount = total / 2;
+
+        int rightBlock = spare.back();
+        spare.pop_back();
+
+        IndexNode left;
+        IndexNode right;
+        initNode(left, node.level);
+        initNode(right, node.level);
+
+        left.count = leftCount;
+        memcpy(left.entries, entries, leftCount * sizeof(IndexEntry));
+        right.count = total - leftCount;
+        memcpy(right.entries, &entries[leftCount], right.count * sizeof(IndexEntry));
+
+        if (node.level == 0) {
+            right.next = node.next;
+            left.next = rightBlock;
+        }
+
+        IndexEntry separator;
+        separator.hash = right.entries[0].hash;
+        separator.value = rightBlock;
+
+        if (blockId == rootBlock) {
+            // root stays in place, both halves move to new blocks
+            int leftBlock = spare.back();
+            spare.pop_back();
+
+            writeNode(leftBlock, left);
+            writeNode(rightBlock, right);
+
+            IndexNode root;
+            initNode(root, node.level + 1);
+            root.removed = node.removed;
+            root.count = 2;
+            root.entries[0].value = leftBlock;
+            root.entries[1] = separator;
+
+            writeNode(rootBlock, root);
+            break;
+        }
+
+        writeNode(blockId, left);
+        writeNode(rightBlock, right);
+
+        // put the separator into the parent
+        blockId = path.back();
+        position = positions.back() + 1;
+        path.pop_back();
+        positions.pop_back();
+
+        readNode(blockId, node);
+        entry = separator;
+    }
+
+    // the root wasn't split
+    for (size_t j = 0; j < spare.size(); j++) setBlockUnused(spare[j]);
+    return true;
+}
+
+bool removeIndexEntry(int rootBlock, unsigned hash, int slot) {
+    IndexNode node;
+    int blockId = findLeaf(rootBlock, hash, node, NULL, NULL);
+
+    int i = lowerBound(node, hash);
+
+    while (true) {
+        if (i == node.count) {
+            if (node.next == 0) return false;
+
+            blockId = node.next;
+            readNode(blockId, node);
+            i = 0;
+            continue;
+        }
+
+        if (node.entries[i].hash != hash) return false;
+
+        if (node.entries[i].value == slot) {
+            memmove(&node.entries[i], &node.entries[i + 1], (node.count - i - 1) * sizeof(IndexEntry));
+            node.count--;
+
+            if (blockId == rootBlock) {
+                node.removed++;
+            } else {
+                IndexNode root;
+                readNode(rootBlock, root);
+                root.removed++;
+                writeNode(rootBlock, root);
+            }
+
+            writeNode(blockId, node);
+            return true;
+        }
+
+        i++;
+    }
+}
+
+int indexRemovals(int rootBlock) {
+    IndexNode root;
+    readNode(rootBlock, root);
+    return root.removed;
+}
+
+}       // fs::namespace end
@@ -0,0 +1,52 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include "fs.h"
+
+#include <vector>
+
+namespace fs {
+
+// directories with more links than this get an index
+const int DIR_INDEX_THRESHOLD = 2 * BLOCK_SIZE / sizeof(Link);
+
+/**
+ * @brief The IndexEntry struct is a record of a directory index node
+ */
+struct IndexEntry {
+    unsigned hash;                          // hash of the file name
+    int value;                              // leaf - index of the link in dir, node - child block
+};
+
+const int INDEX_ENTRIES = (BLOCK_SIZE - 4 * sizeof(int)) / sizeof(IndexEntry);
+
+/**
+ * @brief The IndexNode struct is a block of a directory index: b+tree of the
+ * file name hashes. Node entry i points to the child, which hashes are not
+ * less than entries[i].hash (entries[0].hash isn't used). Equal hashes may
+ * span several leaves, so leaves are chained. Nodes aren't merged, when entries
+ * are removed, the root counts removals, so the index can be rebuilt
+ */
+struct IndexNode {
+    int level;                              // 0 - leaf
+    int count;                              // number of used entries
+    int next;                               // next leaf block, 0 if it is the last
+    int removed;                            // root only, entries removed since the build
+    IndexEntry entries[INDEX_ENTRIES];
+};
+
+unsigned nameHash(const char* fileName);
+
+// root block of the index of the links or 0 if there is no space
+int buildIndex(const Link* links, int linksNumber);
+void freeIndex(int rootBlock);
+
+// indexes of the links, which names have the hash
+void findIndexSlots(int rootBlock, unsigned hash, std::vector<int>& slots);
+bool insertIndexEntry(int rootBlock, unsigned hash, int slot);
+bool removeIndexEntry(int rootBlock, unsigned hash, int slot);
+int indexRemovals(int rootBlock);
+
+}       // fs::namespace end
+
+#endif // DIRINDEX_H
@@ -0,0 +1,246 @@
+#include "extents.h"
+#include "volume.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+namespace fs {
+
+static bool logicalLess(int logical, const Extent& extent) {
+    return logical < extent.logical;
+}
+
+// appends extents of the tree node, level 0 nodes hold the extents themselves
+static void loadNode(int blockId, int count, int level, vector<Extent>& extents) {
+    char block[BLOCK_SIZE];
+    readBlock(blockId, block);
+
+    const Extent* entries = reinterpret_cast<const Extent*>(block);
+
+    if (level == 0) {
+        extents.insert(extents.end(), entries, entries + count);
+        return;
+    }
+
+    // copy entries out, the buffer is reused by the children
+    vector<Extent> children(entries, entries + count);
+    for (size_t i = 0; i < children.size(); i++) {
+        loadNode(children[i].physical, children[i].length, level - 1, extents);
+    }
+}
+
+// collects blocks of the tree node and of all its children
+static void collectNode(int blockId, int count, int level, vector<int>& blocks) {
+    blocks.push_back(blockId);
+    if (level == 0) return;
+
+    char block[BLOCK_SIZE];
+    readBlock(blockId, block);
+
+    vector<Extent> children(reinterpret_cast<const Extent*>(block), reinterpret_cast<const Extent*>(block) + count);
+    for (size_t i = 0; i < children.size(); i++) {
+        collectNode(children[i].physical, children[i].length, level - 1, blocks);
+    }
+}
+
+void loadExtents(const Inode& inode, vector<Extent>& extents) {
+    extents.clear();
+
+    if (inode.depth == 0) {
+        extents.assign(inode.extents, inode.extents + inode.extentsNumber);
+        return;
+    }
+
+    for (int i = 0; i < inode.extentsNumber; i++) {
+        loadNode(inode.extents[i].physical, inode.extents[i].length, inode.depth - 1, extents);
+    }
+}
+
+bool storeExtents(Inode& inode, const vector<Extent>& extents) {
+    vector<int> extentBlocks;                    // blocks, that hold the tree now
+    for (int i = 0; inode.depth > 0 && i < inode.extentsNumber; i++) {
+        collectNode(inode.extents[i].physical, inode.extents[i].length, inode.depth - 1, extentBlocks);
+    }
+
+    int extentsNumber = extents.size();
+
+    // whole map fits into the inode
+    if (extentsNumber <= INODE_EXTENTS) {
+        for (size_t i = 0; i < extentBlocks.size(); i++) setBlockUnused(extentBlocks[i]);
+
+        inode.depth = 0;
+        inode.extentsNumber = extentsNumber;
+        if (extentsNumber > 0) memcpy(inode.extents, extents.data(), extentsNumber * sizeof(Extent));
+        return true;
+    }
+
+    // every level has a block per EXTENTS_PER_BLOCK entries of the level below
+    int blocksNumber = 0;
+    for (int entries = extentsNumber; entries > INODE_EXTENTS; ) {
+        entries = divCeil(entries, EXTENTS_PER_BLOCK);
+        blocksNumber += entries;
+    }
+
+    // allocate missing blocks first, so nothing is changed on failure
+    int usedBlocks = extentBlocks.size();
+    while (static_cast<int>(extentBlocks.size()) < blocksNumber) {
+        int blockId = allocateBlock();
+
+        if (blockId == -1) {
+            for (size_t i = usedBlocks; i < extentBlocks.size(); i++) setBlockUnused(extentBlocks[i]);
+            cout << "Error: not enough disk space for the file map" << endl;
+            return false;
+        }
+
+        extentBlocks.push_back(blockId);
+    }
+
+    while (static_cast<int>(extentBlocks.size()) > blocksNumber) {
+        setBlockUnused(extentBlocks.back());
+        extentBlocks.pop_back();
+    }
+
+    // write the tree bottom up, entries of a level point to the blocks below
+    vector<Extent> entries = extents;
+    int nextBlock = 0;
+    int depth = 0;
+
+    char block[BLOCK_SIZE];
+    while (static_cast<int>(entries.size()) > INODE_EXTENTS) {
+        vector<Extent> parents;
+
+        for (size_t first = 0; first < entries.size(); first += EXTENTS_PER_BLOCK) {
+            int count = min(static_cast<int>(entries.size() - first), EXTENTS_PER_BLOCK);
+            int blockId = extentBlocks[nextBlock++];
+
+            memset(block, 0, BLOCK_SIZE);
+            memcpy(block, &entries[first], count * sizeof(Extent));
+            writeBlock(blockId, block);
+
+            Extent parent;
+            parent.logical = entries[first].logical;
+            parent.physical = blockId;
+            parent.length = count;
+            parents.push_back(parent);
+        }
+
+        entries.swap(parents);
+        depth++;
+    }
+
+    inode.depth = depth;
+    inode.extentsNumber = entries.size();
+    memcpy(inode.extents, entries.data(), entries.size() * sizeof(Extent));
+    return true;
+}
+
+int mapBlock(const vector<Extent>& extents, int logical, int& run) {
+    return mapBlock(extents.data(), extents.size(), logical, run);
+}
+
+int mapBlock(const Extent* extents, int extentsNumber, int logical, int& run) {
+    const Extent* end = extents + extentsNumber;
+
+    // first extent, which starts after the block
+    const Extent* next = upper_bound(extents, end, logical, logicalLess);
+
+    if (next != extents) {
+        const Extent& extent = *(next - 1);
+
+        if (logical < extent.logical + extent.length) {
+            run = extent.logical + extent.length - logical;
+            return extent.physical + (logical - extent.logical);
+        }
+    }
+
+    run = next == end ? INT_MAX : next->logical - logical;
+    return -1;
+}
+
+void addExtent(vector<Extent>& extents, int logical, int physical, int length) {
+    vector<Extent>::iterator next = upper_bound(extents.begin(), extents.end(), logical, logicalLess);
+
+    // glue to the previous extent
+    if (next != extents.begin()) {
+        Extent& prev = *(next - 1);
+
+        if (prev.logical + prev.length == logical && prev.physical + prev.length == physical) {
+            prev.length += length;
+
+            if (next != extents.end() && logical + length == next->logical &&
+                    physical + length == next->physical) {
+                prev.length += next->length;
+                extents.erase(next);
+            }
+            return;
+        }
+    }
+
+    // glue to the next extent
+    if (next != extents.end() && logical + length == next->logical && physical + length == next->physical) {
+        next->logical = logical;
+        next->physical = physical;
+        next->length += length;
+        return;
+    }
+
+    Extent extent;
+    extent.logical = logical;
+    extent.physical = physical;
+    extent.length = length;
+    extents.insert(next, extent);
+}
+
+void removeExtent(vector<Extent>& extents, int logical, int length) {
+    vector<Extent> kept;
+    int end = logical + length;
+
+    for (size_t i = 0; i < extents.size(); i++) {
+        Extent extent = extents[i];
+        int extentEnd = extent.logical + extent.length;
+
+        if (extentEnd <= logical || extent.logical >= end) {
+            kept.push_back(extent);
+            continue;
+        }
+
+        // parts before and after the removed blocks stay
+        if (extent.logical < logical) {
+            Extent head = extent;
+            head.length = logical - extent.logical;
+            kept.push_back(head);
+        }
+
+        if (extentEnd > end) {
+            Extent tail;
+            tail.logical = end;
+            tail.physical = extent.physical + (end - extent.logical);
+            tail.length = extentEnd - end;
+            kept.push_back(tail);
+        }
+    }
+
+    extents.swap(kept);
+}
+
+void freeExtents(vector<Extent>& extents, int logical) {
+    while (!extents.empty()) {
+        Extent& last = extents.back();
+        if (last.logical + last.length <= logical) break;
+
+        int keep = max(0, logical - last.logical);          // blocks of the extent before logical
+        freeRun(last.physical + keep, last.length - keep);
+
+        if (keep == 0) {
+            extents.pop_back();
+        } else {
+            last.length = keep;
+        }
+    }
+}
+
+}       // fs::namespace end
@@ -0,0 +1,33 @@
+#ifndef EXTENTS_H
+#define EXTENTS_H
+
+#include "fs.h"
+
+#include <vector>
+
+namespace fs {
+
+// reads the whole block map of the file, sorted by logical block
+void loadExtents(const Inode& inode, std::vector<Extent>& extents);
+
+// puts the block map into the inode and its tree of extents blocks,
+// false if there is no space for the tree
+bool storeExtents(Inode& inode, const std::vector<Extent>& extents);
+
+// device block of the file block or -1 for a hole,
+// run is set to the number of blocks left in the same extent (or hole)
+int mapBlock(const std::vector<Extent>& extents, int logical, int& run);
+int mapBlock(const Extent* extents, int extentsNumber, int logical, int& run);
+
+// maps the hole [logical, logical + length), merging it with adjacent extents
+void addExtent(std::vector<Extent>& extents, int logical, int physical, int length);
+
+// unmaps blocks [logical, logical + length), splitting extents; the blocks aren't freed
+void removeExtent(std::vector<Extent>& extents, int logical, int length);
+
+// releases all the blocks starting from the logical one
+void freeExtents(std::vector<Extent>& extents, int logical);
+
+}       // fs::namespace end
+
+#endif // EXTENTS_H
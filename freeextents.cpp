@@ -0,0 +1,110 @@
+#include "freeextents.h"
+
+using namespace std;
+
+namespace fs {
+
+void FreeExtents::clear() {
+    byOffset.clear();
+    bySize.clear();
+}
+
+void FreeExtents::insert(int blockId, int length) {
+    if (length <= 0) return;
+
+    int first = blockId;
+    int end = blockId + length;
+
+    // merge with the run that ends at blockId and the one that starts at the end
+    Offsets::iterator next = byOffset.lower_bound(blockId);
+
+    if (next != byOffset.begin()) {
+        Offsets::iterator previous = prev(next);
+
+        if (previous->first + previous->second == blockId) {
+            first = previous->first;
+            erase(previous);
+        }
+    }
+
+    if (next != byOffset.end() && next->first == end) {
+        end += next->second;
+        erase(next);
+    }
+
+    add(first, end - first);
+}
+
+void FreeExtents::remove(int blockId, int length) {
+    if (length <= 0) return;
+
+    // the run, that contains blockId
+    Offsets::iterator run = byOffset.upper_bound(blockId);
+    if (run == byOffset.begin()) return;
+    run--;
+
+    int first = run->first;
+    int end = run->first + run->second;
+    if (blockId >= end) return;
+
+    erase(run);
+
+    if (first < blockId) add(first, blockId - first);
+    if (blockId + length < end) add(blockId + length, end - blockId - length);
+}
+
+int FreeExtents::find(int wanted, int goal, int& length) const {
+    length = 0;
+    if (byOffset.empty()) return -1;
+
+    if (goal != -1) {
+        Offsets::const_iterator run = byOffset.upper_bound(goal);
+
+        // goal itself is free, the run is continued from it
+        if (run != byOffset.begin()) {
+            Offsets::const_iterator previous = prev(run);
+            int end = previous->first + previous->second;
+
+            if (goal < end) {
+                length = min(wanted, end - goal);
+                if (length == wanted) return goal;
+            }
+        }
+
+        for (int i = 0; i < FREE_EXTENTS_PROBES && run != byOffset.end(); i++, run++) {
+            if (run->second >= wanted) {
+                length = wanted;
+                return run->first;
+            }
+        }
+
+        // a piece at goal is better than a far run, if nothing fits anywhere
+        if (length > 0 && bySize.rbegin()->first < wanted) return goal;
+    }
+
+    // best fit
+    set<pair<int, int> >::const_iterator fit = bySize.lower_bound(make_pair(wanted, -1));
+    if (fit != bySize.end()) {
+        length = wanted;
+        return fit->second;
+    }
+
+    length = bySize.rbegin()->first;
+    return bySize.rbegin()->second;
+}
+
+int FreeExtents::extentsNumber() const {
+    return byOffset.size();
+}
+
+void FreeExtents::add(int blockId, int length) {
+    byOffset[blockId] = length;
+    bySize.insert(make_pair(length, blockId));
+}
+
+void FreeExtents::erase(Offsets::iterator run) {
+    bySize.erase(make_pair(run->second, run->first));
+    byOffset.erase(run);
+}
+
+}       // fs::namespace end
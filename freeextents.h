@@ -0,0 +1,43 @@
+#ifndef FREEEXTENTS_H
+#define FREEEXTENTS_H
+
+#include <map>
+#include <set>
+#include <utility>
+
+namespace fs {
+
+const int FREE_EXTENTS_PROBES = 8;              // free runs past the goal checked for a fit
+
+/**
+ * @brief The FreeExtents class indexes runs of free device blocks by offset
+ * and by size. Adjacent runs are always merged, so every run is bounded by
+ * used blocks
+ */
+class FreeExtents {
+public:
+    void clear();
+
+    void insert(int blockId, int length);       // blocks become free
+    void remove(int blockId, int length);       // free blocks become used
+
+    // run of wanted blocks at goal, else one of the runs that follow goal, else
+    // the smallest run that fits, else the largest one; length is set to the
+    // number of blocks found, -1 if there are no free blocks
+    int find(int wanted, int goal, int& length) const;
+
+    int extentsNumber() const;
+
+private:
+    typedef std::map<int, int> Offsets;         // first block -> length
+
+    void add(int blockId, int length);
+    void erase(Offsets::iterator run);
+
+    Offsets byOffset;
+    std::set<std::pair<int, int> > bySize;      // (length, first block)
+};
+
+}       // fs::namespace end
+
+#endif // FREEEXTENTS_H
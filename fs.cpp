@@ -1,9 +1,22 @@
 #include "fs.h"
-
+#include "checksums.h"
+#include "compression.h"
+#include "dirindex.h"
+#include "extents.h"
+#include "stats.h"
+#include "volume.h"
+
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <shared_mutex>
 #include <vector>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
@@ -15,91 +28,329 @@ namespace fs {
 
 void getFileName(char fileName[FNAME_LEN]);
 bool addDirRecord(int inodeId, const char* fileName, int dirId);
-int getFreeBlockId();
 int align_size(int size);
-Link *getLinks(int dirId, int &linksNumber);
 bool dirContainsFile(int fileId);
 int getFileId(const char* absFileName, int &parentDirId, std::string &path);
 int getFileId(const char* absFileName, int &parentDirId);
 int getFileId(const char* absFileName);
-bool removeDirRecord(int dirId, int recordId);
-void clearBlock(int blockId, int size = BLOCK_SIZE, int shift = 0);
-bool setInodeBlockByIndex(Inode &inode, int index);
+bool removeDirRecord(int dirId, const char* fileName, int fileId);
+int findLink(int dirId, const char* fileName);
+int readRecords(DirCursor& cursor, DirEntry* entries, int count);
+int findLinkSlot(int dirId, const char* fileName, Link& link);
+void buildDirIndex(int dirId);
+void dropDirIndex(int dirId);
+void unlinkLocked(int dirId, int fileId, const char* fileName);
+char* readData(int inodeId, int size, int shift = 0);
+void readAhead(int inodeId, int size, int shift);
+void prefetchBlocks(const Inode& inode, int from, int to);
+bool checkIoVec(const IoVec* iov, int count, int shift);
+bool bufferData(int inodeId, int size, const char* data, int shift);
+bool writeInline(int inodeId, Inode& inode, int size, const char* data, int shift);
+bool spillInline(int inodeId, Inode& inode);
+int clusterBlocks(const Extent* extents, int extentsNumber, int cluster);
+bool loadCluster(const Extent* extents, int extentsNumber, int cluster, char* data);
+bool readClusters(const Extent* extents, int extentsNumber, char* buff, int size, int shift);
+bool storeCluster(std::vector<Extent>& extents, int cluster, const char* data, std::vector<Extent>& newRuns,
+                  std::vector<Extent>& oldRuns);
+bool writeClusters(int inodeId, Inode& inode, int size, const char* data, int shift);
+bool flushClusters(Inode& inode, std::vector<Extent>& extents, const WriteBuffer::Blocks& blocks);
+void truncateClusters(int inodeId, Inode& inode, int newSize);
+bool unshareRange(std::vector<Extent>& extents, int firstBlockIndex, int lastBlockIndex, bool copyFirst,
+                  bool copyLast, std::vector<Extent>& newRuns, std::vector<Extent>& sharedRuns);
+void releaseRuns(const std::vector<Extent>& runs);
+bool shareContents(const Inode& inode, Inode& copy);
+int copyInode(int inodeId, std::vector<int>& created);
+int copyTree(int dirId, int parentId, std::vector<int>& created);
+bool isReadOnly(int inodeId);
+void releaseInode(int inodeId);
+bool flushData(int inodeId);
+bool allocateRange(std::vector<Extent>& extents, int firstBlockIndex, int lastBlockIndex, bool reserved,
+                   std::vector<Extent>& newRuns);
 char* getAbsPath(const char* path);
 std::string simplifyPath(std::vector<std::string> parts);
 std::vector<std::string> splitPath(const char* path);
+void writeSuperblock(bool clean);
+void waitHeldBlocks(int count);
+
+
+
+Volume* vol = NULL;                 // mounted device state
+
+bool mount(const char *fileName, const MountOptions& options) {
+    umount();
+
+    unique_ptr<BlockDevice> device;
+
+    if (options.useMmap) {
+        MmapDevice* mmapDevice = new MmapDevice();
+        device.reset(mmapDevice);
 
-void readBlock(int block_id, char* data, int size = BLOCK_SIZE, int shift = 0);
-void readBlock(int block_id, Inode* inode);
-void writeBlock(int block_id, const char* data, int size = BLOCK_SIZE, int shift = 0);
-void writeBlock(int block_id, const Inode* inode);
-int divCeil(int a, int b);
-int divFloor(int a, int b);
-bool isBlockUsed(int block_id);
-void setBlockUsed(int block_id);
-void setBlockUnused(int block_id);
+        if (!mmapDevice->open(fileName)) device.reset();
+    }
+
+    // fallback to the positional file access
+    if (!device) {
+        FileDevice* fileDevice = new FileDevice();
+        device.reset(fileDevice);
+
+        if (!fileDevice->open(fileName)) return false;
+    }
 
+    if (!mount(device.get(), options)) return false;
 
+    vol->ownedDevice = move(device);
+    return true;
+}
 
-int device_capacity = -1;
-int bitmask_blocks = -1;
-int data_blocks = -1;               // number of blocks, which bitmask occupies
-int root_inode_id = -1;             // root fd
-set<int> openedDescriptors;         // list of opened descriptors
-fstream fio;                        // device
-string wd;                          // current work dir
+bool mount(BlockDevice* device, const MountOptions& options) {
+    FS_STAT_OP(OP_MOUNT);
 
-bool mount(const char *fileName) {
     umount();
-    wd = "/";
 
-    fio.open(fileName, fstream::in | fstream::out | fstream::binary);
-    if (fio.fail()) {
+    vol = new Volume();
+    vol->wd = "/";
+
+    vol->device = device;
+    vol->cache.attach(device, options.cacheBlocks);
+
+    // measure device capacity
+    vol->device_capacity = device->capacity();
+    int deviceBlocks = vol->device_capacity / BLOCK_SIZE;
+
+    // the whole format is described by the superblock
+    Superblock& super = vol->superblock;
+    char block[BLOCK_SIZE];
+    vol->cache.read(SUPERBLOCK_ID, block);
+    memcpy(&super, block, sizeof(Superblock));
+
+    // only a device without the magic is formatted, a known format of another version is left alone
+    bool formatted = super.magic == SUPERBLOCK_MAGIC;
+
+    if (formatted && (super.version != FS_VERSION || super.blockSize != BLOCK_SIZE)) {
+        cout << "Error: format version " << super.version << " with " << super.blockSize
+             << " B blocks isn't supported, impossible to mount" << endl;
+
+        vol->cache.detach();
+        delete vol;
+        vol = NULL;
         return false;
     }
 
-    // measure device capacity
-    fio.seekg(0, fio.end);
-    int device_capacity = fio.tellg();
+    if (formatted && (super.blocksNumber > deviceBlocks || super.bitmaskBlocks <= 0 || super.inodeBlocks <= 0
+                      || super.journalBlocks <= 0 || super.refCountsBlocks <= 0 || super.checksumsBlocks < 0)) {
+        cout << "Error: superblock doesn't match the device, impossible to mount" << endl;
+
+        vol->cache.detach();
+        delete vol;
+        vol = NULL;
+        return false;
+    }
+
+    if (!formatted) {
+        super = Superblock();
+        super.magic = SUPERBLOCK_MAGIC;
+        super.version = FS_VERSION;
+        super.blockSize = BLOCK_SIZE;
+        super.blocksNumber = deviceBlocks;
+        super.bitmaskBlocks = divCeil(deviceBlocks, BLOCK_SIZE * 8);
+        super.inodesNumber = max(deviceBlocks / INODE_RATIO, 2 * INODES_PER_BLOCK);
+        super.inodeBlocks = divCeil(super.inodesNumber, INODES_PER_BLOCK);
+        super.rootInodeId = ROOT_INODE_ID;
+        super.journalStart = BITMASK_BLOCK_ID + super.bitmaskBlocks + super.inodeBlocks;
+        super.journalBlocks = min(max(deviceBlocks / JOURNAL_RATIO, JOURNAL_MIN_BLOCKS), JOURNAL_MAX_BLOCKS);
+        super.refCountsStart = super.journalStart + super.journalBlocks;
+        super.refCountsBlocks = divCeil(deviceBlocks - BITMASK_BLOCK_ID - super.bitmaskBlocks, BLOCK_SIZE);
+        super.checksumsStart = super.refCountsStart + super.refCountsBlocks;
+        super.checksumsBlocks = options.checksums ? divCeil(deviceBlocks - BITMASK_BLOCK_ID, SUMS_PER_BLOCK) : 0;
+
+        // bitmask, inode table, shares and sums start empty, no old log may be taken for transactions
+        const int ZERO_RUN = 64;                    // blocks cleared by one write
+        vector<char> zeros(ZERO_RUN * BLOCK_SIZE, 0);
+        int metaBlocks = super.bitmaskBlocks + super.inodeBlocks + super.journalBlocks + super.refCountsBlocks
+                + super.checksumsBlocks;
+
+        for (int i = 0; i < metaBlocks; i += ZERO_RUN) {
+            int count = min(ZERO_RUN, metaBlocks - i);
+            vol->cache.writeBlocks(BITMASK_BLOCK_ID + i, count, &zeros[0]);
+        }
+
+        vol->journal.format(&vol->cache, super.journalStart, super.journalBlocks);
+    } else {
+        // operations committed before a crash get to their places
+        vol->journal.recover(&vol->cache, super.journalStart, super.journalBlocks);
+
+        // file data written after the last commit may be newer than its sums
+        if (!super.clean) super.unverified = 1;
+    }
+
+    // blocks read from now on are verified, the log has no sums
+    if (super.checksumsBlocks > 0) {
+        vol->checksums.load(vol->cache, super.checksumsStart, BITMASK_BLOCK_ID, super.blocksNumber - BITMASK_BLOCK_ID);
+        vol->checksums.exclude(super.journalStart, super.journalBlocks);
+        vol->checksums.setUnverified(super.unverified != 0);
+        vol->cache.setChecksums(&vol->checksums);
+    }
+
+    vol->bitmask_blocks = super.bitmaskBlocks;
+    vol->data_blocks = super.blocksNumber;
+    vol->inode_blocks = super.inodeBlocks;
+    vol->inodes_number = super.inodesNumber;
+    vol->root_inode_id = super.rootInodeId;
+
+    // inode table follows the bitmask, the bitmask describes blocks past it
+    int inodeTableId = BITMASK_BLOCK_ID + vol->bitmask_blocks;
+
+    bool loaded = vol->bitmap.load(vol->cache, BITMASK_BLOCK_ID, inodeTableId, vol->data_blocks - inodeTableId);
+    if (!formatted) {
+        for (int i = 0; i < vol->inode_blocks; i++) setBlockUsed(inodeTableId + i);
+        for (int i = 0; i < super.journalBlocks; i++) setBlockUsed(super.journalStart + i);
+        for (int i = 0; i < super.refCountsBlocks; i++) setBlockUsed(super.refCountsStart + i);
+        for (int i = 0; i < super.checksumsBlocks; i++) setBlockUsed(super.checksumsStart + i);
+    }
+
+    loaded = vol->refCounts.load(vol->cache, super.refCountsStart, inodeTableId, vol->data_blocks - inodeTableId)
+            && loaded;
+    loaded = vol->inodes.load(vol->cache, inodeTableId, vol->inodes_number) && loaded;
 
+    // zeros of damaged blocks would give used blocks and inodes away
+    if (!loaded && options.checkMetadata) {
+        cout << "Error: metadata of the device is damaged, impossible to mount, run fsck" << endl;
 
-    // how many blocks for bitmask
-    bitmask_blocks = divCeil(device_capacity, BLOCK_SIZE * BLOCK_SIZE * 8);
-    // how many blocks are used for data
-    data_blocks = divCeil(device_capacity, BLOCK_SIZE);
+        vol->cache.detach();
+        delete vol;
+        vol = NULL;
+        return false;
+    }
+
+    vol->dentries.setCapacity(options.dentryEntries);
+    vol->readahead.start(&vol->cache, options.readaheadBlocks, options.backgroundReadahead);
+    vol->engine.start(device, &vol->cache, options.asyncDepth);
+    vol->writeBuffer.setCapacity(options.writeBufferBlocks);
+    vol->compression = options.compression;
+
+    // blocks changed in memory go with every commit, async file data goes before the blocks mapping it;
+    // metadata images are sealed last, the sums are committed with them
+    Volume* volume = vol;
+    vol->journal.start(&vol->cache, super.journalStart, super.journalBlocks, options.journalInterval, [volume] {
+        volume->engine.waitAll();
+        {
+            lock_guard<mutex> lock(volume->allocatorLock);
+            volume->bitmap.flush(volume->journal);
+            volume->refCounts.flush(volume->journal);
+        }
+        volume->inodes.flush(volume->journal);
 
-    root_inode_id = bitmask_blocks;
+        if (volume->superblock.checksumsBlocks > 0) {
+            volume->journal.visitRunning([volume](int blockId, const char* data) {
+                volume->checksums.sealImage(blockId, data);
+            });
+            volume->checksums.flush(volume->journal);
+        }
+    }, [volume] {
+        // blocks freed by the transaction may get new contents now
+        lock_guard<mutex> lock(volume->allocatorLock);
+        volume->bitmap.release();
+    });
 
-    // if no inode for root is created
-    if (!isBlockUsed(root_inode_id)) {
-        setBlockUsed(root_inode_id);
+    if (!formatted) {
+        JournalHandle handle(vol->journal);
+        vol->inodes.setUsed(vol->root_inode_id);
 
         Inode root;
         root.links = 1;
         root.size = 0;
         root.type = 1;                              // is the directory
-        writeBlock(root_inode_id, &root);
+        root.flags = 0;
+        root.indexRoot = 0;
+        root.depth = 0;
+        root.extentsNumber = 0;
+        writeInode(vol->root_inode_id, &root);
+
+        addDirRecord(vol->root_inode_id, ".", vol->root_inode_id);
+        addDirRecord(vol->root_inode_id, "..", vol->root_inode_id);
+    }
 
-        addDirRecord(root_inode_id, ".", root_inode_id);
-        addDirRecord(root_inode_id, "..", root_inode_id);
+    // the format is on the device, before the superblock tells it is formatted
+    if (!formatted) {
+        vol->journal.commit();
+        vol->cache.sync();
     }
 
+    // counters stay stale until the device is unmounted
+    writeSuperblock(false);
     return true;
 }
 
 void umount() {
-    device_capacity = -1;
-    bitmask_blocks = -1;
-    data_blocks = -1;
-    root_inode_id = -1;
-    openedDescriptors.clear();
-    wd = "";
+    if (vol == NULL) return;
+    FS_STAT_OP(OP_UMOUNT);
+
+    // callbacks of the requests in flight may still use the volume
+    vol->engine.waitAll();
+    poll();
+    vol->engine.stop();
+
+    vector<int> files = vol->writeBuffer.files();
+    for (size_t i = 0; i < files.size(); i++) flush(files[i]);
+
+    vol->readahead.stop();
+    vol->journal.stop();
+    vol->cache.sync();
+
+    // the device is consistent, when the clean flag gets there
+    writeSuperblock(true);
+    vol->cache.detach();
+
+    delete vol;
+    vol = NULL;
+}
 
-    fio.close();
+void sync() {
+    FS_STAT_OP(OP_SYNC);
+
+    vol->engine.waitAll();
+
+    vector<int> files = vol->writeBuffer.files();
+    for (size_t i = 0; i < files.size(); i++) flush(files[i]);
+
+    // metadata is durable in the log, file data may have no metadata changes
+    vol->journal.commit();
+    vol->cache.sync();
+    writeSuperblock(false);
+}
+
+void flush(int inodeId) {
+    FS_STAT_OP(OP_FLUSH);
+    JournalHandle handle(vol->journal);
+    unique_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+    flushData(inodeId);
+}
+
+CacheStats cacheStats() {
+    if (vol == NULL) return CacheStats();
+    return vol->cache.stats();
+}
+
+FsStats statfs() {
+    FsStats stats = FsStats();
+    if (vol == NULL) return stats;
+
+    stats.blockSize = BLOCK_SIZE;
+    stats.blocks = vol->data_blocks;
+    stats.inodes = vol->inodes_number;
+    stats.freeInodes = vol->inodes.freeInodes();
+
+    // blocks held until the commit are free for a write, it waits for the commit
+    lock_guard<mutex> lock(vol->allocatorLock);
+    stats.freeBlocks = max(vol->bitmap.freeBlocks() + vol->bitmap.heldBlocksNumber() - vol->reservedBlocks, 0);
+    return stats;
 }
 
 /// reimplement4
 int create(const char* fileName, int type, char *linkTo) {
+    FS_STAT_OP(OP_CREATE);
+    JournalHandle handle(vol->journal);
+
     char* absFileName = getAbsPath(fileName);
 
     int parentDirId = -1;
@@ -118,34 +369,30 @@ int create(const char* fileName, int type, char *linkTo) {
         return -1;
     }
 
-    // find space for the new Inode
-    int inodeId = getFreeBlockId();
-
-    if (inodeId == -1) {
-        cout << "Error: no free space available" << endl;
-        return -1;
-    }
-
     vector<string> names = splitPath(fileName);
     if (names[names.size() - 1].size() > FNAME_LEN - 1) {
         cout << "Error: object name " << names[names.size() - 1] << " is too long" << endl;
         return -1;
     }
 
-    setBlockUsed(inodeId);
+    // find a slot for the new Inode
+    int inodeId = allocateInode();
 
-    // add file inode to corresponding derectory link
-    if (!addDirRecord(inodeId, names[names.size() - 1].c_str(), parentDirId)) {
-        setBlockUnused(inodeId);           // no block was used
+    if (inodeId == -1) {
+        cout << "Error: no free inodes available" << endl;
         return -1;
     }
 
-    // create empty inode for new file
+    // create empty inode for new file, nobody sees it before it is linked
     Inode newFileInode;
     newFileInode.links = 1;
     newFileInode.size = 0;
     newFileInode.type = type;                    // is a file
-    writeBlock(inodeId, &newFileInode);
+    newFileInode.flags = type == 0 && vol->compression ? INODE_COMPRESSED : 0;
+    newFileInode.indexRoot = 0;
+    newFileInode.depth = 0;
+    newFileInode.extentsNumber = 0;
+    writeInode(inodeId, &newFileInode);
 
 
     if (type == 1) {                  // is a dir
@@ -154,24 +401,52 @@ int create(const char* fileName, int type, char *linkTo) {
     }
 
     if (type == 2) {
-        write(inodeId, strlen(linkTo) + 1, linkTo);
+        writeData(inodeId, strlen(linkTo) + 1, linkTo);
+    }
+
+    unique_lock<shared_mutex> lock(vol->inodeLock(parentDirId));
+
+    Inode parentInode;
+    readInode(parentDirId, &parentInode);
+
+    bool linked = false;
+    if (parentInode.links == 0) {                // dir was removed meanwhile
+        cout << "Error: bad path" << endl;
+    } else if (parentInode.flags & INODE_READONLY) {
+        cout << "Error: object is read-only" << endl;
+    } else if (findLink(parentDirId, names[names.size() - 1].c_str()) != -1) {
+        cout << "Error: object \"" << names[names.size() - 1] <<  "\" already exists" << endl;
+    } else {
+        // add file inode to corresponding derectory link
+        linked = addDirRecord(inodeId, names[names.size() - 1].c_str(), parentDirId);
+    }
+
+    if (!linked) {
+        truncateData(inodeId, 0);
+        freeInode(inodeId);
+        return -1;
     }
 
     return inodeId;
 }
 
 char* read(int inodeId, int size, int shift) {
-    Inode inode;
-    readBlock(inodeId, &inode);
+    FS_STAT_OP(OP_READ);
 
-    // size is too big
-    if (size > BLOCKS_PER_INODE * BLOCK_SIZE) {
-        cout << "Error: size " << size << " out of " <<
-                BLOCKS_PER_INODE * BLOCK_SIZE << " is too big" <<  endl;
-        return NULL;
-    }
+    shared_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+    vol->engine.waitInode(inodeId, true);
 
-    if (size + shift > inode.size) {
+    char* buff = readData(inodeId, size, shift);
+    if (buff != NULL) readAhead(inodeId, size, shift);
+
+    return buff;
+}
+
+char* readData(int inodeId, int size, int shift) {
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    if (size < 0 || shift < 0 || size + shift > inode.size) {
         cout << "Error: access " << size + shift << " byte out of " << inode.size <<
                 " bytes file size" << endl;
         return NULL;
@@ -180,48 +455,304 @@ char* read(int inodeId, int size, int shift) {
     // return buffer
     char* buff = new char[size];
 
-    // index of the first block in inode
-    int firstBlockIndex = shift / BLOCK_SIZE;
-
-    // shift in the first block
-    int firstBlockShift = shift % BLOCK_SIZE;
+    if (inode.depth == INLINE_DEPTH) {
+        memcpy(buff, &inode.data[shift], size);
+        return buff;
+    }
 
-    // buffer for the file blocks
-    char fileBlock[BLOCK_SIZE];
+    vector<Extent> extents;
+    loadExtents(inode, extents);
 
-    // copy only a part of the first block
-    if (BLOCK_SIZE - firstBlockShift >= size) {
-        readBlock(inode.blocks[firstBlockIndex], fileBlock);
-        memcpy(&buff[0], &fileBlock[firstBlockShift], size);
+    bool verified;
+    if (inode.flags & INODE_COMPRESSED) {
+        verified = readClusters(extents.data(), extents.size(), buff, size, shift);
     } else {
-        // index of the last block in inode
-        int lastBlockIndex = divFloor(size + shift, BLOCK_SIZE);
-        int curBuffSize = 0;
+        verified = readExtents(extents.data(), extents.size(), buff, size, shift);
+    }
+
+    if (!verified) {
+        delete[] buff;
+        return NULL;
+    }
+    vol->writeBuffer.overlay(inodeId, buff, size, shift);
+
+    return buff;
+}
 
-        readBlock(inode.blocks[firstBlockIndex], fileBlock);
+// whole request is checked before any transfer
+bool checkIoVec(const IoVec* iov, int count, int shift) {
+    if (shift < 0) {
+        cout << "Error: negative shift is not allowed" << endl;
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (iov[i].size < 0) {
+            cout << "Error: negative size is not allowed" << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int read(int inodeId, char* buffer, int size, int shift) {
+    IoVec iov;
+    iov.base = buffer;
+    iov.size = size;
+
+    return readv(inodeId, &iov, 1, shift);
+}
+
+int readv(int inodeId, const IoVec* iov, int count, int shift) {
+    FS_STAT_OP(OP_READ);
+
+    shared_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+    vol->engine.waitInode(inodeId, true);
+
+    Inode inode;
+    readInode(inodeId, &inode);
 
-        memcpy(&buff[curBuffSize], &fileBlock[firstBlockShift], BLOCK_SIZE - firstBlockShift);
-        curBuffSize = curBuffSize + (BLOCK_SIZE - firstBlockShift);
+    if (!checkIoVec(iov, count, shift)) return -1;
 
-        int i;
-        for (i = firstBlockIndex + 1; i < lastBlockIndex; i++) {
-            readBlock(inode.blocks[i], fileBlock);
+    // inline map is used in place, the tree is loaded only for big files
+    vector<Extent> tree;
+    const Extent* extents = inode.extents;
+    int extentsNumber = inode.extentsNumber;
 
-            memcpy(&buff[curBuffSize], fileBlock, BLOCK_SIZE);
-            curBuffSize += BLOCK_SIZE;
+    if (inode.depth != 0) {
+        loadExtents(inode, tree);
+        extents = tree.data();
+        extentsNumber = tree.size();
+    }
+
+    int bytesRead = 0;
+    for (int i = 0; i < count; i++) {
+        // stop at the end of the file
+        int size = max(0, min(iov[i].size, inode.size - shift - bytesRead));
+
+        // damaged blocks fail the whole request
+        if (inode.depth == INLINE_DEPTH) {
+            memcpy(iov[i].base, &inode.data[shift + bytesRead], size);
+        } else if (inode.flags & INODE_COMPRESSED) {
+            if (!readClusters(extents, extentsNumber, iov[i].base, size, shift + bytesRead)) return -1;
+            vol->writeBuffer.overlay(inodeId, iov[i].base, size, shift + bytesRead);
+        } else {
+            if (!readExtents(extents, extentsNumber, iov[i].base, size, shift + bytesRead)) return -1;
+            vol->writeBuffer.overlay(inodeId, iov[i].base, size, shift + bytesRead);
         }
 
-        readBlock(inode.blocks[lastBlockIndex], fileBlock);
-        // copy left part of the last block
-        int lastBlockPart = size - curBuffSize;
+        bytesRead += size;
+        if (size < iov[i].size) break;
+    }
+
+    readAhead(inodeId, bytesRead, shift);
+
+    return bytesRead;
+}
+
+bool readAsync(int inodeId, char* buffer, int size, int shift, IoCallback done) {
+    FS_STAT_OP(OP_READ);
 
-        memcpy(&buff[curBuffSize], fileBlock, lastBlockPart);
+    // buffered data gets its blocks, so it can be transferred
+    if (vol->writeBuffer.contains(inodeId)) flush(inodeId);
+
+    shared_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    if (inode.type != 0) {
+        cout << "Error: object isn't a file, can't read" << endl;
+        return false;
     }
 
-    return buff;
+    IoVec iov;
+    iov.base = buffer;
+    iov.size = size;
+    if (!checkIoVec(&iov, 1, shift)) return false;
+
+    vector<Extent> tree;
+    const Extent* extents = inode.extents;
+    int extentsNumber = inode.extentsNumber;
+
+    if (inode.depth != 0) {
+        loadExtents(inode, tree);
+        extents = tree.data();
+        extentsNumber = tree.size();
+    }
+
+    // stop at the end of the file
+    size = max(0, min(size, inode.size - shift));
+
+    AsyncRequest* request = vol->engine.begin(inodeId, false, size, done);
+    if (inode.depth == INLINE_DEPTH) {
+        memcpy(buffer, &inode.data[shift], size);
+    } else if (inode.flags & INODE_COMPRESSED) {
+        // clusters are decompressed at once
+        if (!readClusters(extents, extentsNumber, buffer, size, shift)) vol->engine.fail(request);
+    } else if (!readExtents(extents, extentsNumber, buffer, size, shift, request)) {
+        vol->engine.fail(request);
+    }
+    vol->engine.end(request);
+
+    return true;
+}
+
+// lets readahead know about the read of [shift, shift + size), inode is locked
+void readAhead(int inodeId, int size, int shift) {
+    if (size <= 0) return;
+
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    // inline contents came with the inode
+    if (inode.depth == INLINE_DEPTH) return;
+
+    int from, to;
+    if (vol->readahead.onRead(inodeId, shift / BLOCK_SIZE, (shift + size - 1) / BLOCK_SIZE,
+                              divCeil(inode.size, BLOCK_SIZE), from, to)) {
+        prefetchBlocks(inode, from, to);
+    }
+}
+
+// queues file blocks [from, to) for prefetch by runs of device blocks
+void prefetchBlocks(const Inode& inode, int from, int to) {
+    vector<Extent> tree;
+    const Extent* extents = inode.extents;
+    int extentsNumber = inode.extentsNumber;
+
+    if (inode.depth != 0) {
+        loadExtents(inode, tree);
+        extents = tree.data();
+        extentsNumber = tree.size();
+    }
+
+    while (from < to) {
+        int run;
+        int blockId = mapBlock(extents, extentsNumber, from, run);
+        run = min(run, to - from);
+
+        // holes are zeros, nothing to read
+        if (blockId != -1) vol->readahead.prefetch(blockId, run);
+        from += run;
+    }
+}
+
+// copies bytes [shift, shift + size) of the file into buff,
+// whole blocks are queued to the engine, if there is a request
+bool readExtents(const Extent* extents, int extentsNumber, char* buff, int size, int shift,
+                 AsyncRequest* request) {
+    int bytesRead = 0;
+    bool verified = true;
+
+    while (bytesRead < size) {
+        int blockIndex = (shift + bytesRead) / BLOCK_SIZE;
+        int blockShift = (shift + bytesRead) % BLOCK_SIZE;
+
+        int run;                                    // blocks left in the extent or hole
+        int blockId = mapBlock(extents, extentsNumber, blockIndex, run);
+        int part;
+
+        if (blockShift != 0 || size - bytesRead < BLOCK_SIZE) {
+            // copy only a part of the block
+            part = min(BLOCK_SIZE - blockShift, size - bytesRead);
+            if (!readBlock(blockId, &buff[bytesRead], part, blockShift)) verified = false;
+        } else {
+            // whole blocks of the extent by one transfer
+            int blocks = min(run, (size - bytesRead) / BLOCK_SIZE);
+            part = blocks * BLOCK_SIZE;
+
+            if (blockId == -1) {
+                memset(&buff[bytesRead], 0, part);
+            } else if (request != NULL) {
+                vol->engine.read(request, blockId, blocks, &buff[bytesRead]);
+            } else {
+                if (!vol->cache.readBlocks(blockId, blocks, &buff[bytesRead])) verified = false;
+                vol->journal.overlay(blockId, blocks, &buff[bytesRead]);
+            }
+        }
+
+        bytesRead += part;
+    }
+
+    return verified;
+}
+
+// number of blocks mapped in the cluster of a compressed file
+int clusterBlocks(const Extent* extents, int extentsNumber, int cluster) {
+    int first = cluster * CLUSTER_BLOCKS;
+    int blocks = 0;
+
+    for (int i = first; i < first + CLUSTER_BLOCKS; ) {
+        int run;
+        int blockId = mapBlock(extents, extentsNumber, i, run);
+        run = min(run, first + CLUSTER_BLOCKS - i);
+
+        if (blockId != -1) blocks += run;
+        i += run;
+    }
+
+    return blocks;
+}
+
+// CLUSTER_SIZE bytes of the cluster of a compressed file, false if its stream is damaged
+bool loadCluster(const Extent* extents, int extentsNumber, int cluster, char* data) {
+    int blocks = clusterBlocks(extents, extentsNumber, cluster);
+
+    if (blocks == 0 || blocks == CLUSTER_BLOCKS) {
+        return readExtents(extents, extentsNumber, data, CLUSTER_SIZE, cluster * CLUSTER_SIZE);
+    }
+
+    char stream[CLUSTER_SIZE];
+    if (!readExtents(extents, extentsNumber, stream, blocks * BLOCK_SIZE, cluster * CLUSTER_SIZE)) {
+        memset(data, 0, CLUSTER_SIZE);
+        return false;
+    }
+
+    int streamSize;
+    memcpy(&streamSize, stream, CLUSTER_HEADER);
+
+    if (streamSize <= 0 || streamSize > blocks * BLOCK_SIZE - CLUSTER_HEADER
+            || !lzDecompress(&stream[CLUSTER_HEADER], streamSize, data, CLUSTER_SIZE)) {
+        cout << "Error: compressed cluster " << cluster << " is damaged" << endl;
+        memset(data, 0, CLUSTER_SIZE);
+        return false;
+    }
+
+    return true;
+}
+
+// copies bytes [shift, shift + size) of a compressed file into buff, holes and raw clusters
+// are read in place, compressed ones are decompressed whole; false, if some are damaged
+bool readClusters(const Extent* extents, int extentsNumber, char* buff, int size, int shift) {
+    char data[CLUSTER_SIZE];
+    int bytesRead = 0;
+    bool verified = true;
+
+    while (bytesRead < size) {
+        int cluster = (shift + bytesRead) / CLUSTER_SIZE;
+        int clusterShift = (shift + bytesRead) % CLUSTER_SIZE;
+        int part = min(CLUSTER_SIZE - clusterShift, size - bytesRead);
+
+        int blocks = clusterBlocks(extents, extentsNumber, cluster);
+
+        if (blocks == 0 || blocks == CLUSTER_BLOCKS) {
+            if (!readExtents(extents, extentsNumber, &buff[bytesRead], part, shift + bytesRead)) verified = false;
+        } else {
+            if (!loadCluster(extents, extentsNumber, cluster, data)) verified = false;
+            memcpy(&buff[bytesRead], &data[clusterShift], part);
+        }
+
+        bytesRead += part;
+    }
+
+    return verified;
 }
 
 void ls(const char* path) {
+    FS_STAT_OP(OP_LS);
+
     int linksNumber = 0;
 
     char* absPath = getAbsPath(path);
@@ -234,34 +765,153 @@ void ls(const char* path) {
         return;
     }
 
-    Link* links = getLinks(dirId, linksNumber);
+    Link* links;
+    {
+        shared_lock<shared_mutex> lock(vol->inodeLock(dirId));
+        links = getLinks(dirId, linksNumber);
+    }
+
     for (int i = 0;  i < linksNumber; i++) {
         cout << links[i].fileName << " ";
         cout << links[i].inodeId << endl;
     }
 
+    FS_STAT_ADD(STAT_DIR_ENTRIES_SCANNED, linksNumber);
+
     delete absPath;
     delete links;
 }
 
 void ls() {
+    string wd;
+    {
+        lock_guard<mutex> lock(vol->wdLock);
+        wd = vol->wd;
+    }
+
     ls(wd.c_str());
 }
 
+bool opendir(const char* path, DirCursor& cursor) {
+    FS_STAT_OP(OP_READDIR);
+
+    char* absPath = getAbsPath(path);
+    int dirId = getFileId(absPath);
+
+    Inode inode;
+    if (dirId != -1) {
+        shared_lock<shared_mutex> lock(vol->inodeLock(dirId));
+        readInode(dirId, &inode);
+    }
+
+    if (dirId == -1 || inode.type != 1) {
+        cout << "Error: can't access \"" << absPath << "\" : no such dir" << endl;
+        delete[] absPath;
+        return false;
+    }
+
+    cursor.dirId = dirId;
+    cursor.position = 0;
+
+    delete[] absPath;
+    return true;
+}
+
+// records of the dir from the cursor, stats of the inodes aren't filled
+int readRecords(DirCursor& cursor, DirEntry* entries, int count) {
+    if (cursor.dirId <= 0 || cursor.position < 0 || count < 0) {
+        cout << "Error: dir isn't opened" << endl;
+        return -1;
+    }
+
+    vector<Link> links;
+    {
+        shared_lock<shared_mutex> lock(vol->inodeLock(cursor.dirId));
+
+        Inode inode;
+        readInode(cursor.dirId, &inode);
+
+        if (inode.type != 1 || inode.links == 0) {
+            cout << "Error: dir was removed" << endl;
+            return -1;
+        }
+
+        // only the wanted records are read
+        int linksNumber = inode.size / sizeof(Link);
+        links.resize(max(0, min(count, linksNumber - cursor.position)));
+        if (links.empty()) return 0;
+
+        vector<Extent> extents;
+        loadExtents(inode, extents);
+        readExtents(extents.data(), extents.size(), reinterpret_cast<char*>(links.data()),
+                    links.size() * sizeof(Link), cursor.position * sizeof(Link));
+    }
+
+    for (size_t i = 0; i < links.size(); i++) {
+        memcpy(entries[i].name, links[i].fileName, FNAME_LEN);
+        entries[i].name[FNAME_LEN] = 0;
+        entries[i].inodeId = links[i].inodeId;
+        entries[i].type = -1;
+        entries[i].size = 0;
+        entries[i].links = 0;
+    }
+
+    FS_STAT_ADD(STAT_DIR_ENTRIES_SCANNED, links.size());
+
+    cursor.position += links.size();
+    return links.size();
+}
+
+int readdir(DirCursor& cursor, DirEntry* entries, int count) {
+    FS_STAT_OP(OP_READDIR);
+
+    return readRecords(cursor, entries, count);
+}
+
+int readdirplus(DirCursor& cursor, DirEntry* entries, int count) {
+    FS_STAT_OP(OP_READDIR);
+
+    int entriesNumber = readRecords(cursor, entries, count);
+    if (entriesNumber <= 0) return entriesNumber;
+
+    // inodes are read in the table order, so a huge dir is one sweep over the table
+    vector<int> order(entriesNumber);
+    for (int i = 0; i < entriesNumber; i++) order[i] = i;
+    sort(order.begin(), order.end(), [entries](int a, int b) { return entries[a].inodeId < entries[b].inodeId; });
+
+    vector<int> inodeIds(entriesNumber);
+    for (int i = 0; i < entriesNumber; i++) inodeIds[i] = entries[order[i]].inodeId;
+
+    vector<Inode> inodes(entriesNumber);
+    vol->inodes.read(inodeIds.data(), entriesNumber, inodes.data());
+
+    for (int i = 0; i < entriesNumber; i++) {
+        DirEntry& entry = entries[order[i]];
+        entry.type = inodes[i].type;
+        entry.size = inodes[i].size;
+        entry.links = inodes[i].links;
+    }
+
+    return entriesNumber;
+}
+
 void filestat(int inodeId) {
     bool isFileInDir = true;
 
     Inode inode;
-    readBlock(inodeId, &inode);
+    {
+        shared_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+        readInode(inodeId, &inode);
+    }
 
     if (inode.type == 1) {                        // dir
-        if (inode.size < 2 * sizeof(Link)) isFileInDir = false;
+        if (inode.size < static_cast<int>(2 * sizeof(Link))) isFileInDir = false;
     } else {
         if (inode.size == 0) isFileInDir = false;
     }
 
     // if root dir
-    if (inodeId == root_inode_id) isFileInDir = true;
+    if (inodeId == vol->root_inode_id) isFileInDir = true;
 
     if (!isFileInDir) {
         cout << "Error: incorrect id" << endl;
@@ -281,258 +931,1353 @@ void filestat(int inodeId) {
 }
 
 int open(const char *fileName) {
+    FS_STAT_OP(OP_OPEN);
+
     int fileId = getFileId(fileName);
 
     Inode inode;
-    readBlock(fileId, &inode);
+    {
+        shared_lock<shared_mutex> lock(vol->inodeLock(fileId));
+        readInode(fileId, &inode);
+    }
 
     if (inode.type != 0) {
         cout << "Error: object isn't a file, can't open" << endl;
         return -1;
     }
 
-    if (fileId > 0) openedDescriptors.insert(fileId);
-    return getFileId(fileName);
+    lock_guard<mutex> lock(vol->descriptorsLock);
+    if (fileId > 0) {
+        vol->openedDescriptors.insert(fileId);
+        vol->readahead.open(fileId);
+    }
+    return fileId;
 }
 
 void close(int inodeId) {
-    openedDescriptors.erase(inodeId);
+    FS_STAT_OP(OP_CLOSE);
+
+    flush(inodeId);
+
+    lock_guard<mutex> lock(vol->descriptorsLock);
+    vol->openedDescriptors.erase(inodeId);
+    vol->readahead.close(inodeId);
 }
 
-void link(const char *existFileName, const char *linkName) {
-    char* absExistFileName = getAbsPath(existFileName);
-    int existFileId = getFileId(getAbsPath(absExistFileName));
-    if (existFileId == -1) {
-        cout << "Error: no such file \"" << absExistFileName <<  "\" exists" << endl;
-        delete absExistFileName;
+void advise(int inodeId, Advice advice, int shift, int size) {
+    shared_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    if (inode.type != 0) {
+        cout << "Error: object isn't a file, can't advise" << endl;
         return;
     }
 
-    char* absLinkName = getAbsPath(linkName);
-    int linkFileId = getFileId(getAbsPath(absLinkName));
-    if (linkFileId != -1) {
-        cout << "Error: file \"" << linkName <<  "\" already exists" << endl;
-        delete absLinkName;
+    if (shift < 0 || size < 0) {
+        cout << "Error: negative shift or size is not allowed" << endl;
         return;
     }
 
-    addDirRecord(existFileId, linkName, root_inode_id);
+    vol->readahead.advise(inodeId, advice);
+
+    if (advice == ADVICE_WILLNEED) {
+        int end = min(static_cast<long>(inode.size), static_cast<long>(shift) + size);
+        if (shift < end) prefetchBlocks(inode, shift / BLOCK_SIZE, divCeil(end, BLOCK_SIZE));
+    }
+}
+
+bool setCompression(int inodeId, bool compressed) {
+    JournalHandle handle(vol->journal);
+    unique_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    if (inode.type != 0) {
+        cout << "Error: object isn't a file, can't compress" << endl;
+        return false;
+    }
+
+    if (isReadOnly(inodeId)) return false;
+
+    // clusters are mapped otherwise than blocks, the data isn't converted
+    if (inode.size != 0 || vol->writeBuffer.contains(inodeId)) {
+        cout << "Error: file isn't empty, can't change its compression" << endl;
+        return false;
+    }
+
+    inode.flags = compressed ? inode.flags | INODE_COMPRESSED : inode.flags & ~INODE_COMPRESSED;
+
+    writeInode(inodeId, &inode);
+    return true;
+}
+
+void link(const char *existFileName, const char *linkName) {
+    FS_STAT_OP(OP_LINK);
+    JournalHandle handle(vol->journal);
+
+    char* absExistFileName = getAbsPath(existFileName);
+    int existFileId = getFileId(getAbsPath(absExistFileName));
+    if (existFileId == -1) {
+        cout << "Error: no such file \"" << absExistFileName <<  "\" exists" << endl;
+        delete absExistFileName;
+        return;
+    }
+
+    char* absLinkName = getAbsPath(linkName);
+    int linkFileId = getFileId(getAbsPath(absLinkName));
+    if (linkFileId != -1) {
+        cout << "Error: file \"" << linkName <<  "\" already exists" << endl;
+        delete absLinkName;
+        return;
+    }
+
+    InodesLock lock(vol, vol->root_inode_id, existFileId);
+    if (isReadOnly(existFileId)) return;
+
+    addDirRecord(existFileId, linkName, vol->root_inode_id);
+
+    Inode inode;
+    readInode(existFileId, &inode);
+
+    // increase number of links
+    inode.links += 1;
+
+    writeInode(existFileId, &inode);
+}
+
+void unlink(const char* linkName) {
+    FS_STAT_OP(OP_UNLINK);
+    JournalHandle handle(vol->journal);
+
+    int dirId;
+    int existLinkId;
+
+    // name of the record in dirId, symlinks on the way are resolved
+    string path;
+    char* absLinkName = getAbsPath(linkName);
+    existLinkId = getFileId(absLinkName, dirId, path);
+    delete absLinkName;
+
+    // is not a link or a file
+    if (existLinkId == -1) {
+        cout << "Error: no such link \"" << linkName <<  "\" exist" << endl;
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(vol->descriptorsLock);
+        set<int>::iterator it = vol->openedDescriptors.find(existLinkId);
+
+        // check whether the file is closed
+        if (it != vol->openedDescriptors.end()) {
+            cout << "Error: close file first" << endl;
+            return;
+        }
+    }
+
+    InodesLock lock(vol, dirId, existLinkId);
+    if (isReadOnly(dirId) || isReadOnly(existLinkId)) return;
+
+    unlinkLocked(dirId, existLinkId, splitPath(path.c_str()).back().c_str());
+}
+
+// both dir and file inodes are locked by the caller
+void unlinkLocked(int dirId, int fileId, const char* fileName) {
+    Inode inode;
+    readInode(fileId, &inode);
+
+    if (inode.links > 1) {                      // file has other links
+        if (!removeDirRecord(dirId, fileName, fileId)) return;
+
+        inode.links -= 1;
+        writeInode(fileId, &inode);
+    } else {                                    // file has no other links, delete it
+        if (!removeDirRecord(dirId, fileName, fileId)) return;
+
+        releaseInode(fileId);
+    }
+}
+
+void write(int inodeId, int size, char* data, int shift) {
+    FS_STAT_OP(OP_WRITE);
+    waitHeldBlocks(divCeil(max(size, 0), BLOCK_SIZE) + 1);
+    JournalHandle handle(vol->journal);
+
+    unique_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+    vol->engine.waitInode(inodeId, false);
+    if (isReadOnly(inodeId)) return;
+
+    bufferData(inodeId, size, data, shift);
+}
+
+int write(int inodeId, const char* data, int size, int shift) {
+    IoVec iov;
+    iov.base = const_cast<char*>(data);
+    iov.size = size;
+
+    return writev(inodeId, &iov, 1, shift);
+}
+
+int writev(int inodeId, const IoVec* iov, int count, int shift) {
+    FS_STAT_OP(OP_WRITE);
+
+    int blocks = count;
+    for (int i = 0; i < count; i++) blocks += divCeil(max(iov[i].size, 0), BLOCK_SIZE);
+    waitHeldBlocks(blocks);
+
+    JournalHandle handle(vol->journal);
+
+    unique_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+    vol->engine.waitInode(inodeId, false);
+
+    if (isReadOnly(inodeId) || !checkIoVec(iov, count, shift)) return -1;
+
+    // buffers go one after another in the file
+    int bytesWritten = 0;
+    for (int i = 0; i < count; i++) {
+        if (!bufferData(inodeId, iov[i].size, iov[i].base, shift + bytesWritten)) break;
+        bytesWritten += iov[i].size;
+    }
+
+    return bytesWritten;
+}
+
+bool writeAsync(int inodeId, const char* data, int size, int shift, IoCallback done) {
+    FS_STAT_OP(OP_WRITE);
+    waitHeldBlocks(divCeil(max(size, 0), BLOCK_SIZE) + 1);
+    JournalHandle handle(vol->journal);
+
+    unique_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+    // reads in flight would get blocks, that don't match their sums any more
+    vol->engine.waitInode(inodeId, false);
+
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    if (inode.type != 0) {
+        cout << "Error: object isn't a file, can't write" << endl;
+        return false;
+    }
+
+    if (isReadOnly(inodeId)) return false;
+
+    IoVec iov;
+    iov.base = const_cast<char*>(data);
+    iov.size = size;
+    if (!checkIoVec(&iov, 1, shift)) return false;
+
+    // buffered data goes first, async transfers must not be overwritten by it later
+    if (!flushData(inodeId)) return false;
+
+    // nothing is transferred, if blocks can't be allocated
+    AsyncRequest* request = vol->engine.begin(inodeId, true, size, done);
+    if (!writeData(inodeId, size, data, shift, request)) {
+        vol->engine.cancel(request);
+        return false;
+    }
+
+    vol->engine.end(request);
+    return true;
+}
+
+int poll(bool wait) {
+    vector<AsyncRequest*> finished;
+    vol->engine.reap(wait, finished);
+
+    // callbacks are free to issue new requests
+    for (size_t i = 0; i < finished.size(); i++) {
+        if (finished[i]->done) finished[i]->done(finished[i]->failed ? -1 : finished[i]->bytes);
+        delete finished[i];
+    }
+
+    return finished.size();
+}
+
+bool writeData(int inodeId, int size, const char* data, int shift, AsyncRequest* request) {
+    if (size <= 0) return true;
+
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    if (writeInline(inodeId, inode, size, data, shift)) return true;
+    if (inode.depth == INLINE_DEPTH && !spillInline(inodeId, inode)) return false;
+
+    // clusters are compressed at once, they take new blocks, so the shared ones aren't touched
+    if (inode.flags & INODE_COMPRESSED) return writeClusters(inodeId, inode, size, data, shift);
+
+    vector<Extent> extents;
+    loadExtents(inode, extents);
+
+    int firstBlockIndex = shift / BLOCK_SIZE;
+    int lastBlockIndex = (shift + size - 1) / BLOCK_SIZE;
+
+    // blocks shared with clones are replaced by copies, the partially written ones keep their bytes
+    vector<Extent> newRuns;
+    vector<Extent> sharedRuns;
+    bool unshared = unshareRange(extents, firstBlockIndex, lastBlockIndex, shift % BLOCK_SIZE != 0 || size < BLOCK_SIZE,
+                                 (shift + size) % BLOCK_SIZE != 0, newRuns, sharedRuns);
+
+    // only the first and the last blocks may be written partially
+    int run;
+    bool firstIsNew = mapBlock(extents, firstBlockIndex, run) == -1;
+    bool lastIsNew = mapBlock(extents, lastBlockIndex, run) == -1;
+
+    // allocate runs of blocks for the holes first, so nothing is written on failure
+    if (!unshared || !allocateRange(extents, firstBlockIndex, lastBlockIndex, false, newRuns)
+            || !storeExtents(inode, extents)) {
+        releaseRuns(newRuns);
+        return false;
+    }
+
+    releaseRuns(sharedRuns);
+
+    // dirs and symlinks are metadata, file data goes around the journal
+    bool journaled = inode.type != 0;
+
+    int bytesWritten = 0;
+    char fileBlock[BLOCK_SIZE];
+
+    while (bytesWritten < size) {
+        int blockIndex = (shift + bytesWritten) / BLOCK_SIZE;
+        int blockShift = (shift + bytesWritten) % BLOCK_SIZE;
+
+        int blockId = mapBlock(extents, blockIndex, run);
+        int part;
+
+        if (blockShift != 0 || size - bytesWritten < BLOCK_SIZE) {
+            // write only necessary part of the block
+            part = min(BLOCK_SIZE - blockShift, size - bytesWritten);
+
+            bool isNew = blockIndex == firstBlockIndex ? firstIsNew : lastIsNew;
+            if (isNew) {
+                // new block may keep garbage, the rest of it must be zeros
+                memset(fileBlock, 0, BLOCK_SIZE);
+                memcpy(&fileBlock[blockShift], &data[bytesWritten], part);
+
+                if (journaled) {
+                    writeBlock(blockId, fileBlock);
+                } else {
+                    vol->cache.write(blockId, fileBlock);
+                }
+            } else if (journaled) {
+                writeBlock(blockId, &data[bytesWritten], part, blockShift);
+            } else {
+                vol->cache.write(blockId, &data[bytesWritten], part, blockShift);
+            }
+        } else {
+            // whole blocks of the extent by one transfer
+            int blocks = min(run, (size - bytesWritten) / BLOCK_SIZE);
+            part = blocks * BLOCK_SIZE;
+
+            if (request != NULL) {
+                vol->engine.write(request, blockId, blocks, &data[bytesWritten]);
+            } else if (journaled) {
+                vol->journal.writeBlocks(blockId, blocks, &data[bytesWritten]);
+            } else {
+                vol->cache.writeBlocks(blockId, blocks, &data[bytesWritten]);
+            }
+        }
+
+        bytesWritten += part;
+    }
+
+    if (size + shift > inode.size) inode.size = size + shift;
+
+    writeInode(inodeId, &inode);
+    return true;
+}
+
+// maps the holes of file blocks [firstBlockIndex, lastBlockIndex] by runs of new blocks,
+// false if the device is full; new runs are added to newRuns, so the caller can free them
+bool allocateRange(vector<Extent>& extents, int firstBlockIndex, int lastBlockIndex, bool reserved,
+                   vector<Extent>& newRuns) {
+    for (int i = firstBlockIndex; i <= lastBlockIndex; ) {
+        int run;
+        if (mapBlock(extents, i, run) != -1) {
+            i += run;
+            continue;
+        }
+
+        int holeLength = min(run, lastBlockIndex - i + 1);
+
+        // continue the previous extent on the device, if possible
+        int previousRun;
+        int previousBlock = i > 0 ? mapBlock(extents, i - 1, previousRun) : -1;
+        int goal = previousBlock == -1 ? -1 : previousBlock + 1;
+
+        int length;
+        int blockId = allocateRun(holeLength, goal, length, reserved);
+
+        if (blockId == -1) {
+            cout << "Error: not enough disk space, impossible to write " << endl;
+            return false;
+        }
+
+        addExtent(extents, i, blockId, length);
+
+        Extent newRun;
+        newRun.logical = i;
+        newRun.physical = blockId;
+        newRun.length = length;
+        newRuns.push_back(newRun);
+
+        i += length;
+    }
+
+    return true;
+}
+
+// replaces the blocks of [firstBlockIndex, lastBlockIndex], that are shared with clones, by new
+// ones; the first and the last blocks keep their bytes, if asked. New runs are added to newRuns,
+// the caller frees them on failure, replaced ones to sharedRuns, they lose an owner, when the map
+// is stored
+bool unshareRange(vector<Extent>& extents, int firstBlockIndex, int lastBlockIndex, bool copyFirst,
+                  bool copyLast, vector<Extent>& newRuns, vector<Extent>& sharedRuns) {
+    vector<Extent> runs;
+    {
+        lock_guard<mutex> lock(vol->allocatorLock);
+        if (vol->refCounts.sharedBlocks() == 0) return true;
+
+        for (int i = firstBlockIndex; i <= lastBlockIndex; ) {
+            int run;
+            int blockId = mapBlock(extents, i, run);
+            run = min(run, lastBlockIndex - i + 1);
+
+            for (int j = 0; blockId != -1 && j < run; j++) {
+                if (!vol->refCounts.isShared(blockId + j, 1)) continue;
+
+                // neighbours both in the file and on the device make one run
+                if (!runs.empty() && runs.back().logical + runs.back().length == i + j
+                        && runs.back().physical + runs.back().length == blockId + j) {
+                    runs.back().length++;
+                    continue;
+                }
+
+                Extent shared;
+                shared.logical = i + j;
+                shared.physical = blockId + j;
+                shared.length = 1;
+                runs.push_back(shared);
+            }
+
+            i += run;
+        }
+    }
+
+    char fileBlock[BLOCK_SIZE];
+
+    for (size_t r = 0; r < runs.size(); r++) {
+        for (int done = 0; done < runs[r].length; ) {
+            int length;
+            int blockId = allocateRun(runs[r].length - done, -1, length, false);
+
+            if (blockId == -1) {
+                cout << "Error: not enough disk space, impossible to write " << endl;
+                return false;
+            }
+
+            Extent newRun;
+            newRun.logical = runs[r].logical + done;
+            newRun.physical = blockId;
+            newRun.length = length;
+            newRuns.push_back(newRun);
+
+            Extent sharedRun;
+            sharedRun.logical = newRun.logical;
+            sharedRun.physical = runs[r].physical + done;
+            sharedRun.length = length;
+            sharedRuns.push_back(sharedRun);
+
+            // partially written blocks keep the rest of the old contents
+            for (int i = 0; i < length; i++) {
+                int blockIndex = newRun.logical + i;
+
+                if ((copyFirst && blockIndex == firstBlockIndex) || (copyLast && blockIndex == lastBlockIndex)) {
+                    readBlock(sharedRun.physical + i, fileBlock);
+                    vol->cache.write(blockId + i, fileBlock);
+                }
+            }
+
+            removeExtent(extents, newRun.logical, length);
+            addExtent(extents, newRun.logical, blockId, length);
+            done += length;
+        }
+    }
+
+    return true;
+}
+
+void releaseRuns(const vector<Extent>& runs) {
+    for (size_t i = 0; i < runs.size(); i++) freeRun(runs[i].physical, runs[i].length);
+}
+
+// the copy maps the same blocks as the inode, the blocks get one more owner;
+// inline contents are copied
+bool shareContents(const Inode& inode, Inode& copy) {
+    copy.flags = (copy.flags & ~INODE_COMPRESSED) | (inode.flags & INODE_COMPRESSED);
+
+    if (inode.depth == INLINE_DEPTH) {
+        copy.depth = INLINE_DEPTH;
+        memcpy(copy.data, inode.data, INLINE_SIZE);
+        copy.size = inode.size;
+        return true;
+    }
+
+    vector<Extent> extents;
+    loadExtents(inode, extents);
+
+    {
+        lock_guard<mutex> lock(vol->allocatorLock);
+
+        for (size_t i = 0; i < extents.size(); i++) {
+            if (!vol->refCounts.canShare(extents[i].physical, extents[i].length)) {
+                cout << "Error: blocks have too many owners, impossible to share them" << endl;
+                return false;
+            }
+        }
+
+        for (size_t i = 0; i < extents.size(); i++) vol->refCounts.share(extents[i].physical, extents[i].length);
+    }
+
+    if (!storeExtents(copy, extents)) {
+        releaseRuns(extents);
+        return false;
+    }
+
+    copy.size = inode.size;
+    return true;
+}
+
+// small files and symlinks keep their contents in the inode, so they are read with it;
+// false, if the data doesn't fit there or the file has blocks already
+bool writeInline(int inodeId, Inode& inode, int size, const char* data, int shift) {
+    if (inode.type == 1 || shift > INLINE_SIZE || size > INLINE_SIZE - shift) return false;
+
+    if (inode.depth != INLINE_DEPTH) {
+        // only a file without blocks becomes inline
+        if (inode.depth != 0 || inode.extentsNumber != 0 || inode.size > INLINE_SIZE
+                || vol->writeBuffer.contains(inodeId)) {
+            return false;
+        }
+
+        inode.depth = INLINE_DEPTH;
+        memset(inode.data, 0, INLINE_SIZE);
+    }
+
+    memcpy(&inode.data[shift], data, size);
+    if (size + shift > inode.size) inode.size = size + shift;
+
+    writeInode(inodeId, &inode);
+    return true;
+}
+
+// moves inline contents to a block of their own, so the file may grow past INLINE_SIZE
+bool spillInline(int inodeId, Inode& inode) {
+    char fileBlock[BLOCK_SIZE] = {0};
+    memcpy(fileBlock, inode.data, inode.size);
+
+    inode.depth = 0;
+    inode.extentsNumber = 0;
+
+    // the contents become the first cluster
+    if (inode.size > 0 && (inode.flags & INODE_COMPRESSED)) {
+        if (writeClusters(inodeId, inode, inode.size, fileBlock, 0)) return true;
+
+        readInode(inodeId, &inode);
+        return false;
+    }
+
+    if (inode.size > 0) {
+        int blockId = allocateBlock();
+
+        if (blockId == -1) {
+            cout << "Error: not enough disk space, impossible to write " << endl;
+            readInode(inodeId, &inode);
+            return false;
+        }
+
+        // dirs and symlinks are metadata, file data goes around the journal
+        if (inode.type != 0) {
+            writeBlock(blockId, fileBlock);
+        } else {
+            vol->cache.write(blockId, fileBlock);
+        }
+
+        inode.extentsNumber = 1;
+        inode.extents[0].logical = 0;
+        inode.extents[0].physical = blockId;
+        inode.extents[0].length = 1;
+    }
+
+    writeInode(inodeId, &inode);
+    return true;
+}
+
+// puts new contents of the cluster of a compressed file on new blocks: compressed, raw if that
+// doesn't save a block, none if it is zeros. New runs are added to newRuns, the caller frees them
+// on failure, old ones to oldRuns, they are freed, when the map is stored
+bool storeCluster(vector<Extent>& extents, int cluster, const char* data, vector<Extent>& newRuns,
+                  vector<Extent>& oldRuns) {
+    int first = cluster * CLUSTER_BLOCKS;
+
+    for (int i = first; i < first + CLUSTER_BLOCKS; ) {
+        int run;
+        int blockId = mapBlock(extents, i, run);
+        run = min(run, first + CLUSTER_BLOCKS - i);
+
+        if (blockId != -1) {
+            Extent oldRun;
+            oldRun.logical = i;
+            oldRun.physical = blockId;
+            oldRun.length = run;
+            oldRuns.push_back(oldRun);
+        }
+
+        i += run;
+    }
+
+    removeExtent(extents, first, CLUSTER_BLOCKS);
+
+    char stream[CLUSTER_SIZE];
+    const char* contents = data;
+    int blocks = CLUSTER_BLOCKS;
+
+    if (data[0] == 0 && memcmp(data, data + 1, CLUSTER_SIZE - 1) == 0) {
+        blocks = 0;
+    } else {
+        int streamSize = lzCompress(data, CLUSTER_SIZE, &stream[CLUSTER_HEADER],
+                                    CLUSTER_SIZE - BLOCK_SIZE - CLUSTER_HEADER);
+
+        if (streamSize > 0) {
+            // the rest of the last block is zeros
+            memcpy(stream, &streamSize, CLUSTER_HEADER);
+            blocks = divCeil(CLUSTER_HEADER + streamSize, BLOCK_SIZE);
+            memset(&stream[CLUSTER_HEADER + streamSize], 0, blocks * BLOCK_SIZE - CLUSTER_HEADER - streamSize);
+
+            contents = stream;
+            FS_STAT_ADD(STAT_CLUSTERS_COMPRESSED, 1);
+        } else {
+            FS_STAT_ADD(STAT_CLUSTERS_RAW, 1);
+        }
+    }
+
+    // continue the previous cluster on the device, if possible
+    vector<Extent>::iterator next = upper_bound(extents.begin(), extents.end(), first,
+                                                [](int logical, const Extent& extent) { return logical < extent.logical; });
+    int goal = next == extents.begin() ? -1 : (next - 1)->physical + (next - 1)->length;
+
+    for (int done = 0; done < blocks; ) {
+        int length;
+        int blockId = allocateRun(blocks - done, goal, length, false);
+
+        if (blockId == -1) {
+            cout << "Error: not enough disk space, impossible to write " << endl;
+            return false;
+        }
+
+        vol->cache.writeBlocks(blockId, length, &contents[done * BLOCK_SIZE]);
+        addExtent(extents, first + done, blockId, length);
+
+        Extent newRun;
+        newRun.logical = first + done;
+        newRun.physical = blockId;
+        newRun.length = length;
+        newRuns.push_back(newRun);
+
+        done += length;
+        goal = blockId + length;
+    }
+
+    return true;
+}
+
+// writes bytes [shift, shift + size) of a compressed file by whole clusters, partially written
+// ones are read first; nothing is changed on failure. The file is locked exclusively
+bool writeClusters(int inodeId, Inode& inode, int size, const char* data, int shift) {
+    vector<Extent> extents;
+    loadExtents(inode, extents);
+
+    vector<Extent> newRuns;
+    vector<Extent> oldRuns;
+    char cluster[CLUSTER_SIZE];
+    bool stored = true;
+
+    for (int bytesWritten = 0; bytesWritten < size && stored; ) {
+        int index = (shift + bytesWritten) / CLUSTER_SIZE;
+        int clusterShift = (shift + bytesWritten) % CLUSTER_SIZE;
+        int part = min(CLUSTER_SIZE - clusterShift, size - bytesWritten);
+        const char* contents = &data[bytesWritten];
+
+        if (part != CLUSTER_SIZE) {
+            loadCluster(extents.data(), extents.size(), index, cluster);
+            memcpy(&cluster[clusterShift], &data[bytesWritten], part);
+            contents = cluster;
+        }
+
+        stored = storeCluster(extents, index, contents, newRuns, oldRuns);
+        bytesWritten += part;
+    }
+
+    if (!stored || !storeExtents(inode, extents)) {
+        releaseRuns(newRuns);
+        return false;
+    }
+
+    releaseRuns(oldRuns);
+
+    if (size + shift > inode.size) inode.size = size + shift;
+
+    writeInode(inodeId, &inode);
+    return true;
+}
+
+// writes the buffered blocks of a compressed file by whole clusters, the rest of a cluster
+// is taken from the device; nothing is changed on failure
+bool flushClusters(Inode& inode, vector<Extent>& extents, const WriteBuffer::Blocks& blocks) {
+    vector<Extent> newRuns;
+    vector<Extent> oldRuns;
+    char cluster[CLUSTER_SIZE];
+    bool stored = true;
+
+    for (WriteBuffer::Blocks::const_iterator it = blocks.begin(); it != blocks.end() && stored; ) {
+        int index = it->first / CLUSTER_BLOCKS;
+
+        WriteBuffer::Blocks::const_iterator end = it;
+        int buffered = 0;
+        while (end != blocks.end() && end->first / CLUSTER_BLOCKS == index) {
+            end++;
+            buffered++;
+        }
+
+        if (buffered < CLUSTER_BLOCKS) loadCluster(extents.data(), extents.size(), index, cluster);
+
+        for (; it != end; it++) {
+            memcpy(&cluster[(it->first % CLUSTER_BLOCKS) * BLOCK_SIZE], it->second.data, BLOCK_SIZE);
+        }
+
+        stored = storeCluster(extents, index, cluster, newRuns, oldRuns);
+    }
+
+    if (!stored || !storeExtents(inode, extents)) {
+        releaseRuns(newRuns);
+        return false;
+    }
+
+    releaseRuns(oldRuns);
+    return true;
+}
+
+// drops the clusters of a compressed file past newSize, the tail of the last one is zeroed
+void truncateClusters(int inodeId, Inode& inode, int newSize) {
+    vector<Extent> extents;
+    loadExtents(inode, extents);
+
+    freeExtents(extents, divCeil(newSize, CLUSTER_SIZE) * CLUSTER_BLOCKS);
+    unreserveBlocks(vol->writeBuffer.truncate(inodeId, newSize));
+
+    vector<Extent> newRuns;
+    vector<Extent> oldRuns;
+    int index = newSize / CLUSTER_SIZE;
+
+    if (newSize % CLUSTER_SIZE != 0 && clusterBlocks(extents.data(), extents.size(), index) != 0) {
+        vector<Extent> kept = extents;
+
+        char cluster[CLUSTER_SIZE];
+        loadCluster(extents.data(), extents.size(), index, cluster);
+        memset(&cluster[newSize % CLUSTER_SIZE], 0, CLUSTER_SIZE - newSize % CLUSTER_SIZE);
+
+        // the tail is left, if there is no space for the cluster
+        if (!storeCluster(extents, index, cluster, newRuns, oldRuns)) {
+            releaseRuns(newRuns);
+            newRuns.clear();
+            oldRuns.clear();
+            extents.swap(kept);
+        }
+    }
+
+    if (storeExtents(inode, extents)) {
+        releaseRuns(oldRuns);
+    } else {
+        releaseRuns(newRuns);
+    }
+}
+
+// data of regular files is kept in the write buffer, holes only get blocks reserved;
+// the file is locked exclusively
+bool bufferData(int inodeId, int size, const char* data, int shift) {
+    if (size <= 0) return true;
+
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    if (writeInline(inodeId, inode, size, data, shift)) return true;
+    if (inode.depth == INLINE_DEPTH && !spillInline(inodeId, inode)) return false;
+
+    int firstBlockIndex = shift / BLOCK_SIZE;
+    int lastBlockIndex = (shift + size - 1) / BLOCK_SIZE;
+
+    // big writes are contiguous already, buffered data goes first to keep the order
+    if (inode.type != 0 || !vol->writeBuffer.fits(lastBlockIndex - firstBlockIndex + 1)) {
+        return flushData(inodeId) && writeData(inodeId, size, data, shift);
+    }
+
+    vector<Extent> extents;
+    loadExtents(inode, extents);
+
+    // reserve blocks for the holes first, so nothing is buffered on failure
+    int holes = 0;
+    for (int i = firstBlockIndex; i <= lastBlockIndex; ) {
+        int run;
+        int blockId = mapBlock(extents, i, run);
+        run = min(run, lastBlockIndex - i + 1);
+
+        for (int j = i; blockId == -1 && j < i + run; j++) {
+            if (!vol->writeBuffer.contains(inodeId, j)) holes++;
+        }
+
+        i += run;
+    }
+
+    if (holes > 0 && !reserveBlocks(holes)) {
+        cout << "Error: not enough disk space, impossible to write " << endl;
+        return false;
+    }
+
+    int bytesWritten = 0;
+    char fileBlock[BLOCK_SIZE];
+
+    while (bytesWritten < size) {
+        int blockIndex = (shift + bytesWritten) / BLOCK_SIZE;
+        int blockShift = (shift + bytesWritten) % BLOCK_SIZE;
+        int part = min(BLOCK_SIZE - blockShift, size - bytesWritten);
+
+        if (vol->writeBuffer.contains(inodeId, blockIndex)) {
+            vol->writeBuffer.update(inodeId, blockIndex, &data[bytesWritten], part, blockShift);
+        } else {
+            int run;
+            int blockId = mapBlock(extents, blockIndex, run);
+
+            // the rest of a partially written block is taken from the device, holes are zeros
+            if (part != BLOCK_SIZE && (inode.flags & INODE_COMPRESSED)) {
+                readClusters(extents.data(), extents.size(), fileBlock, BLOCK_SIZE, blockIndex * BLOCK_SIZE);
+            } else if (part != BLOCK_SIZE) {
+                if (blockId == -1) {
+                    memset(fileBlock, 0, BLOCK_SIZE);
+                } else {
+                    readBlock(blockId, fileBlock);
+                }
+            }
+
+            memcpy(&fileBlock[blockShift], &data[bytesWritten], part);
+            vol->writeBuffer.put(inodeId, blockIndex, fileBlock, blockId == -1);
+        }
+
+        bytesWritten += part;
+    }
+
+    if (size + shift > inode.size) {
+        inode.size = size + shift;
+        writeInode(inodeId, &inode);
+    }
+
+    // too much data is kept in memory, the file is written out
+    if (vol->writeBuffer.isFull()) flushData(inodeId);
+
+    return true;
+}
+
+// allocates blocks for the buffered data of the file and writes it by runs of
+// device blocks; the data is kept buffered on failure. The file is locked exclusively
+bool flushData(int inodeId) {
+    WriteBuffer::Blocks blocks;
+    vol->writeBuffer.take(inodeId, blocks);
+    if (blocks.empty()) return true;
+
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    vector<Extent> extents;
+    loadExtents(inode, extents);
+
+    int reserved = 0;
+    for (WriteBuffer::Blocks::iterator it = blocks.begin(); it != blocks.end(); it++) {
+        if (it->second.reserved) reserved++;
+    }
+
+    if (inode.flags & INODE_COMPRESSED) {
+        if (!flushClusters(inode, extents, blocks)) {
+            vol->writeBuffer.restore(inodeId, blocks);
+            return false;
+        }
+
+        unreserveBlocks(reserved);
+        writeInode(inodeId, &inode);
+        return true;
+    }
+
+    // holes of all the runs of buffered blocks get blocks first, nothing is written on failure;
+    // buffered blocks are whole, shared ones are replaced without copying
+    vector<Extent> newRuns;
+    vector<Extent> sharedRuns;
+    bool allocated = true;
+
+    for (WriteBuffer::Blocks::iterator it = blocks.begin(); it != blocks.end() && allocated; ) {
+        int first = it->first;
+        int last = first;
+        while (++it != blocks.end() && it->first == last + 1) last++;
+
+        allocated = unshareRange(extents, first, last, false, false, newRuns, sharedRuns)
+                && allocateRange(extents, first, last, true, newRuns);
+    }
+
+    if (!allocated || !storeExtents(inode, extents)) {
+        releaseRuns(newRuns);
+        vol->writeBuffer.restore(inodeId, blocks);
+        return false;
+    }
+
+    unreserveBlocks(reserved);
+    releaseRuns(sharedRuns);
+
+    // blocks, that follow one another both in the file and on the device, go by one transfer
+    vector<char> transfer;
+
+    for (WriteBuffer::Blocks::iterator it = blocks.begin(); it != blocks.end(); ) {
+        int run;
+        int blockId = mapBlock(extents, it->first, run);
+        int logical = it->first;
+        int count = 0;
+
+        transfer.clear();
+        while (it != blocks.end() && it->first == logical + count && count < run) {
+            transfer.insert(transfer.end(), it->second.data, it->second.data + BLOCK_SIZE);
+            count++;
+            it++;
+        }
+
+        vol->cache.writeBlocks(blockId, count, transfer.data());
+    }
+
+    writeInode(inodeId, &inode);
+    return true;
+}
+
+void truncate(const char *fileName, int newSize) {
+    int inodeId = getFileId(fileName);
+    if (inodeId == -1) {
+        cout << "Error: no such file found" << endl;
+        return;
+    }
+
+    if (newSize < 0) {
+        cout << "Error: negative size is not allowed" << endl;
+        return;
+    }
+
+    truncate(inodeId, newSize);
+}
+
+void mkdir(const char* dirName) {
+    FS_STAT_OP(OP_MKDIR);
+    create(dirName, 1);
+}
+
+void cd(const char* path) {
+    FS_STAT_OP(OP_CD);
+
+    int dirId;                  // parent dir
+    int fileId;                 // file inode id
+    string newPath;             // new path
+
+    char* absPath = getAbsPath(path);
+
+    fileId = getFileId(absPath, dirId, newPath);
+
+    if (fileId == -1) {
+        cout << "Error: no such object exists" << endl;
+        return;
+    }
+
+    Inode inode;
+    {
+        shared_lock<shared_mutex> lock(vol->inodeLock(fileId));
+        readInode(fileId, &inode);
+    }
+
+    if (inode.type != 1) {
+        cout << "Error: not a directory" << endl;
+        return;
+    }
+
+    newPath = simplifyPath(splitPath(newPath.c_str()));
+    if (newPath.back() != '/') newPath.append("/");
+
+    lock_guard<mutex> lock(vol->wdLock);
+    vol->wd = newPath;
+}
+
+void symlink(char* from, const char* name) {
+    FS_STAT_OP(OP_SYMLINK);
+    create(name, 2, from);
+}
+
+void rmdir(const char* dirName) {
+    FS_STAT_OP(OP_RMDIR);
+    JournalHandle handle(vol->journal);
+
+    int dirId;
+    int parentDirId;
+
+    string path;
+    char* absDirName = getAbsPath(dirName);
+
+    dirId = getFileId(absDirName, parentDirId, path);
+
+    if (dirId == -1) {
+        cout << "Error: no such dir exists" << endl;
+        delete[] absDirName;
+        return;
+    }
+
+    delete[] absDirName;
+
+    InodesLock lock(vol, parentDirId, dirId);
+    if (isReadOnly(parentDirId) || isReadOnly(dirId)) return;
+
+    Inode inode;
+    readInode(dirId, &inode);
+
+    if (inode.type != 1) {
+        cout << "Error: not a directory" << endl;
+        return;
+    }
+
+    if (inode.size > static_cast<int>(2 * sizeof(Link))) {
+        cout << "Error: this directory is not empty" << endl;
+        return;
+    }
+
+    unlinkLocked(parentDirId, dirId, splitPath(path.c_str()).back().c_str());
+}
+
+int clone(const char* existFileName, const char* cloneName) {
+    FS_STAT_OP(OP_CLONE);
+    JournalHandle handle(vol->journal);
+
+    int existFileId = getFileId(existFileName);
+    if (existFileId == -1) {
+        cout << "Error: no such file \"" << existFileName <<  "\" exists" << endl;
+        return -1;
+    }
+
+    Inode inode;
+    {
+        shared_lock<shared_mutex> lock(vol->inodeLock(existFileId));
+        readInode(existFileId, &inode);
+    }
+
+    if (inode.type != 0) {
+        cout << "Error: object isn't a file, can't clone" << endl;
+        return -1;
+    }
+
+    int cloneId = create(cloneName);
+    if (cloneId == -1) return -1;
+
+    bool cloned;
+    {
+        InodesLock lock(vol, existFileId, cloneId);
+
+        // buffered and async data must be on the blocks, that are shared
+        vol->engine.waitInode(existFileId, false);
+        cloned = flushData(existFileId);
+
+        Inode copy;
+        readInode(existFileId, &inode);
+        readInode(cloneId, &copy);
+
+        cloned = cloned && shareContents(inode, copy);
+        if (cloned) writeInode(cloneId, &copy);
+    }
+
+    if (!cloned) {
+        fs::unlink(cloneName);
+        return -1;
+    }
+
+    return cloneId;
+}
+
+bool snapshot(const char* dirName) {
+    FS_STAT_OP(OP_SNAPSHOT);
+    JournalHandle handle(vol->journal);
 
-    Inode inode;
-    readBlock(existFileId, &inode);
+    char* absDirName = getAbsPath(dirName);
 
-    // increase number of links
-    inode.links += 1;
+    int parentDirId = -1;
+    int fileId = getFileId(absDirName, parentDirId);
 
-    writeBlock(existFileId, &inode);
-}
+    if (fileId != -1) {
+        cout << "Error: object \"" << absDirName <<  "\" already exists" << endl;
+        delete[] absDirName;
+        return false;
+    }
 
-void unlink(const char* linkName) {
-    int dirId;
-    int existLinkId;
+    delete[] absDirName;
 
-    char* absLinkName = getAbsPath(linkName);
-    existLinkId = getFileId(absLinkName, dirId);
-    delete absLinkName;
+    if (parentDirId == -1) {
+        cout << "Error: bad path" << endl;
+        return false;
+    }
 
-    // is not a link or a file
-    if (existLinkId == -1) {
-        cout << "Error: no such link \"" << linkName <<  "\" exist" << endl;
-        return;
+    string name = splitPath(dirName).back();
+    if (name.size() > FNAME_LEN - 1) {
+        cout << "Error: object name " << name << " is too long" << endl;
+        return false;
     }
 
-    Inode inode;
-    readBlock(existLinkId, &inode);
+    // the tree doesn't change, while it is copied; all the data gets to the blocks to share
+    AllInodesLock lock(vol);
+    vol->engine.waitAll();
 
-    set<int>::iterator it = openedDescriptors.find(existLinkId);
+    vector<int> files = vol->writeBuffer.files();
+    for (size_t i = 0; i < files.size(); i++) flushData(files[i]);
 
-    // check whether the file is closed
-    if (it != openedDescriptors.end()) {
-        cout << "Error: close file first" << endl;
-        return;
-    }
+    Inode parentInode;
+    readInode(parentDirId, &parentInode);
 
-    if (inode.links > 1) {                      // file has other links
-        inode.links -= 1;
-        removeDirRecord(dirId, existLinkId);
-        writeBlock(existLinkId, &inode);
-    } else {                                    // file has no other links, delete it
-        truncate(existLinkId, 0);
-        removeDirRecord(dirId, existLinkId);
-        setBlockUnused(existLinkId);
+    if (parentInode.links == 0) {                // dir was removed meanwhile
+        cout << "Error: bad path" << endl;
+        return false;
     }
-}
 
-void write(int inodeId, int size, char* data, int shift) {
-    if (size > BLOCKS_PER_INODE * BLOCK_SIZE) {
-        cout << "Error: size " << size << " out of " <<
-                BLOCKS_PER_INODE * BLOCK_SIZE << " is too big" <<  endl;
-        cout << "in write" << endl;
-        return;
+    if (isReadOnly(parentDirId)) return false;
+
+    if (findLink(parentDirId, name.c_str()) != -1) {
+        cout << "Error: object \"" << name <<  "\" already exists" << endl;
+        return false;
     }
 
-    if (size <= 0) return;
+    vector<int> created;
+    int copyId = copyTree(vol->root_inode_id, parentDirId, created);
+    if (copyId != -1 && addDirRecord(copyId, name.c_str(), parentDirId)) return true;
 
-    Inode inode;
-    readBlock(inodeId, &inode);
+    for (size_t i = created.size(); i-- > 0; ) releaseInode(created[i]);
+    return false;
+}
 
-    // truncate first (there is no enough space to write)
-    if (size + shift > inode.size) {
-        truncate(inodeId, size + shift);
-        readBlock(inodeId, &inode);
-    }
+bool removeSnapshot(const char* dirName) {
+    FS_STAT_OP(OP_SNAPSHOT);
+    JournalHandle handle(vol->journal);
 
-    int firstBlockShift = shift % BLOCK_SIZE;
-    int firstBlockIndex = shift / BLOCK_SIZE;
-    int curBlockIndex = firstBlockIndex;
-    int lastBlockIndex = divFloor(inode.size, BLOCK_SIZE);
-    int bytesWritten = 0;
+    int parentDirId;
+    string path;
+    char* absDirName = getAbsPath(dirName);
+    int dirId = getFileId(absDirName, parentDirId, path);
+    delete[] absDirName;
 
-    // shift exist
-    if (firstBlockShift != 0) {
-        // write to the first block
-        if (!setInodeBlockByIndex(inode, curBlockIndex)) return;
+    if (dirId == -1) {
+        cout << "Error: no such dir exists" << endl;
+        return false;
+    }
 
-        setBlockUsed(inode.blocks[curBlockIndex]);
+    AllInodesLock lock(vol);
 
-        // write only necessary part of file
-        bytesWritten = min(BLOCK_SIZE - firstBlockShift, size);
-        writeBlock(inode.blocks[curBlockIndex], data, bytesWritten, firstBlockShift);
+    Inode inode;
+    readInode(dirId, &inode);
+    Inode parentInode;
+    readInode(parentDirId, &parentInode);
 
-        curBlockIndex++;
+    if (inode.type != 1 || !(inode.flags & INODE_READONLY) || (parentInode.flags & INODE_READONLY)) {
+        cout << "Error: not a snapshot" << endl;
+        return false;
     }
 
-    for (int i = curBlockIndex; i < lastBlockIndex; i++) {
-        if (!setInodeBlockByIndex(inode, i)) {
-            for (int j = firstBlockIndex; j <= i; j++) {
-                setBlockUnused(inode.blocks[j]);
-            }
-            return;
-        }
-
-        setBlockUsed(inode.blocks[i]);
-        writeBlock(inode.blocks[i], &data[bytesWritten], BLOCK_SIZE);
-        bytesWritten += BLOCK_SIZE;
+    if (!removeDirRecord(parentDirId, splitPath(path.c_str()).back().c_str(), dirId)) {
+        cout << "Error: no such dir exists" << endl;
+        return false;
     }
 
-    // copy leftover part of the last block, if not copied previously
-    if (curBlockIndex <= lastBlockIndex) {
-        int lastBlockPart = inode.size - bytesWritten;
+    // objects of the snapshot lose a link per record, the ones left without links are freed
+    deque<int> dirs;
+    dirs.push_back(dirId);
 
-        if (!setInodeBlockByIndex(inode, lastBlockIndex)) return;
-        setBlockUsed(inode.blocks[lastBlockIndex]);
-        writeBlock(inode.blocks[lastBlockIndex], &data[bytesWritten], lastBlockPart);
-    }
+    while (!dirs.empty()) {
+        int id = dirs.front();
+        dirs.pop_front();
 
-    writeBlock(inodeId, &inode);
-}
+        int linksNumber;
+        Link* links = getLinks(id, linksNumber);
 
-void truncate(const char *fileName, int newSize) {
-    int inodeId = getFileId(fileName);
-    if (inodeId == -1) {
-        cout << "Error: no such file found" << endl;
-        return;
-    }
+        for (int i = 0; i < linksNumber; i++) {
+            if (!strcmp(links[i].fileName, ".") || !strcmp(links[i].fileName, "..")) continue;
 
-    // size is too big
-    if (newSize > BLOCKS_PER_INODE * BLOCK_SIZE) {
-        cout << "Error: size " << newSize << " out of " <<
-                BLOCKS_PER_INODE * BLOCK_SIZE << " is too big" <<  endl;
-        cout << "in truncate" << endl;
-        return;
-    } else if (newSize < 0) {
-        cout << "Error: negative size is not allowed" << endl;
-        return;
+            Inode child;
+            readInode(links[i].inodeId, &child);
+
+            if (--child.links > 0) {
+                writeInode(links[i].inodeId, &child);
+            } else if (child.type == 1) {
+                dirs.push_back(links[i].inodeId);
+            } else {
+                releaseInode(links[i].inodeId);
+            }
+        }
+
+        delete[] links;
+        releaseInode(id);
     }
 
-    truncate(inodeId, newSize);
+    return true;
 }
 
-void mkdir(const char* dirName) {
-    create(dirName, 1);
-}
+// copies the tree of dirId for a snapshot, the copy of dirId gets ".." to parentId; hard links stay
+// links between the copies, read-only objects (other snapshots) are left out. Id of the copy, -1 on
+// failure; all the inodes made are added to created
+int copyTree(int dirId, int parentId, vector<int>& created) {
+    map<int, int> copies;                       // original inode -> its copy
+    map<int, int> records;                      // copy -> records pointing to it
+
+    int treeCopyId = copyInode(dirId, created);
+    if (treeCopyId == -1) return -1;
+    copies[dirId] = treeCopyId;
+
+    // original dirs with the parents of their copies
+    deque<pair<int, int> > dirs;
+    dirs.push_back(make_pair(dirId, parentId));
+
+    while (!dirs.empty()) {
+        int originalId = dirs.front().first;
+        int copyId = copies[originalId];
+        int copyParentId = dirs.front().second;
+        dirs.pop_front();
+
+        int linksNumber;
+        Link* links = getLinks(originalId, linksNumber);
+        vector<Link> copyLinks;
+        bool copied = true;
+
+        for (int i = 0; i < linksNumber; i++) {
+            Link link = links[i];
+
+            if (!strcmp(link.fileName, ".")) {
+                link.inodeId = copyId;
+            } else if (!strcmp(link.fileName, "..")) {
+                link.inodeId = copyParentId;
+            } else {
+                Inode child;
+                readInode(link.inodeId, &child);
+                if (child.flags & INODE_READONLY) continue;
+
+                map<int, int>::iterator it = copies.find(link.inodeId);
+                if (it == copies.end()) {
+                    int childCopyId = copyInode(link.inodeId, created);
+                    copied = childCopyId != -1;
+                    if (!copied) break;
+
+                    it = copies.insert(make_pair(link.inodeId, childCopyId)).first;
+                    if (child.type == 1) dirs.push_back(make_pair(link.inodeId, copyId));
+                }
 
-void cd(const char* path) {
-    int dirId;                  // parent dir
-    int fileId;                 // file inode id
-    string newPath;             // new path
+                link.inodeId = it->second;
+                records[it->second]++;
+            }
 
-    char* absPath = getAbsPath(path);
+            copyLinks.push_back(link);
+        }
 
-    fileId = getFileId(absPath, dirId, newPath);
+        delete[] links;
 
-    if (fileId == -1) {
-        cout << "Error: no such object exists" << endl;
-        return;
+        int size = copyLinks.size() * sizeof(Link);
+        if (!copied || !writeData(copyId, size, reinterpret_cast<const char*>(copyLinks.data()))) return -1;
+        if (static_cast<int>(copyLinks.size()) > DIR_INDEX_THRESHOLD) buildDirIndex(copyId);
     }
 
-    Inode inode;
-    readBlock(fileId, &inode);
+    // the copy of dirId gets its record, when it is done
+    records[treeCopyId] = 1;
 
-    if (inode.type != 1) {
-        cout << "Error: not a directory" << endl;
-        return;
+    for (map<int, int>::iterator it = records.begin(); it != records.end(); it++) {
+        Inode copy;
+        readInode(it->first, &copy);
+        copy.links = it->second;
+        writeInode(it->first, &copy);
     }
 
-    newPath = simplifyPath(splitPath(newPath.c_str()));
-    if (newPath.back() != '/') newPath.append("/");
-    wd = newPath;
+    return treeCopyId;
 }
 
-void symlink(char* from, const char* name) {
-    create(name, 2, from);
-}
+// new read-only inode with the contents of inodeId, dirs get their records later
+int copyInode(int inodeId, vector<int>& created) {
+    Inode inode;
+    readInode(inodeId, &inode);
 
-void rmdir(const char* dirName) {
-    int dirId;
-    int parentDirId;
+    int copyId = allocateInode();
 
-    char* absDirName = getAbsPath(dirName);
+    if (copyId == -1) {
+        cout << "Error: no free inodes available" << endl;
+        return -1;
+    }
 
-    dirId = getFileId(absDirName, parentDirId);
+    Inode copy;
+    memset(&copy, 0, sizeof(Inode));
+    copy.type = inode.type;
+    copy.flags = INODE_READONLY;
 
-    if (dirId == -1) {
-        cout << "Error: no such dir exists" << endl;
-        delete absDirName;
-        return;
+    if (inode.type != 1 && !shareContents(inode, copy)) {
+        freeInode(copyId);
+        return -1;
     }
 
+    writeInode(copyId, &copy);
+    created.push_back(copyId);
+    return copyId;
+}
+
+// the object can't be changed, if it belongs to a snapshot
+bool isReadOnly(int inodeId) {
     Inode inode;
-    readBlock(dirId, &inode);
+    readInode(inodeId, &inode);
 
-    if (inode.type != 1) {
-        cout << "Error: not a directory" << endl;
-        delete absDirName;
-        return;
+    if (inode.flags & INODE_READONLY) {
+        cout << "Error: object is read-only" << endl;
+        return true;
     }
 
-    if (inode.size > 2 * sizeof(Link)) {
-        cout << "Error: this directory is not empty" << endl;
-        delete absDirName;
-        return;
-    }
+    return false;
+}
 
-    unlink(absDirName);
-    delete absDirName;
+// frees the inode with its blocks, its links are gone already
+void releaseInode(int inodeId) {
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    if (inode.indexRoot != 0) dropDirIndex(inodeId);
+    if (inode.type == 1) vol->dentries.invalidateDir(inodeId);
+    truncateData(inodeId, 0);
+    freeInode(inodeId);
 }
 
 void pwd() {
-    cout << wd << endl;
+    lock_guard<mutex> lock(vol->wdLock);
+    cout << vol->wd << endl;
 }
 
 int getFileId(const char* absFileName, int &parentDirId, string &path) {
-    int filesInDir;
-    Link* links;
+    FS_STAT_OP(OP_LOOKUP);
 
     parentDirId = -1;                              // id of the parent dir
     vector<string> names = splitPath(absFileName); // path names, including symlinks
     string curName = names[1];                     // names[0] is "/"
     int curNameInd = 1;                            // index in names
-    int curFileId = root_inode_id;                 // current file looked up
+    int curFileId = vol->root_inode_id;            // current file looked up
+    bool curIsDir = true;                          // names are cached for dirs only
     path.append("/");
 
     vector<string> symNames;                       // current symlink path
-    vector<string>::iterator linkName;             // current link in symlinks
+    vector<string>::iterator linkName = symNames.end();   // current link in symlinks
 
     int pathLen = names.size() - 1;                // names[0] is "/"
 
@@ -542,8 +2287,6 @@ int getFileId(const char* absFileName, int &parentDirId, string &path) {
             break;
         }
 
-        links = getLinks(curFileId, filesInDir);
-
         // use name from path
         if (linkName == symNames.end()) {
             curName = names[curNameInd++];
@@ -556,43 +2299,70 @@ int getFileId(const char* absFileName, int &parentDirId, string &path) {
         path.append(curName);
         path.append("/");
 
-        for (int i = 0; i < filesInDir; i++) {
-            if (!curName.compare(links[i].fileName)) {         // name matches
-                int tempFileId = parentDirId;
-                parentDirId = curFileId;
-                curFileId = links[i].inodeId;
+        // look the name up in the dentry cache first
+        Dentry dentry;
+        if (!curIsDir || !vol->dentries.lookup(curFileId, curName, dentry)) {
+            long generation;
+
+            // holding the dir lock only meanwhile
+            {
+                shared_lock<shared_mutex> lock(vol->inodeLock(curFileId));
+                generation = vol->dentries.generation();
+                dentry.inodeId = findLink(curFileId, curName.c_str());
+            }
+
+            dentry.type = 0;
+            dentry.target.clear();
+
+            if (dentry.inodeId != -1) {
+                shared_lock<shared_mutex> lock(vol->inodeLock(dentry.inodeId));
 
                 Inode inode;
-                readBlock(curFileId, &inode);
+                readInode(dentry.inodeId, &inode);
+                dentry.type = inode.type;
+
+                if (inode.type == 2 && inode.depth == INLINE_DEPTH) {
+                    dentry.target.assign(inode.data, strnlen(inode.data, inode.size));
+                } else if (inode.type == 2) {
+                    // a damaged target leaves the link dangling
+                    char* symLink = readData(dentry.inodeId, inode.size);
+                    if (symLink != NULL) dentry.target.assign(symLink, strnlen(symLink, inode.size));
+                    delete[] symLink;
+                }
+            }
+
+            // records of a file may change with any write, they aren't cached
+            if (curIsDir) vol->dentries.insert(curFileId, curName, dentry, generation);
+        }
 
-                if (inode.type == 2) {                        // is a symlink
-                    char* symLink = read(curFileId, inode.size);
-                    symNames = splitPath(reinterpret_cast<const char*>(symLink));
+        if (dentry.inodeId == -1) {
+            parentDirId = curFileId;
+            curFileId = -1;
+            continue;
+        }
 
-                    delete symLink;
+        int tempFileId = parentDirId;
+        bool parentIsDir = curIsDir;
+        parentDirId = curFileId;
+        curFileId = dentry.inodeId;
+        curIsDir = dentry.type == 1;
 
-                    curFileId = parentDirId;
-                    parentDirId = tempFileId;
+        if (dentry.type == 2) {                       // is a symlink
+            symNames = splitPath(dentry.target.c_str());
 
-                    if (symNames[0] == "/") {
-                        curFileId = root_inode_id;
-                        symNames.erase(symNames.begin(), symNames.begin() + 1);
-                        pathLen--;
-                    }
+            curFileId = parentDirId;
+            parentDirId = tempFileId;
+            curIsDir = parentIsDir;
 
-                    pathLen += symNames.size();
-                    linkName = symNames.begin();
-                }
-                break;
+            if (symNames[0] == "/") {
+                curFileId = vol->root_inode_id;
+                curIsDir = true;
+                symNames.erase(symNames.begin(), symNames.begin() + 1);
             }
 
-            if (i == filesInDir - 1) {
-                parentDirId = curFileId;
-                curFileId = -1;
-            }
+            pathLen += symNames.size();
+            linkName = symNames.begin();
         }
-
-        delete links;
     }
 
     return curFileId;
@@ -631,78 +2401,134 @@ vector<string> splitPath(const char* path) {
 }
 
 void truncate(int inodeId, int newSize) {
-    Inode inode;
-    readBlock(inodeId, &inode);
-
-    int newBlocksNumber = divCeil(newSize, BLOCK_SIZE);
-    int blocksNumber;                           // number of blocks before truncate()
+    FS_STAT_OP(OP_TRUNCATE);
+    JournalHandle handle(vol->journal);
+    unique_lock<shared_mutex> lock(vol->inodeLock(inodeId));
+    if (isReadOnly(inodeId)) return;
 
-    blocksNumber = divCeil(inode.size, BLOCK_SIZE);
+    truncateData(inodeId, newSize);
+}
 
-    if (newSize > inode.size) { // add new blocks if needed
-        // create imaginary blocks, that are not presented in memory (with all zeros)
+void truncateData(int inodeId, int newSize) {
+    // blocks may be freed, no transfer may be left on them
+    vol->engine.waitInode(inodeId, false);
 
-        if (inode.size > 0) {
-            clearBlock(inode.blocks[blocksNumber], BLOCK_SIZE - inode.size, inode.size);
-            blocksNumber++;
+    Inode inode;
+    readInode(inodeId, &inode);
+
+    if (inode.depth == INLINE_DEPTH && newSize <= INLINE_SIZE) {
+        // the tail is kept zeroed, the file may grow again
+        if (newSize < inode.size) memset(&inode.data[newSize], 0, inode.size - newSize);
+    } else if (inode.depth == INLINE_DEPTH) {
+        if (!spillInline(inodeId, inode)) return;
+    } else if (newSize < inode.size && (inode.flags & INODE_COMPRESSED)) {
+        truncateClusters(inodeId, inode, newSize);
+    } else if (newSize < inode.size) {
+        // new blocks aren't allocated, unmapped blocks are read as zeros
+        vector<Extent> extents;
+        loadExtents(inode, extents);
+
+        // mark freed blocks as unused, buffered ones are dropped with their reservations
+        freeExtents(extents, divCeil(newSize, BLOCK_SIZE));
+        unreserveBlocks(vol->writeBuffer.truncate(inodeId, newSize));
+
+        // keep the tail of the last block zeroed, the file may grow again
+        int lastBlockIndex = newSize / BLOCK_SIZE;
+        vector<Extent> newRuns;
+        vector<Extent> sharedRuns;
+
+        if (newSize % BLOCK_SIZE != 0 && !vol->writeBuffer.contains(inodeId, lastBlockIndex)
+                && unshareRange(extents, lastBlockIndex, lastBlockIndex, true, true, newRuns, sharedRuns)) {
+            int run;
+            int blockId = mapBlock(extents, lastBlockIndex, run);
+
+            if (blockId != -1 && inode.type == 0 && vol->writeBuffer.fits(1)) {
+                // cleared block is written with the rest of the buffered data
+                char fileBlock[BLOCK_SIZE];
+                readBlock(blockId, fileBlock);
+                memset(&fileBlock[newSize % BLOCK_SIZE], 0, BLOCK_SIZE - newSize % BLOCK_SIZE);
+                vol->writeBuffer.put(inodeId, lastBlockIndex, fileBlock, false);
+            } else if (blockId != -1 && inode.type == 0) {
+                // file data isn't journaled
+                char zeros[BLOCK_SIZE] = {0};
+                vol->cache.write(blockId, zeros, BLOCK_SIZE - newSize % BLOCK_SIZE, newSize % BLOCK_SIZE);
+            } else if (blockId != -1) {
+                clearBlock(blockId, BLOCK_SIZE - newSize % BLOCK_SIZE, newSize % BLOCK_SIZE);
+            }
         }
 
-        for (int i = blocksNumber; i < newBlocksNumber; i++) inode.blocks[i] = -1;
-
-    } else {                // just free some blocks if needed
-        // mark freed blocks as unused
-        for (int i = newBlocksNumber; i < blocksNumber; i++) {
-            if (inode.blocks[i] != -1) setBlockUnused(inode.blocks[i]);
-            inode.blocks[i] = 0;
+        // the map only shrinks, unless a shared block is replaced in the middle of an extent
+        if (storeExtents(inode, extents)) {
+            releaseRuns(sharedRuns);
+        } else {
+            releaseRuns(newRuns);
         }
     }
 
     inode.size = newSize;
 
-    writeBlock(inodeId, &inode);
+    writeInode(inodeId, &inode);
 }
 
-bool removeDirRecord(int dirId, int recordId) {
+// the last record takes the place of the removed one, so only their blocks are written
+bool removeDirRecord(int dirId, const char* fileName, int fileId) {
+    Link link;
+    int slot = findLinkSlot(dirId, fileName, link);
+
+    // no dir record found
+    if (slot == -1 || link.inodeId != fileId) return false;
+
+    vol->dentries.invalidate(dirId, fileName);
+
     Inode dirInode;
-    readBlock(dirId, &dirInode);
+    readInode(dirId, &dirInode);
 
-    Link* links;
-    int linksNumber;
-    links = getLinks(dirId, linksNumber);
+    int lastSlot = dirInode.size / sizeof(Link) - 1;
+    Link last;
 
-    int recordIndex = 0;
-    // look for record index
-    for (recordIndex = 0; recordIndex < linksNumber; recordIndex++) {
-        if (links[recordIndex].inodeId == recordId) break;
+    if (slot != lastSlot) {
+        vector<Extent> extents;
+        loadExtents(dirInode, extents);
+
+        readExtents(extents.data(), extents.size(), reinterpret_cast<char*>(&last), sizeof(Link),
+                    lastSlot * sizeof(Link));
+        writeData(dirId, sizeof(Link), reinterpret_cast<const char*>(&last), slot * sizeof(Link));
     }
 
-    // no dir record found
-    if (recordIndex == linksNumber) return false;
+    // truncate frees the last block if it gets empty
+    truncateData(dirId, lastSlot * sizeof(Link));
 
-    // shift all links by one (delete old link)
-    for (int i = recordIndex; i < linksNumber - 1; i++) links[i] = links[i + 1];
+    if (dirInode.indexRoot == 0) return true;
 
-    // check whether it is possible to free a block
-    if (dirInode.size % BLOCK_SIZE == sizeof(Link)) {
-        // delete last block, it will be free after links shift
-        setBlockUnused(dirInode.blocks[linksNumber - 1]);
-        dirInode.blocks[linksNumber - 1] = 0;
+    // dir got small, linear search is fine again
+    if (lastSlot < DIR_INDEX_THRESHOLD / 2) {
+        dropDirIndex(dirId);
+        return true;
     }
 
-    dirInode.size -= sizeof(Link);
+    removeIndexEntry(dirInode.indexRoot, nameHash(fileName), slot);
 
-    writeBlock(dirId, &dirInode);
+    if (slot != lastSlot) {
+        removeIndexEntry(dirInode.indexRoot, nameHash(last.fileName), lastSlot);
 
-    // write new data to dir
-    write(dirId, dirInode.size, reinterpret_cast<char*>(links));
+        if (!insertIndexEntry(dirInode.indexRoot, nameHash(last.fileName), slot)) {
+            dropDirIndex(dirId);
+            return true;
+        }
+    }
+
+    // nodes are never merged, a mostly empty index is built anew
+    if (indexRemovals(dirInode.indexRoot) > lastSlot) {
+        dropDirIndex(dirId);
+        buildDirIndex(dirId);
+    }
 
-    delete links;
     return true;
 }
 
 bool dirContainsFile(int fileId) {
     int filesInDir = 0;            // how many files exist in dir
-    Link* links = getLinks(root_inode_id, filesInDir);
+    Link* links = getLinks(vol->root_inode_id, filesInDir);
 
     // check whether dir contains the name
     bool isFileInDir = false;
@@ -711,21 +2537,71 @@ bool dirContainsFile(int fileId) {
         if (links[i].inodeId == fileId) isFileInDir = true;
     }
 
+    FS_STAT_ADD(STAT_DIR_ENTRIES_SCANNED, filesInDir);
+
     delete links;
     return isFileInDir;
 }
 
 Link* getLinks(int dirId, int &linksNumber) {
     Inode dirInode;
-    readBlock(dirId, &dirInode);
+    readInode(dirId, &dirInode);
 
     Link* links;
     linksNumber = dirInode.size / sizeof(Link);
-    links = (Link*)read(dirId, dirInode.size);
+    links = (Link*)readData(dirId, dirInode.size);
+    if (links == NULL) linksNumber = 0;     // damaged records are skipped
 
     return links;
 }
 
+int findLink(int dirId, const char* fileName) {
+    Link link;
+    return findLinkSlot(dirId, fileName, link) == -1 ? -1 : link.inodeId;
+}
+
+// index of the record with the name in the dir, -1 if there is none
+int findLinkSlot(int dirId, const char* fileName, Link& link) {
+    Inode dirInode;
+    readInode(dirId, &dirInode);
+
+    // only the links with the same name hash are read
+    if (dirInode.indexRoot != 0) {
+        vector<int> slots;
+        findIndexSlots(dirInode.indexRoot, nameHash(fileName), slots);
+
+        vector<Extent> extents;
+        if (!slots.empty()) loadExtents(dirInode, extents);
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            readExtents(extents.data(), extents.size(), reinterpret_cast<char*>(&link), sizeof(Link),
+                        slots[i] * sizeof(Link));
+            FS_STAT_ADD(STAT_DIR_ENTRIES_SCANNED, 1);
+
+            if (!strcmp(link.fileName, fileName)) return slots[i];
+        }
+
+        return -1;
+    }
+
+    int linksNumber;
+    Link* links = getLinks(dirId, linksNumber);
+
+    int slot = -1;
+    for (int i = 0; i < linksNumber; i++) {
+        if (!strcmp(links[i].fileName, fileName)) {
+            link = links[i];
+            slot = i;
+            break;
+        }
+    }
+
+    FS_STAT_ADD(STAT_DIR_ENTRIES_SCANNED, slot == -1 ? linksNumber : slot + 1);
+
+    delete[] links;
+    return slot;
+}
+
 bool addDirRecord(int inodeId, const char *fileName, int dirId) {
     // new record (link to file from dir)
     Link link;
@@ -733,89 +2609,205 @@ bool addDirRecord(int inodeId, const char *fileName, int dirId) {
     link.inodeId = inodeId;
 
     Inode dirInode;
-    readBlock(dirId, &dirInode);
+    readInode(dirId, &dirInode);
+
+    int slot = dirInode.size / sizeof(Link);
+
+    // append the record, a new block is allocated if needed
+    if (!writeData(dirId, sizeof(Link), reinterpret_cast<const char*>(&link), dirInode.size)) return false;
+    vol->dentries.invalidate(dirId, fileName);
+
+    if (dirInode.indexRoot != 0) {
+        // no space for the index, dir remains linear
+        if (!insertIndexEntry(dirInode.indexRoot, nameHash(fileName), slot)) dropDirIndex(dirId);
+    } else if (slot + 1 > DIR_INDEX_THRESHOLD) {
+        buildDirIndex(dirId);
+    }
+
+    return true;
+}
+
+void buildDirIndex(int dirId) {
+    int linksNumber;
+    Link* links = getLinks(dirId, linksNumber);
+
+    int rootBlock = buildIndex(links, linksNumber);
+    delete[] links;
+
+    if (rootBlock == 0) return;
+
+    Inode dirInode;
+    readInode(dirId, &dirInode);
+    dirInode.indexRoot = rootBlock;
+    writeInode(dirId, &dirInode);
+}
+
+void dropDirIndex(int dirId) {
+    Inode dirInode;
+    readInode(dirId, &dirInode);
+
+    freeIndex(dirInode.indexRoot);
+    dirInode.indexRoot = 0;
+    writeInode(dirId, &dirInode);
+}
 
-    // new block needed
-    if ((dirInode.size % BLOCK_SIZE) == 0) {
-        // allocate new block
-        int freeBlockId = getFreeBlockId();
+// finds a free block and marks it used at once
+int allocateBlock() {
+    lock_guard<mutex> lock(vol->allocatorLock);
 
-        if (freeBlockId == -1) return false;            // no disk space
-        setBlockUsed(freeBlockId);
+    // reserved blocks are kept for the buffered data
+    if (vol->bitmap.freeBlocks() <= vol->reservedBlocks) return -1;
 
-        int inodeBlockNumber = dirInode.size / BLOCK_SIZE;
-        dirInode.blocks[inodeBlockNumber] = freeBlockId;
+    int blockId = vol->bitmap.findFree();
+    if (blockId != -1) vol->bitmap.setUsed(blockId);
+
+    return blockId;
+}
+
+// finds up to wanted free blocks in a row near goal and marks them used at once
+int allocateRun(int wanted, int goal, int& length, bool reserved) {
+    lock_guard<mutex> lock(vol->allocatorLock);
+
+    if (!reserved) {
+        int available = vol->bitmap.freeBlocks() - vol->reservedBlocks;
+        if (available <= 0) {
+            length = 0;
+            return -1;
+        }
+
+        wanted = min(wanted, available);
     }
 
-    int inodeBlockNumber = dirInode.size / BLOCK_SIZE;
+    int blockId = vol->bitmap.findRun(wanted, goal, length);
+    for (int i = 0; blockId != -1 && i < length; i++) vol->bitmap.setUsed(blockId + i);
 
-    // id of the first non-full block
-    int blockId = dirInode.blocks[inodeBlockNumber];
-    int shift = dirInode.size % BLOCK_SIZE;
+    return blockId;
+}
 
-    writeBlock(blockId, reinterpret_cast<const char*>(&link), sizeof(Link), shift);
+bool reserveBlocks(int count) {
+    lock_guard<mutex> lock(vol->allocatorLock);
 
-    dirInode.size += sizeof(Link);
-    writeBlock(dirId, &dirInode);
+    if (vol->bitmap.freeBlocks() - vol->reservedBlocks < count) return false;
 
+    vol->reservedBlocks += count;
     return true;
 }
 
-int getFreeBlockId() {
-    int freeBlockId;
-    for (freeBlockId = root_inode_id; freeBlockId <= data_blocks; freeBlockId++) {
-        if (!isBlockUsed(freeBlockId)) break;
+void unreserveBlocks(int count) {
+    lock_guard<mutex> lock(vol->allocatorLock);
+    vol->reservedBlocks -= count;
+}
+
+// blocks freed by the running transaction are free again after its commit, a write,
+// that may need them, waits for it before it starts
+void waitHeldBlocks(int count) {
+    {
+        lock_guard<mutex> lock(vol->allocatorLock);
+
+        int available = vol->bitmap.freeBlocks() - vol->reservedBlocks;
+        if (available >= count || vol->bitmap.heldBlocksNumber() == 0) return;
+    }
+
+    vol->journal.commit();
+}
+
+void freeRun(int blockId, int length) {
+    lock_guard<mutex> lock(vol->allocatorLock);
+
+    if (!vol->refCounts.isShared(blockId, length)) {
+        for (int i = 0; i < length; i++) vol->bitmap.setUnused(blockId + i);
+        vol->journal.revoke(blockId, length);
+        vol->checksums.forget(blockId, length);
+        return;
     }
 
-    if (freeBlockId > data_blocks) return -1;
-    return freeBlockId;
+    // shared blocks only lose an owner, they are kept for the others
+    for (int i = 0; i < length; i++) {
+        if (vol->refCounts.drop(blockId + i)) continue;
+
+        vol->bitmap.setUnused(blockId + i);
+        vol->journal.revoke(blockId + i, 1);
+        vol->checksums.forget(blockId + i, 1);
+    }
 }
 
 void setBlockUsed(int block_id) {
-    fio.seekg((block_id - bitmask_blocks) / 8, fio.beg);
-    int old_mask = fio.get();
-    fio.seekp((block_id - bitmask_blocks) / 8, fio.beg);
-    fio.put(static_cast<char>(old_mask | (1 << ((block_id - bitmask_blocks) % 8))));
+    lock_guard<mutex> lock(vol->allocatorLock);
+    vol->bitmap.setUsed(block_id);
 }
 
 void setBlockUnused(int block_id) {
-    fio.seekg((block_id - bitmask_blocks) / 8, fio.beg);
-    int old_mask = fio.get();
-    fio.seekp((block_id - bitmask_blocks) / 8, fio.beg);
-    fio.put(static_cast<char>(old_mask & ~(1 << ((block_id - bitmask_blocks) % 8))));
+    lock_guard<mutex> lock(vol->allocatorLock);
+    vol->bitmap.setUnused(block_id);
+    vol->journal.revoke(block_id, 1);
+    vol->checksums.forget(block_id, 1);
 }
 
 bool isBlockUsed(int block_id) {
-    fio.seekg((block_id - bitmask_blocks) / 8, fio.beg);
-    return (fio.get() & (1 << ((block_id - bitmask_blocks) % 8))) != 0;
+    lock_guard<mutex> lock(vol->allocatorLock);
+    return vol->bitmap.isUsed(block_id);
 }
 
-void readBlock(int block_id, char* data, int size, int shift) {
+bool readBlock(int block_id, char* data, int size, int shift) {
     if (block_id == 0) {
         cout << "Error: attempt to read corrupted data (fd = 0)" << endl;
-        return;
+        return false;
     }
 
     if (block_id > 0) {
-        fio.seekg(block_id * BLOCK_SIZE + shift, fio.beg);
-        fio.read(data, size);
+        if (!vol->journal.read(block_id, data, size, shift)) return vol->cache.read(block_id, data, size, shift);
     } else {
         // read all zeros, if fd = -1
         for (int i = 0; i < size; i++) data[i] = 0;
     }
+
+    return true;
+}
+
+// geometry is kept, counters are taken from the bitmask and the inode table
+void writeSuperblock(bool clean) {
+    Superblock super = vol->superblock;
+
+    {
+        lock_guard<mutex> lock(vol->allocatorLock);
+        super.freeBlocks = vol->bitmap.freeBlocks() + vol->bitmap.heldBlocksNumber();
+    }
+
+    super.freeInodes = vol->inodes.freeInodes();
+    super.clean = clean ? 1 : 0;
+
+    char block[BLOCK_SIZE] = {0};
+    memcpy(block, &super, sizeof(Superblock));
+    vol->cache.writeBlocks(SUPERBLOCK_ID, 1, block);
 }
 
-void readBlock(int block_id, Inode* inode) {
-    readBlock(block_id, reinterpret_cast<char*>(inode));
+void readInode(int inodeId, Inode* inode) {
+    // read all zeros, if there is no such inode
+    if (!vol->inodes.read(inodeId, inode)) memset(inode, 0, sizeof(Inode));
 }
 
 void writeBlock(int block_id, const char* data, int size, int shift) {
-    fio.seekp(block_id * BLOCK_SIZE + shift, fio.beg);
-    fio.write(data, size);
+    vol->journal.write(block_id, data, size, shift);
+}
+
+void writeInode(int inodeId, const Inode* inode) {
+    vol->inodes.write(inodeId, inode);
+}
+
+int allocateInode() {
+    return vol->inodes.allocate();
 }
 
-void writeBlock(int block_id, const Inode* inode) {
-    writeBlock(block_id, reinterpret_cast<const char*>(inode));
+// inode with no links is free on the device as well
+void freeInode(int inodeId) {
+    Inode inode;
+    memset(&inode, 0, sizeof(Inode));
+
+    writeInode(inodeId, &inode);
+    vol->inodes.setUnused(inodeId);
+
+    // a file, that gets the id again, starts without the readahead window
+    vol->readahead.close(inodeId);
 }
 
 int divCeil(int a, int b) {
@@ -848,28 +2840,16 @@ void clearBlock(int blockId, int size, int shift) {
     delete clearedBlock;
 }
 
-bool setInodeBlockByIndex(Inode &inode, int index) {
-    if (inode.blocks[index] < 0) {
-        inode.blocks[index] = getFreeBlockId();
-
-        // no block found
-        if (inode.blocks[index] == -1) {
-            cout << "Error: not enough disk space, impossible to write " << endl;
-            return false;
-        }
-
-    }
-
-    return true;
-}
-
 char* getAbsPath(const char* path) {
-    char* absPath = new char[100];                   // path, adding the pwd
+    char* absPath;                                   // path, adding the pwd
 
     if (path[0] != '/') {
-        strcpy(absPath, wd.c_str());
+        lock_guard<mutex> lock(vol->wdLock);
+        absPath = new char[vol->wd.size() + strlen(path) + 2];
+        strcpy(absPath, vol->wd.c_str());
         strcat(absPath, path);
     } else {
+        absPath = new char[strlen(path) + 2];
         strcpy(absPath, path);
     }
 
@@ -880,18 +2860,45 @@ char* getAbsPath(const char* path) {
     return absPath;
 }
 
+InodesLock::InodesLock(Volume* vol, int firstId, int secondId) {
+    first = &vol->inodeLock(firstId);
+    second = &vol->inodeLock(secondId);
+
+    if (first == second) {
+        second = NULL;
+    } else if (second < first) {             // stripes are always taken in address order
+        swap(first, second);
+    }
+
+    first->lock();
+    if (second != NULL) second->lock();
+}
+
+InodesLock::~InodesLock() {
+    if (second != NULL) second->unlock();
+    first->unlock();
+}
+
+AllInodesLock::AllInodesLock(Volume* vol) : vol(vol) {
+    for (int i = 0; i < INODE_LOCK_STRIPES; i++) vol->inodeLocks[i].lock();
+}
+
+AllInodesLock::~AllInodesLock() {
+    for (int i = INODE_LOCK_STRIPES - 1; i >= 0; i--) vol->inodeLocks[i].unlock();
+}
+
 string simplifyPath(vector<string> parts) {
     vector<string> newParts;
     string newPath;
 
-    for (int i = 0; i < parts.size(); i++) {
+    for (size_t i = 0; i < parts.size(); i++) {
         if (!parts[i].compare("..")) newParts.pop_back();
         else if (!parts[i].compare(".")) {}
         else newParts.push_back(parts[i]);
     }
 
     newPath.append("/");
-    for (int i = 1; i < newParts.size(); i++) {
+    for (size_t i = 1; i < newParts.size(); i++) {
         newPath.append(newParts[i]);
         newPath.append("/");
     }
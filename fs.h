@@ -1,54 +1,352 @@
 #ifndef FS_H
 #define FS_H
 
+#include <functional>
+#include <string>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
 namespace fs {
+class BlockDevice;
+
 const int BLOCK_SIZE = 512;
-const int BLOCKS_PER_INODE= ((BLOCK_SIZE - sizeof(char) - 2 *
-                              sizeof(int)) / sizeof(int));
 const int FNAME_LEN = 12;                                // actual size is 11
+const int DEFAULT_CACHE_BLOCKS = 1024;                   // 512 KB of cached blocks
+const int DEFAULT_DENTRY_ENTRIES = 4096;
+const int DEFAULT_READAHEAD_BLOCKS = 128;                // 64 KB read ahead at most
+const int DEFAULT_ASYNC_DEPTH = 64;                      // io_uring submission ring size
+const int DEFAULT_WRITE_BUFFER_BLOCKS = 4096;            // 2 MB of file data kept in memory
+const int DEFAULT_JOURNAL_INTERVAL = 5000;               // ms between group commits of metadata
+
+
+/**
+ * @brief The Extent struct describes a run of file blocks, that lie one after
+ * another on a device
+ */
+struct Extent {
+    int logical;                            // index of the first block in the file
+    int physical;                           // number of the first block on the device
+    int length;                             // number of blocks in the run
+};
+
+const int INODE_SIZE = 128;                              // space of an inode in the inode table
+const int INODES_PER_BLOCK = BLOCK_SIZE / INODE_SIZE;
+const int INODE_RATIO = 8;                               // device blocks per inode of the table
+const int ROOT_INODE_ID = 1;                             // inode 0 is never used
+const int INODE_EXTENTS = ((INODE_SIZE - 6 * sizeof(int)) / sizeof(Extent));
+const int EXTENTS_PER_BLOCK = BLOCK_SIZE / sizeof(Extent);
+const int INLINE_SIZE = INODE_EXTENTS * sizeof(Extent);  // contents kept in the inode in place of the map
+const int INLINE_DEPTH = -1;                             // depth of an inode with inline contents
+const int INODE_READONLY = 1;                            // inode of a snapshot, it can't be changed
+const int INODE_COMPRESSED = 2;                          // file data is kept by compressed clusters
 
+const int SUPERBLOCK_ID = 0;                             // block of the superblock
+const int SUPERBLOCK_MAGIC = 0x31534653;                 // "SFS1"
+const int FS_VERSION = 5;                                // format of the device structures
+const int BITMASK_BLOCK_ID = SUPERBLOCK_ID + 1;          // first block of the bitmask
 
 /**
- * @brief The Inode struct describes structure of file descriptor on a disk
+ * @brief The Inode struct describes structure of file descriptor on a disk.
+ * Blocks of a file are mapped by extents, sorted by logical block. If they don't
+ * fit into the inode (depth > 0), inode extents point to the tree of extents
+ * blocks: logical - first block mapped by the tree block, physical - its block
+ * number, length - number of entries in it. Blocks of level 0 hold extents,
+ * others point to the blocks a level below. File blocks, that aren't mapped,
+ * are zeros. Files and symlinks up to INLINE_SIZE bytes keep their contents
+ * in place of the map (depth INLINE_DEPTH), bytes past the size are zeros.
+ * Compressed files map clusters of CLUSTER_BLOCKS file blocks: a cluster maps
+ * all of them (raw data), none (zeros) or fewer blocks from its first one, that
+ * hold the compressed stream. Inodes are kept in the inode table, INODES_PER_BLOCK
+ * per block
  */
 struct Inode {
     char type;                              // 0 - file; 1 - dir; 2 -symlink
+    char flags;                             // INODE_READONLY, INODE_COMPRESSED
     int links;                              // quantity of links per per file
     int size;                               // current file size;
-    int blocks[BLOCKS_PER_INODE];           // array of the file block numbers
+    int indexRoot;                          // root block of the dir index, 0 if there is none
+    int depth;                              // 0 - extents are in the inode, INLINE_DEPTH - data, else tree levels
+    int extentsNumber;                      // number of used extents
+    union {
+        Extent extents[INODE_EXTENTS];      // map of the file blocks
+        char data[INLINE_SIZE];             // inline contents
+    };
 };
 
+static_assert(sizeof(Inode) <= INODE_SIZE, "Inode doesn't fit into its table slot");
+
+/**
+ * @brief The Superblock struct describes the format of a device, it is kept in
+ * block SUPERBLOCK_ID. The bitmask follows it, the inode table follows the
+ * bitmask, the metadata journal follows the table, the table of block shares
+ * follows the journal, the table of block checksums follows the shares.
+ * Counters are exact, if the device was unmounted cleanly
+ */
+struct Superblock {
+    int magic;                              // SUPERBLOCK_MAGIC
+    int version;                            // FS_VERSION
+    int blockSize;                          // BLOCK_SIZE
+    int blocksNumber;                       // blocks of the device, the superblock included
+    int bitmaskBlocks;                      // number of blocks, which bitmask occupies
+    int inodeBlocks;                        // number of blocks, which inode table occupies
+    int inodesNumber;                       // size of the inode table
+    int freeBlocks;
+    int freeInodes;
+    int clean;                              // 1 - unmounted, 0 - mounted or crashed
+    int rootInodeId;
+    int journalStart;                       // first block of the metadata journal
+    int journalBlocks;
+    int refCountsStart;                     // first block of the table of block shares
+    int refCountsBlocks;
+    int checksumsStart;                     // first block of the table of block checksums
+    int checksumsBlocks;                    // 0 - blocks have no checksums
+    int unverified;                         // 1 - file data may be newer than its checksums after a crash
+};
+
+static_assert(sizeof(Superblock) <= BLOCK_SIZE, "Superblock doesn't fit into its block");
+
 /**
  * @brief The Link struct desribes single directory entry
  */
 struct Link {
     char fileName[FNAME_LEN];         // name of a file
-    int inodeId;                      // number of the Inode (corresponds to Inode block number)
+    int inodeId;                      // number of the Inode in the inode table
+};
+
+/**
+ * @brief The MountOptions struct describes tunables of a mounted device
+ */
+struct MountOptions {
+    int cacheBlocks = DEFAULT_CACHE_BLOCKS;     // block cache capacity, 0 disables the cache, ignored with mmap
+    bool useMmap = true;                        // map the device file, fstream otherwise
+    int dentryEntries = DEFAULT_DENTRY_ENTRIES; // cached name lookups, 0 disables the cache
+    int readaheadBlocks = DEFAULT_READAHEAD_BLOCKS; // max readahead window, 0 disables readahead
+    bool backgroundReadahead = true;            // prefetch by a worker thread, by readers otherwise
+    int asyncDepth = DEFAULT_ASYNC_DEPTH;       // io_uring queue depth, 0 - async I/O is done synchronously
+    int writeBufferBlocks = DEFAULT_WRITE_BUFFER_BLOCKS;  // file data buffered on write, 0 - write through
+    int journalInterval = DEFAULT_JOURNAL_INTERVAL; // ms between journal commits, 0 - every operation is committed
+    bool compression = false;                   // new files are compressed, see setCompression()
+    bool checksums = true;                      // blocks are checksummed, taken when the device is formatted
+    bool checkMetadata = true;                  // damaged metadata fails the mount, fsck mounts to repair it
+};
+
+/**
+ * @brief The Advice enum describes how a file is going to be read
+ */
+enum Advice {
+    ADVICE_NORMAL,                              // readahead adapts to the reads
+    ADVICE_SEQUENTIAL,                          // read ahead with the largest window at once
+    ADVICE_RANDOM,                              // no readahead
+    ADVICE_WILLNEED                             // prefetch the range now
+};
+
+/**
+ * @brief The IoVec struct describes one buffer of a vectored read or write
+ */
+struct IoVec {
+    char* base;                                 // isn't changed by writes
+    int size;
+};
+
+/**
+ * @brief The DirEntry struct describes one record of a dir, readdirplus()
+ * fills the stats of the inode too, readdir() leaves type -1 and zeros
+ */
+struct DirEntry {
+    char name[FNAME_LEN + 1];                   // always NUL-terminated
+    int inodeId;
+    int type;                                   // as Inode::type
+    int size;
+    int links;
+};
+
+/**
+ * @brief The DirCursor struct keeps the position of a dir listing between
+ * readdir() calls, it may be copied to resume the listing later
+ */
+struct DirCursor {
+    int dirId = -1;                             // set by opendir()
+    int position = 0;                           // next record of the dir
+};
+
+/**
+ * @brief The CacheStats struct describes block cache counters
+ */
+struct CacheStats {
+    long hits;                                  // block found in the cache
+    long misses;                                // block had to be fetched
+    long evictions;                             // blocks dropped to free a cache slot
+    long writebacks;                            // dirty blocks written back to the device
+    long deviceReads;                           // read calls issued to the device
+    long deviceWrites;                          // write calls issued to the device
+    long prefetched;                            // blocks read ahead into the cache
+    long directAccesses;                        // reads and writes of a mapped device, never cached
+};
+
+/**
+ * @brief The FsStats struct describes space of the mounted device
+ */
+struct FsStats {
+    int blockSize;
+    int blocks;                                 // blocks of the device
+    int freeBlocks;                             // blocks, that may still be allocated
+    int inodes;                                 // size of the inode table
+    int freeInodes;
+};
+
+/**
+ * @brief The StatOp enum lists API calls, which latency is recorded
+ */
+enum StatOp {
+    OP_MOUNT,
+    OP_UMOUNT,
+    OP_SYNC,
+    OP_FLUSH,
+    OP_CREATE,
+    OP_OPEN,
+    OP_CLOSE,
+    OP_READ,                                    // read, readv and readAsync
+    OP_WRITE,                                   // write, writev and writeAsync
+    OP_TRUNCATE,
+    OP_LINK,
+    OP_UNLINK,
+    OP_MKDIR,                                   // the create of the dir included
+    OP_RMDIR,
+    OP_SYMLINK,
+    OP_LS,
+    OP_READDIR,                                 // readdir and readdirplus
+    OP_CLONE,
+    OP_SNAPSHOT,                                // snapshot and removeSnapshot
+    OP_CD,
+    OP_LOOKUP,                                  // path resolution of any call
+    OPS_NUMBER
 };
 
-bool mount(const char* fileName);
+/**
+ * @brief The StatCounter enum lists counted internal events
+ */
+enum StatCounter {
+    STAT_BLOCKS_READ,                           // blocks read through the block cache
+    STAT_BLOCKS_WRITTEN,                        // blocks written through the block cache
+    STAT_BITMAP_PROBES,                         // free-space searches and bit tests
+    STAT_DIR_ENTRIES_SCANNED,                   // directory records compared or listed
+    STAT_JOURNAL_COMMITS,                       // transactions written to the log
+    STAT_JOURNAL_BLOCKS,                        // log blocks written, descriptors and commits included
+    STAT_CLUSTERS_COMPRESSED,                   // clusters of compressed files written in fewer blocks
+    STAT_CLUSTERS_RAW,                          // clusters, that didn't get smaller
+    STAT_BLOCKS_VERIFIED,                       // blocks read from the device and checked by their sums
+    STAT_CHECKSUM_ERRORS,                       // blocks, that didn't match their sums
+    STAT_CHECKSUMS_RESEALED,                    // blocks taken as they are by fsck
+    COUNTERS_NUMBER
+};
+
+/**
+ * @brief The LatencyStats struct describes the latency histogram of an API call,
+ * percentiles are precise to about 3%
+ */
+struct LatencyStats {
+    long count;
+    long totalNs;
+    long minNs;
+    long maxNs;
+    long p50Ns;
+    long p90Ns;
+    long p99Ns;
+    long p999Ns;
+};
+
+/**
+ * @brief The Stats struct describes everything recorded since the start or
+ * resetStats(), latencies and counters are zeros, if the library is built
+ * without FS_ENABLE_STATS
+ */
+struct Stats {
+    bool enabled;
+    LatencyStats ops[OPS_NUMBER];
+    long counters[COUNTERS_NUMBER];
+    CacheStats cache;                           // of the mounted device
+};
+
+// result of an async request: number of bytes or -1 on error
+typedef std::function<void(int result)> IoCallback;
+
+// a device without the superblock magic is formatted, a device of another version or block size is refused
+bool mount(const char* fileName, const MountOptions& options = MountOptions());
+bool mount(BlockDevice* device, const MountOptions& options = MountOptions());   // device isn't owned
 void umount();
+void sync();                                    // writes all cached dirty blocks to the device
+void flush(int inodeId);                        // allocates blocks for the buffered data of the file and writes it
+CacheStats cacheStats();
+FsStats statfs();                               // O(1), counters are kept in memory
+Stats stats();
+std::string statsJson();                        // stats() as a JSON object
+void resetStats();
 
 // 0 - file, 1 - dir, 2 - symlink
 int create(const char *fileName, int type = 0, char* linkTo = "");
 char* read(int inodeId, int size, int shift = 0);
+// read into the caller buffer, stop at the end of the file, -1 on error or a damaged block
+int read(int inodeId, char* buffer, int size, int shift = 0);
+int readv(int inodeId, const IoVec* iov, int count, int shift = 0);
 void ls(const char *path);
 void ls();
+// records are listed in their order in the dir; ones added or removed during
+// the listing may be missed or listed twice, others are listed once
+bool opendir(const char* path, DirCursor& cursor);  // false, if there is no such dir
+// up to count records from the cursor on, 0 at the end of the dir, -1 on error
+int readdir(DirCursor& cursor, DirEntry* entries, int count);
+int readdirplus(DirCursor& cursor, DirEntry* entries, int count);  // with stats of the inodes
 void filestat(int inodeId);
 int open(const char* fileName);
 void close(int inodeId);
+// tells how the file is going to be read, willneed prefetches [shift, shift + size)
+void advise(int inodeId, Advice advice, int shift = 0, int size = 0);
+// data of the file is kept by compressed clusters, read and written transparently;
+// it may be switched only while the file is empty
+bool setCompression(int inodeId, bool compressed);
 void link(const char* existFileName, const char* linkName);
 void truncate(const char* fileName, int newSize);
 void unlink(const char* linkName);
 void write(int inodeId, int size, char* data, int shift = 0);
+// number of bytes written, -1 on error
+int write(int inodeId, const char* data, int size, int shift = 0);
+int writev(int inodeId, const IoVec* iov, int count, int shift = 0);
+
+// async read/write: block map is handled at once, data is transferred in the background
+// and done is called from poll(); buffers must be kept until then. A write waits for the
+// requests of the file in flight. false if the request is rejected, done isn't called then
+bool readAsync(int inodeId, char* buffer, int size, int shift, IoCallback done);
+bool writeAsync(int inodeId, const char* data, int size, int shift, IoCallback done);
+// submits queued requests and calls done of the finished ones, returns their number;
+// if wait, blocks until at least one is finished (if there are any in flight)
+int poll(bool wait = false);
 void truncate(int inodeId, int newSize);
 
 void mkdir(const char* dirName);
 void rmdir(const char* dirName);
+// the new file shares all the blocks of the existing one, a block is copied, when
+// either of them writes it; id of the clone, -1 on error
+int clone(const char* existFileName, const char* cloneName);
+// read-only copy of the whole tree in a new dir, files share their blocks with the
+// originals, other snapshots aren't copied; inodes and dir records are copied, while
+// every other operation on the volume waits, for a time growing with the number of inodes
+bool snapshot(const char* dirName);
+bool removeSnapshot(const char* dirName);       // blocks the volume like snapshot() too
 void pwd();
 void cd(const char* path);
 void symlink(char *to, const char *name);
 
+#if __cplusplus >= 202002L
+inline int read(int inodeId, std::span<char> buffer, int shift = 0) {
+    return read(inodeId, buffer.data(), static_cast<int>(buffer.size()), shift);
+}
+
+inline int write(int inodeId, std::span<const char> data, int shift = 0) {
+    return write(inodeId, data.data(), static_cast<int>(data.size()), shift);
+}
+#endif
+
 }       // fs::namespace end
 
 #endif // FS_H
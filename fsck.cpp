@@ -0,0 +1,806 @@
+#include "fsck.h"
+#include "checksums.h"
+#include "dirindex.h"
+#include "volume.h"
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+using namespace std;
+
+namespace fs {
+
+const int MAX_TREE_DEPTH = 8;                   // deeper maps and indexes are damaged
+const int FSCK_READ_BLOCKS = 64;                // blocks read at once to compare their sums
+
+/**
+ * @brief The Checker class is one pass of fsck over the mounted volume. Dirs
+ * are read by tasks of a work-stealing pool: a worker takes its newest task,
+ * an idle one steals the oldest task of another worker. Every record of a
+ * dir is checked, the first one, that reaches an inode, checks the inode and
+ * claims its blocks, so all the inodes and blocks are checked once; blocks
+ * of files claimed again are counted and compared with the table of shares.
+ * Blocks in use are read from the device past the cache and compared with
+ * their checksums
+ */
+class Checker {
+public:
+    explicit Checker(int threadsNumber);
+
+    void run();                                 // checks the whole tree and the bitmask
+    bool damaged() const;                       // dirs must be rewritten, before counters are fixed
+    void rewriteDirs();                         // drops bad records and broken indexes
+    void fixCounters();                         // link counts, unreachable inodes and the bitmask
+    void fixSums();                             // damaged blocks are taken as they are
+
+    long dirs;
+    long files;
+    long symlinks;
+    long blocks;
+    std::atomic<long> errors;
+    std::vector<std::string> problems;
+
+private:
+    enum State { UNVISITED, CHECKING, GOOD, BAD };
+
+    // records [first, last) of the dir, the whole dir is read first, if there are no records
+    struct Task {
+        int dirId;
+        std::shared_ptr<const std::vector<Link> > links;
+        int first;
+        int last;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    void work(int worker);
+    void push(int worker, const Task& task);
+    bool take(int worker, Task& task);
+
+    void readDir(int worker, int dirId);
+    void checkRecord(int worker, int dirId, const Link& link);
+    State visit(int worker, int inodeId, int parentId);
+    bool checkInode(int worker, int inodeId);
+    bool loadMap(const Inode& inode, std::vector<Extent>& extents, std::vector<int>& tree, std::string& why);
+    bool loadNode(int blockId, int count, int level, std::vector<Extent>& extents, std::vector<int>& tree);
+    bool checkIndex(int blockId, int level, const std::vector<Link>& links, long& entries, std::vector<int>& tree);
+    bool claim(int firstBlockId, int count, int inodeId, bool shareable = false);
+    void compareBitmap();
+    void compareSums();
+    void problem(const std::string& text);
+    void markDir(std::set<int>& dirs, int dirId);
+    bool isRange(int blockId, int count) const;
+
+    int threadsNumber;
+    int rootId;
+    int inodesNumber;
+    int firstBlockId;                           // first block the bitmask describes
+    int blocksNumber;
+
+    std::vector<Inode> inodes;                  // copy of the table, nothing changes it during the pass
+    std::vector<std::atomic<char> > states;
+    std::vector<std::atomic<int> > records;     // records of the dirs pointing to the inode
+    std::vector<int> parents;                   // dir the inode was reached from
+    std::vector<std::atomic<unsigned long> > claimed;   // blocks in use, 64 per word
+    std::vector<std::atomic<unsigned short> > owners;   // file blocks claimed again, by block
+
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::atomic<long> pending;                  // tasks queued or in progress
+    std::atomic<long> counters[4];              // files, dirs, symlinks by type, blocks
+
+    std::mutex fixesLock;                       // guards the found problems and the lists below
+    std::set<int> badRecordDirs;                // dirs with records to drop or to correct
+    std::set<int> badIndexDirs;
+    std::vector<int> leakedBlocks;              // marked used, nothing uses them
+    std::vector<int> lostBlocks;                // used, but marked free
+    std::vector<int> badShares;                 // shares differ from the owners found
+    std::vector<std::pair<int, unsigned> > badSums; // blocks and their sums, that differ from the table
+};
+
+static bool validName(const Link& link) {
+    return link.fileName[0] != 0 && memchr(link.fileName, 0, FNAME_LEN) != NULL;
+}
+
+Checker::Checker(int threadsNumber) :
+    dirs(0), files(0), symlinks(0), blocks(0), errors(0), threadsNumber(threadsNumber), pending(0) {
+    rootId = vol->root_inode_id;
+    inodesNumber = vol->inodes_number;
+    firstBlockId = BITMASK_BLOCK_ID + vol->bitmask_blocks;
+    blocksNumber = vol->data_blocks;
+
+    vol->inodes.copy(inodes);
+    states = vector<atomic<char> >(inodesNumber);
+    records = vector<atomic<int> >(inodesNumber);
+    parents.assign(inodesNumber, 0);
+    claimed = vector<atomic<unsigned long> >((blocksNumber + 63) / 64);
+    owners = vector<atomic<unsigned short> >(blocksNumber);
+
+    for (int i = 0; i < threadsNumber; i++) queues.push_back(unique_ptr<Queue>(new Queue()));
+    for (int i = 0; i < 4; i++) counters[i] = 0;
+}
+
+void Checker::run() {
+    // the table and the log are in use without owners
+    claim(firstBlockId, vol->inode_blocks, 0);
+    claim(vol->superblock.journalStart, vol->superblock.journalBlocks, 0);
+    claim(vol->superblock.refCountsStart, vol->superblock.refCountsBlocks, 0);
+    claim(vol->superblock.checksumsStart, vol->superblock.checksumsBlocks, 0);
+
+    if (visit(0, rootId, rootId) != GOOD || inodes[rootId].type != 1) {
+        problem("root dir is damaged, nothing can be checked");
+        return;
+    }
+
+    vector<thread> workers;
+    for (int i = 1; i < threadsNumber; i++) workers.push_back(thread(&Checker::work, this, i));
+    work(0);
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+    files = counters[0];
+    dirs = counters[1];
+    symlinks = counters[2];
+    blocks = counters[3];
+
+    // the root has no record in a dir
+    records[rootId]++;
+
+    for (int i = 1; i < inodesNumber; i++) {
+        if (inodes[i].links <= 0) continue;
+
+        ostringstream text;
+        if (states[i] != GOOD) {
+            text << "inode " << i << " isn't reachable from the root";
+            problem(text.str());
+        } else if (inodes[i].links != records[i]) {
+            text << "inode " << i << " has " << inodes[i].links << " links, " << records[i] << " records point to it";
+            problem(text.str());
+        }
+    }
+
+    compareBitmap();
+    compareSums();
+}
+
+bool Checker::damaged() const {
+    return !badRecordDirs.empty() || !badIndexDirs.empty();
+}
+
+void Checker::rewriteDirs() {
+    JournalHandle handle(vol->journal);
+
+    // index blocks aren't claimed, the bitmask gets them back
+    set<int> changed(badIndexDirs);
+    changed.insert(badRecordDirs.begin(), badRecordDirs.end());
+
+    for (set<int>::iterator it = changed.begin(); it != changed.end(); it++) {
+        Inode inode;
+        readInode(*it, &inode);
+        inode.indexRoot = 0;
+        writeInode(*it, &inode);
+    }
+
+    for (set<int>::iterator it = badRecordDirs.begin(); it != badRecordDirs.end(); it++) {
+        int dirId = *it;
+        if (states[dirId] != GOOD) continue;
+
+        int linksNumber;
+        Link* links = getLinks(dirId, linksNumber);
+
+        vector<Link> kept;
+        for (int i = 0; i < linksNumber; i++) {
+            Link link = links[i];
+            if (!validName(link)) continue;
+
+            if (strcmp(link.fileName, ".") == 0) {
+                link.inodeId = dirId;
+            } else if (strcmp(link.fileName, "..") == 0) {
+                link.inodeId = dirId == rootId ? rootId : parents[dirId];
+            } else if (link.inodeId <= 0 || link.inodeId >= inodesNumber || states[link.inodeId] != GOOD) {
+                continue;
+            }
+
+            kept.push_back(link);
+        }
+        delete[] links;
+
+        int size = kept.size() * sizeof(Link);
+        writeData(dirId, size, reinterpret_cast<const char*>(kept.data()));
+        truncateData(dirId, size);
+    }
+}
+
+void Checker::fixCounters() {
+    JournalHandle handle(vol->journal);
+
+    for (int i = 1; i < inodesNumber; i++) {
+        if (inodes[i].links <= 0) continue;
+
+        if (states[i] != GOOD) {
+            // blocks aren't freed, they may be used by others, the bitmask gets the rest back
+            freeInode(i);
+        } else if (inodes[i].links != records[i]) {
+            Inode inode;
+            readInode(i, &inode);
+            inode.links = records[i];
+            writeInode(i, &inode);
+        }
+    }
+
+    for (size_t i = 0; i < leakedBlocks.size(); i++) setBlockUnused(leakedBlocks[i]);
+    for (size_t i = 0; i < lostBlocks.size(); i++) setBlockUsed(lostBlocks[i]);
+
+    lock_guard<mutex> lock(vol->allocatorLock);
+    for (size_t i = 0; i < badShares.size(); i++) {
+        vol->refCounts.setShares(badShares[i], min(static_cast<int>(owners[badShares[i]]), MAX_SHARES));
+    }
+}
+
+void Checker::fixSums() {
+    JournalHandle handle(vol->journal);
+
+    for (size_t i = 0; i < badSums.size(); i++) vol->checksums.reseal(badSums[i].first, badSums[i].second);
+
+    // file data is verified again from now on
+    vol->superblock.unverified = 0;
+    vol->checksums.setUnverified(false);
+}
+
+void Checker::work(int worker) {
+    Task task;
+
+    while (true) {
+        if (take(worker, task)) {
+            if (task.links) {
+                for (int i = task.first; i < task.last; i++) checkRecord(worker, task.dirId, (*task.links)[i]);
+            } else {
+                readDir(worker, task.dirId);
+            }
+
+            task.links.reset();
+            pending--;
+        } else if (pending == 0) {
+            return;
+        } else {
+            this_thread::yield();
+        }
+    }
+}
+
+void Checker::push(int worker, const Task& task) {
+    pending++;
+
+    Queue& queue = *queues[worker];
+    lock_guard<mutex> guard(queue.lock);
+    queue.tasks.push_back(task);
+}
+
+bool Checker::take(int worker, Task& task) {
+    // own tasks are taken from the back, they are the most recent
+    {
+        Queue& queue = *queues[worker];
+        lock_guard<mutex> guard(queue.lock);
+
+        if (!queue.tasks.empty()) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // others are stolen from the front, where the largest pieces of work wait
+    for (int i = 1; i < threadsNumber; i++) {
+        Queue& queue = *queues[(worker + i) % threadsNumber];
+        lock_guard<mutex> guard(queue.lock);
+
+        if (!queue.tasks.empty()) {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Checker::readDir(int worker, int dirId) {
+    const Inode& inode = inodes[dirId];
+
+    // the map was checked with the inode
+    vector<Extent> extents;
+    vector<int> tree;
+    string why;
+    loadMap(inode, extents, tree, why);
+
+    int linksNumber = inode.size / sizeof(Link);
+    shared_ptr<vector<Link> > links(new vector<Link>(linksNumber));
+    if (linksNumber > 0) {
+        readExtents(extents.data(), extents.size(), reinterpret_cast<char*>(links->data()), linksNumber * sizeof(Link), 0);
+    }
+
+    if (inode.indexRoot != 0) {
+        long entries = 0;
+        vector<int> indexBlocks;
+
+        if (!checkIndex(inode.indexRoot, -1, *links, entries, indexBlocks) || entries != linksNumber) {
+            ostringstream text;
+            text << "dir " << dirId << ": index doesn't match the records";
+            problem(text.str());
+            markDir(badIndexDirs, dirId);
+        } else {
+            for (size_t i = 0; i < indexBlocks.size(); i++) claim(indexBlocks[i], 1, dirId);
+        }
+    }
+
+    for (int first = 0; first < linksNumber; first += FSCK_CHUNK_LINKS) {
+        Task task;
+        task.dirId = dirId;
+        task.links = links;
+        task.first = first;
+        task.last = min(linksNumber, first + FSCK_CHUNK_LINKS);
+        push(worker, task);
+    }
+}
+
+void Checker::checkRecord(int worker, int dirId, const Link& link) {
+    int id = link.inodeId;
+    bool named = validName(link);
+    bool self = named && strcmp(link.fileName, ".") == 0;
+    bool parent = named && strcmp(link.fileName, "..") == 0;
+    bool reachable = id > 0 && id < inodesNumber && inodes[id].links > 0;
+
+    // messages are made only for the damaged records
+    if (self && id == dirId) return;
+    if (parent && reachable && inodes[id].type == 1) return;
+
+    State state = UNVISITED;
+    if (named && !self && !parent && reachable) {
+        state = visit(worker, id, dirId);
+
+        if (state == GOOD) {
+            records[id]++;
+            return;
+        }
+    }
+
+    ostringstream text;
+    text << "dir " << dirId << ": ";
+
+    if (!named) {
+        text << "record with a bad name";
+    } else if (self || parent) {
+        text << "\"" << link.fileName << "\" points to inode " << id;
+    } else if (id <= 0 || id >= inodesNumber) {
+        text << "\"" << link.fileName << "\" points past the inode table";
+    } else if (state == UNVISITED) {
+        text << "\"" << link.fileName << "\" points to free inode " << id;
+    } else {
+        text << "\"" << link.fileName << "\" points to damaged inode " << id;
+    }
+
+    problem(text.str());
+    markDir(badRecordDirs, dirId);
+}
+
+Checker::State Checker::visit(int worker, int inodeId, int parentId) {
+    char state = UNVISITED;
+
+    if (states[inodeId].compare_exchange_strong(state, CHECKING)) {
+        parents[inodeId] = parentId;
+        bool good = checkInode(worker, inodeId);
+        states[inodeId] = good ? GOOD : BAD;
+        return good ? GOOD : BAD;
+    }
+
+    // another worker checks it right now
+    while ((state = states[inodeId]) == CHECKING) this_thread::yield();
+    return static_cast<State>(state);
+}
+
+bool Checker::checkInode(int worker, int inodeId) {
+    const Inode& inode = inodes[inodeId];
+
+    vector<Extent> extents;
+    vector<int> tree;
+    string why;
+
+    if (inode.type < 0 || inode.type > 2) {
+        why = "unknown type";
+    } else if (inode.size < 0 || (inode.type == 1 && inode.size % sizeof(Link) != 0)) {
+        why = "bad size";
+    } else {
+        loadMap(inode, extents, tree, why);
+    }
+
+    if (!why.empty()) {
+        ostringstream text;
+        text << "inode " << inodeId << ": " << why;
+        problem(text.str());
+        return false;
+    }
+
+    long used = tree.size();
+    for (size_t i = 0; i < tree.size(); i++) claim(tree[i], 1, inodeId);
+    for (size_t i = 0; i < extents.size(); i++) {
+        claim(extents[i].physical, extents[i].length, inodeId, true);
+        used += extents[i].length;
+    }
+
+    counters[static_cast<int>(inode.type)]++;
+    counters[3] += used;
+
+    if (inode.type == 1) {
+        Task task;
+        task.dirId = inodeId;
+        task.first = 0;
+        task.last = 0;
+        push(worker, task);
+    }
+
+    return true;
+}
+
+bool Checker::loadMap(const Inode& inode, vector<Extent>& extents, vector<int>& tree, string& why) {
+    // inline contents have no blocks
+    if (inode.depth == INLINE_DEPTH) {
+        if (inode.type == 1 || inode.extentsNumber != 0 || inode.size > INLINE_SIZE) why = "bad inline data";
+        return why.empty();
+    }
+
+    if (inode.depth < 0 || inode.depth > MAX_TREE_DEPTH || inode.extentsNumber < 0
+            || inode.extentsNumber > INODE_EXTENTS) {
+        why = "bad block map";
+        return false;
+    }
+
+    if (inode.depth == 0) {
+        extents.assign(inode.extents, inode.extents + inode.extentsNumber);
+    } else {
+        for (int i = 0; i < inode.extentsNumber; i++) {
+            if (!loadNode(inode.extents[i].physical, inode.extents[i].length, inode.depth - 1, extents, tree)) {
+                why = "bad tree of extents";
+                return false;
+            }
+        }
+    }
+
+    // extents go one after another by file blocks and lie on the device
+    long end = 0;
+    for (size_t i = 0; i < extents.size(); i++) {
+        const Extent& extent = extents[i];
+
+        if (extent.logical < end || extent.length <= 0 || !isRange(extent.physical, extent.length)) {
+            why = "bad extent";
+            return false;
+        }
+        end = static_cast<long>(extent.logical) + extent.length;
+    }
+
+    return true;
+}
+
+bool Checker::loadNode(int blockId, int count, int level, vector<Extent>& extents, vector<int>& tree) {
+    if (!isRange(blockId, 1) || count <= 0 || count > EXTENTS_PER_BLOCK) return false;
+
+    tree.push_back(blockId);
+
+    vector<Extent> entries(count);
+    readBlock(blockId, reinterpret_cast<char*>(entries.data()), count * sizeof(Extent));
+
+    if (level == 0) {
+        extents.insert(extents.end(), entries.begin(), entries.end());
+        return true;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!loadNode(entries[i].physical, entries[i].length, level - 1, extents, tree)) return false;
+    }
+
+    return true;
+}
+
+// level -1 - the root, its level is taken from the node
+bool Checker::checkIndex(int blockId, int level, const vector<Link>& links, long& entries, vector<int>& tree) {
+    if (!isRange(blockId, 1)) return false;
+
+    IndexNode node;
+    readBlock(blockId, reinterpret_cast<char*>(&node), sizeof(IndexNode));
+
+    if (level == -1) level = node.level;
+    if (node.level != level || level < 0 || level > MAX_TREE_DEPTH || node.count < 0 || node.count > INDEX_ENTRIES) {
+        return false;
+    }
+
+    tree.push_back(blockId);
+
+    for (int i = 0; i < node.count; i++) {
+        const IndexEntry& entry = node.entries[i];
+
+        if (level > 0) {
+            if (!checkIndex(entry.value, level - 1, links, entries, tree)) return false;
+            continue;
+        }
+
+        int slot = entry.value;
+        if (slot < 0 || slot >= static_cast<int>(links.size()) || !validName(links[slot])
+                || nameHash(links[slot].fileName) != entry.hash) {
+            return false;
+        }
+        entries++;
+    }
+
+    return true;
+}
+
+// false, if some of the blocks are already claimed; shareable ones are counted instead
+bool Checker::claim(int firstBlockId, int count, int inodeId, bool shareable) {
+    bool unique = true;
+
+    for (int blockId = firstBlockId; blockId < firstBlockId + count; ) {
+        int word = blockId / 64;
+        int bit = blockId % 64;
+        int bits = min(64 - bit, firstBlockId + count - blockId);
+        unsigned long mask = (bits == 64 ? ~0UL : ((1UL << bits) - 1)) << bit;
+
+        unsigned long shared = claimed[word].fetch_or(mask) & mask;
+        if (shared != 0 && shareable) {
+            for (; shared != 0; shared &= shared - 1) owners[word * 64 + __builtin_ctzl(shared)]++;
+        } else if (shared != 0) {
+            ostringstream text;
+            text << "block " << word * 64 + __builtin_ctzl(shared) << " of inode " << inodeId << " is used by another object";
+            problem(text.str());
+            unique = false;
+        }
+
+        blockId += bits;
+    }
+
+    return unique;
+}
+
+void Checker::compareBitmap() {
+    vector<thread> workers;
+    vector<vector<int> > leaked(threadsNumber);
+    vector<vector<int> > lost(threadsNumber);
+    vector<vector<int> > shares(threadsNumber);
+
+    int span = (blocksNumber - firstBlockId + threadsNumber - 1) / threadsNumber;
+
+    for (int t = 0; t < threadsNumber; t++) {
+        workers.push_back(thread([&, t] {
+            int from = firstBlockId + t * span;
+            int to = min(blocksNumber, from + span);
+
+            for (int blockId = from; blockId < to; blockId++) {
+                if (owners[blockId].load(memory_order_relaxed) != vol->refCounts.shares(blockId)) {
+                    shares[t].push_back(blockId);
+                }
+
+                bool used = (claimed[blockId / 64].load(memory_order_relaxed) >> (blockId % 64)) & 1;
+                if (used == vol->bitmap.isUsed(blockId)) continue;
+
+                if (used) {
+                    lost[t].push_back(blockId);
+                } else {
+                    leaked[t].push_back(blockId);
+                }
+            }
+        }));
+    }
+
+    for (int t = 0; t < threadsNumber; t++) {
+        workers[t].join();
+        leakedBlocks.insert(leakedBlocks.end(), leaked[t].begin(), leaked[t].end());
+        lostBlocks.insert(lostBlocks.end(), lost[t].begin(), lost[t].end());
+        badShares.insert(badShares.end(), shares[t].begin(), shares[t].end());
+    }
+
+    for (size_t i = 0; i < lostBlocks.size(); i++) {
+        ostringstream text;
+        text << "block " << lostBlocks[i] << " is used, but marked free";
+        problem(text.str());
+    }
+
+    for (size_t i = 0; i < leakedBlocks.size(); i++) {
+        ostringstream text;
+        text << "block " << leakedBlocks[i] << " is marked used, but nothing uses it";
+        problem(text.str());
+    }
+
+    for (size_t i = 0; i < badShares.size(); i++) {
+        ostringstream text;
+        text << "block " << badShares[i] << " has " << vol->refCounts.shares(badShares[i]) << " shares, "
+             << owners[badShares[i]] << " found";
+        problem(text.str());
+    }
+}
+
+// the bitmask and the claimed blocks, file data newer than its sums after a crash is told apart
+void Checker::compareSums() {
+    if (vol->superblock.checksumsBlocks == 0) return;
+
+    bool unverified = vol->superblock.unverified != 0;
+    vector<thread> workers;
+    vector<vector<pair<int, unsigned> > > damaged(threadsNumber);
+    vector<vector<pair<int, unsigned> > > stale(threadsNumber);
+
+    int span = (blocksNumber - BITMASK_BLOCK_ID + threadsNumber - 1) / threadsNumber;
+
+    for (int t = 0; t < threadsNumber; t++) {
+        workers.push_back(thread([&, t] {
+            int from = BITMASK_BLOCK_ID + t * span;
+            int to = min(blocksNumber, from + span);
+
+            vector<char> data(FSCK_READ_BLOCKS * BLOCK_SIZE);
+            unsigned sums[FSCK_READ_BLOCKS];
+
+            for (int blockId = from; blockId < to; ) {
+                if (blockId >= firstBlockId && !((claimed[blockId / 64].load(memory_order_relaxed) >> (blockId % 64)) & 1)) {
+                    blockId++;
+                    continue;
+                }
+
+                // a run of blocks in use is read at once
+                int count = 1;
+                while (count < FSCK_READ_BLOCKS && blockId + count < to &&
+                       (blockId + count < firstBlockId ||
+                        ((claimed[(blockId + count) / 64].load(memory_order_relaxed) >> ((blockId + count) % 64)) & 1))) {
+                    count++;
+                }
+
+                if (vol->device->read(static_cast<long>(blockId) * BLOCK_SIZE, &data[0], count * BLOCK_SIZE)) {
+                    crc32cBlocks(&data[0], count, sums);
+
+                    for (int i = 0; i < count; i++) {
+                        bool metadata;
+                        if (vol->checksums.matches(blockId + i, sums[i], metadata)) continue;
+
+                        if (unverified && !metadata) {
+                            stale[t].push_back(make_pair(blockId + i, sums[i]));
+                        } else {
+                            damaged[t].push_back(make_pair(blockId + i, sums[i]));
+                        }
+                    }
+                }
+
+                blockId += count;
+            }
+        }));
+    }
+
+    for (int t = 0; t < threadsNumber; t++) {
+        workers[t].join();
+        badSums.insert(badSums.end(), damaged[t].begin(), damaged[t].end());
+    }
+
+    size_t damagedNumber = badSums.size();
+    for (int t = 0; t < threadsNumber; t++) badSums.insert(badSums.end(), stale[t].begin(), stale[t].end());
+
+    // reads fail on both kinds, the repair takes them as they are
+    for (size_t i = 0; i < badSums.size(); i++) {
+        ostringstream text;
+        text << "block " << badSums[i].first << " doesn't match its checksum"
+             << (i < damagedNumber ? "" : ", it may be file data written just before the crash");
+        problem(text.str());
+    }
+}
+
+void Checker::problem(const string& text) {
+    errors++;
+
+    lock_guard<mutex> guard(fixesLock);
+    if (static_cast<int>(problems.size()) < FSCK_MAX_PROBLEMS) problems.push_back(text);
+}
+
+void Checker::markDir(set<int>& dirs, int dirId) {
+    lock_guard<mutex> guard(fixesLock);
+    dirs.insert(dirId);
+}
+
+bool Checker::isRange(int blockId, int count) const {
+    return blockId >= firstBlockId && count >= 0 && static_cast<long>(blockId) + count <= blocksNumber;
+}
+
+// the check mounts the device itself, the volume of the caller would be lost
+static bool mounted() {
+    if (vol == NULL) return false;
+
+    cout << "Error: a device is mounted, unmount it before the check" << endl;
+    return true;
+}
+
+FsckReport fsck(const char* fileName, const FsckOptions& options) {
+    if (mounted()) return FsckReport();
+
+    unique_ptr<BlockDevice> device;
+
+    if (options.useMmap) {
+        MmapDevice* mmapDevice = new MmapDevice();
+        device.reset(mmapDevice);
+
+        if (!mmapDevice->open(fileName)) device.reset();
+    }
+
+    if (!device) {
+        FileDevice* fileDevice = new FileDevice();
+        device.reset(fileDevice);
+
+        if (!fileDevice->open(fileName)) return FsckReport();
+    }
+
+    return fsck(device.get(), options);
+}
+
+FsckReport fsck(BlockDevice* device, const FsckOptions& options) {
+    FsckReport report;
+    if (mounted()) return report;
+
+    // mount() would format a device without the file system
+    Superblock super;
+    char block[BLOCK_SIZE];
+    device->read(static_cast<long>(SUPERBLOCK_ID) * BLOCK_SIZE, block, BLOCK_SIZE);
+    memcpy(&super, block, sizeof(Superblock));
+
+    if (super.magic != SUPERBLOCK_MAGIC || super.version != FS_VERSION || super.blockSize != BLOCK_SIZE) {
+        return report;
+    }
+
+    MountOptions mountOptions;
+    mountOptions.useMmap = options.useMmap;
+    mountOptions.readaheadBlocks = 0;
+    mountOptions.writeBufferBlocks = 0;
+    mountOptions.checkMetadata = false;         // damaged blocks are found by the check
+    if (!mount(device, mountOptions)) return report;
+
+    int threadsNumber = options.threads > 0 ? options.threads : max(1u, thread::hardware_concurrency());
+
+    unique_ptr<Checker> checker(new Checker(threadsNumber));
+    checker->run();
+
+    report.checked = true;
+    report.dirs = checker->dirs;
+    report.files = checker->files;
+    report.symlinks = checker->symlinks;
+    report.blocks = checker->blocks;
+    report.errors = checker->errors;
+    report.remaining = checker->errors;
+    report.problems = checker->problems;
+
+    if (options.repair && (report.errors > 0 || vol->superblock.unverified)) {
+        checker->fixSums();
+
+        // counters are taken from the tree, that is left after the records are fixed
+        if (checker->damaged()) {
+            checker->rewriteDirs();
+            checker.reset(new Checker(threadsNumber));
+            checker->run();
+        }
+
+        checker->fixCounters();
+
+        // the check reads the device past the cache
+        sync();
+        checker.reset(new Checker(threadsNumber));
+        checker->run();
+        report.remaining = checker->errors;
+
+        for (size_t i = 0; i < checker->problems.size(); i++) {
+            report.problems.push_back("not repaired: " + checker->problems[i]);
+        }
+    }
+
+    umount();
+    return report;
+}
+
+}       // fs::namespace end
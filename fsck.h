@@ -0,0 +1,45 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include "fs.h"
+
+#include <string>
+#include <vector>
+
+namespace fs {
+
+const int FSCK_MAX_PROBLEMS = 1000;             // problems described in the report, others are only counted
+const int FSCK_CHUNK_LINKS = 4096;              // dir records checked by one task
+
+/**
+ * @brief The FsckOptions struct describes a check of an unmounted device
+ */
+struct FsckOptions {
+    int threads = 0;                            // workers of the traversal, 0 - one per core
+    bool repair = false;                        // fix what was found, else the metadata isn't changed
+    bool useMmap = true;                        // map the device file, positional I/O otherwise
+};
+
+/**
+ * @brief The FsckReport struct describes the state of a device found by fsck()
+ */
+struct FsckReport {
+    bool checked = false;                       // false, if there is no file system on the device
+    long dirs = 0;                              // objects reachable from the root
+    long files = 0;
+    long symlinks = 0;
+    long blocks = 0;                            // blocks they occupy, maps and indexes included
+    long errors = 0;                            // problems found
+    long remaining = 0;                         // problems left after the repair
+    std::vector<std::string> problems;          // first FSCK_MAX_PROBLEMS of the found ones
+};
+
+// walks the tree from the root by several threads and compares the block bitmask
+// and the inode link counts with what is reachable; the journal is replayed first.
+// Nothing is checked, while a device is mounted
+FsckReport fsck(const char* fileName, const FsckOptions& options = FsckOptions());
+FsckReport fsck(BlockDevice* device, const FsckOptions& options = FsckOptions());   // device isn't owned
+
+}       // fs::namespace end
+
+#endif // FSCK_H
@@ -0,0 +1,68 @@
+#include "fsck.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace fs;
+using namespace std;
+
+// exit codes, like e2fsck ones
+const int EXIT_CLEAN = 0;
+const int EXIT_REPAIRED = 1;
+const int EXIT_ERRORS_LEFT = 4;
+const int EXIT_USAGE = 8;
+
+static void usage() {
+    cerr << "usage: fsfsck [--repair] [--threads N] [--no-mmap] IMAGE" << endl;
+}
+
+int main(int argc, char** argv) {
+    FsckOptions options;
+    const char* image = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (arg == "--repair") {
+            options.repair = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = atoi(argv[++i]);
+        } else if (arg == "--no-mmap") {
+            options.useMmap = false;
+        } else if (arg[0] != '-' && image == NULL) {
+            image = argv[i];
+        } else {
+            usage();
+            return EXIT_USAGE;
+        }
+    }
+
+    if (image == NULL) {
+        usage();
+        return EXIT_USAGE;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    FsckReport report = fsck(image, options);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (!report.checked) {
+        cerr << "Error: " << image << " has no file system" << endl;
+        return EXIT_USAGE;
+    }
+
+    for (size_t i = 0; i < report.problems.size(); i++) cout << report.problems[i] << endl;
+    if (report.errors > static_cast<long>(report.problems.size())) {
+        cout << "... " << report.errors - report.problems.size() << " more" << endl;
+    }
+
+    cout << image << ": " << report.dirs << " dirs, " << report.files << " files, " << report.symlinks
+         << " symlinks, " << report.blocks << " blocks, " << report.errors << " errors";
+    if (options.repair) cout << ", " << report.remaining << " left";
+    cout << " (" << seconds << " s)" << endl;
+
+    if (report.remaining > 0) return EXIT_ERRORS_LEFT;
+    return report.errors > 0 ? EXIT_REPAIRED : EXIT_CLEAN;
+}
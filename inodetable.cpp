@@ -0,0 +1,135 @@
+#include "inodetable.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace fs {
+
+InodeTable::InodeTable() : firstBlockId(0), inodesNumber(0), usedInodes(0), hint(1) {}
+
+bool InodeTable::load(BlockCache& cache, int firstBlockId, int inodesNumber) {
+    lock_guard<mutex> guard(lock);
+
+    this->firstBlockId = firstBlockId;
+    this->inodesNumber = inodesNumber;
+    hint = 1;
+
+    int blocksNumber = (inodesNumber + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+
+    table.assign(static_cast<long>(blocksNumber) * BLOCK_SIZE, 0);
+    dirtyBlocks.assign(blocksNumber, false);
+    bool verified = blocksNumber == 0 || cache.readBlocks(firstBlockId, blocksNumber, &table[0]);
+
+    // inodes with links are in use, 0 is reserved
+    used.assign(inodesNumber, false);
+    usedInodes = 0;
+    for (int i = 0; i < inodesNumber; i++) {
+        Inode inode;
+        memcpy(&inode, &table[static_cast<long>(i) * INODE_SIZE], sizeof(Inode));
+        used[i] = i == 0 || inode.links > 0;
+        if (used[i]) usedInodes++;
+    }
+
+    return verified;
+}
+
+void InodeTable::flush(Journal& journal) {
+    lock_guard<mutex> guard(lock);
+
+    int blocksNumber = dirtyBlocks.size();
+
+    // runs of dirty blocks are written at once
+    for (int b = 0; b < blocksNumber; b++) {
+        if (!dirtyBlocks[b]) continue;
+
+        int count = 1;
+        while (b + count < blocksNumber && dirtyBlocks[b + count]) count++;
+
+        journal.writeBlocks(firstBlockId + b, count, &table[static_cast<long>(b) * BLOCK_SIZE]);
+        for (int i = 0; i < count; i++) dirtyBlocks[b + i] = false;
+
+        b += count - 1;
+    }
+}
+
+bool InodeTable::read(int inodeId, Inode* inode) {
+    if (!isValid(inodeId)) return false;
+
+    lock_guard<mutex> guard(lock);
+    memcpy(inode, &table[static_cast<long>(inodeId) * INODE_SIZE], sizeof(Inode));
+    return true;
+}
+
+void InodeTable::copy(vector<Inode>& inodes) {
+    lock_guard<mutex> guard(lock);
+
+    inodes.resize(inodesNumber);
+    for (int i = 0; i < inodesNumber; i++) {
+        memcpy(&inodes[i], &table[static_cast<long>(i) * INODE_SIZE], sizeof(Inode));
+    }
+}
+
+void InodeTable::read(const int* inodeIds, int count, Inode* inodes) {
+    lock_guard<mutex> guard(lock);
+
+    for (int i = 0; i < count; i++) {
+        if (isValid(inodeIds[i])) {
+            memcpy(&inodes[i], &table[static_cast<long>(inodeIds[i]) * INODE_SIZE], sizeof(Inode));
+        } else {
+            memset(&inodes[i], 0, sizeof(Inode));
+        }
+    }
+}
+
+void InodeTable::write(int inodeId, const Inode* inode) {
+    if (!isValid(inodeId)) return;
+
+    lock_guard<mutex> guard(lock);
+    memcpy(&table[static_cast<long>(inodeId) * INODE_SIZE], inode, sizeof(Inode));
+    dirtyBlocks[inodeId / INODES_PER_BLOCK] = true;
+}
+
+void InodeTable::setUsed(int inodeId) {
+    if (!isValid(inodeId)) return;
+
+    lock_guard<mutex> guard(lock);
+    if (!used[inodeId]) usedInodes++;
+    used[inodeId] = true;
+}
+
+void InodeTable::setUnused(int inodeId) {
+    if (!isValid(inodeId)) return;
+
+    lock_guard<mutex> guard(lock);
+    if (used[inodeId]) usedInodes--;
+    used[inodeId] = false;
+}
+
+int InodeTable::allocate() {
+    lock_guard<mutex> guard(lock);
+
+    // continue from the place of the last allocation, then wrap around
+    for (int i = 0; i < inodesNumber; i++) {
+        int inodeId = (hint + i) % inodesNumber;
+        if (used[inodeId]) continue;
+
+        used[inodeId] = true;
+        usedInodes++;
+        hint = inodeId;
+        return inodeId;
+    }
+
+    return -1;
+}
+
+int InodeTable::freeInodes() {
+    lock_guard<mutex> guard(lock);
+    return inodesNumber - usedInodes;
+}
+
+bool InodeTable::isValid(int inodeId) const {
+    return inodeId > 0 && inodeId < inodesNumber;
+}
+
+}       // fs::namespace end
@@ -0,0 +1,51 @@
+#ifndef INODETABLE_H
+#define INODETABLE_H
+
+#include "blockcache.h"
+#include "journal.h"
+
+#include <mutex>
+#include <vector>
+
+namespace fs {
+
+/**
+ * @brief The InodeTable class keeps the device inode table in memory.
+ * Inodes are packed INODES_PER_BLOCK per block, inode i lives in block
+ * (firstBlockId + i / INODES_PER_BLOCK). Changed blocks are written back
+ * on flush. Inode 0 is never given out, inodes with no links are free
+ */
+class InodeTable {
+public:
+    InodeTable();
+
+    bool load(BlockCache& cache, int firstBlockId, int inodesNumber);  // false, if some blocks are damaged
+    void flush(Journal& journal);               // writes dirty table blocks back
+
+    bool read(int inodeId, Inode* inode);       // false, if there is no such inode
+    void copy(std::vector<Inode>& inodes);      // all the inodes at once
+    // inodes of the sorted ids by one sweep over the table, zeros for the invalid ones
+    void read(const int* inodeIds, int count, Inode* inodes);
+    void write(int inodeId, const Inode* inode);
+
+    void setUsed(int inodeId);
+    void setUnused(int inodeId);
+    int allocate();                             // next-fit search, -1 if the table is full
+    int freeInodes();
+
+private:
+    bool isValid(int inodeId) const;
+
+    std::mutex lock;
+    std::vector<char> table;                    // copy of the table blocks
+    std::vector<bool> dirtyBlocks;              // table blocks changed since flush
+    std::vector<bool> used;                     // inodes given out
+    int firstBlockId;                           // first block of the table
+    int inodesNumber;
+    int usedInodes;                             // inodes given out, 0 included
+    int hint;                                   // inode where the last search stopped
+};
+
+}       // fs::namespace end
+
+#endif // INODETABLE_H
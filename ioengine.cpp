@@ -0,0 +1,413 @@
+#include "ioengine.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FS_IO_URING 1
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE                               // linux/fs.h macro hides fs::BLOCK_SIZE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+
+using namespace std;
+
+namespace fs {
+
+const unsigned SYNC_BATCH = 64;                 // transfers done at once without io_uring
+
+IoEngine::IoEngine() : device(NULL), cache(NULL), deviceFd(-1), inFlight(0), requests(0),
+                       ringFd(-1), entries(SYNC_BATCH), cqEntries(0), sqRing(NULL), cqRing(NULL),
+                       sqRingSize(0), cqRingSize(0), sqes(NULL) {
+}
+
+IoEngine::~IoEngine() {
+    stop();
+}
+
+void IoEngine::start(BlockDevice* device, BlockCache* cache, int depth) {
+    stop();
+
+    this->device = device;
+    this->cache = cache;
+    deviceFd = device->descriptor();
+
+    // mapped devices are served from memory by the cache, they never get here
+    if (depth > 0 && deviceFd != -1) setupRing(depth);
+}
+
+void IoEngine::stop() {
+    if (device == NULL) return;
+
+    waitAll();
+
+    lock_guard<mutex> guard(lock);
+    for (size_t i = 0; i < finished.size(); i++) delete finished[i];
+    finished.clear();
+
+    closeRing();
+    device = NULL;
+    cache = NULL;
+    deviceFd = -1;
+}
+
+bool IoEngine::usesRing() const {
+    return ringFd != -1;
+}
+
+AsyncRequest* IoEngine::begin(int inodeId, bool write, int bytes, const IoCallback& done) {
+    AsyncRequest* request = new AsyncRequest();
+    request->inodeId = inodeId;
+    request->write = write;
+    request->bytes = bytes;
+    request->pending = 1;
+    request->failed = false;
+    request->done = done;
+
+    lock_guard<mutex> guard(lock);
+    pair<int, int>& counters = busy[inodeId];
+    if (write) counters.second++; else counters.first++;
+    requests++;
+
+    return request;
+}
+
+void IoEngine::read(AsyncRequest* request, int firstBlockId, int count, char* data) {
+    vector<bool> cached;
+    bool damaged;
+    bool all = cache->readCached(firstBlockId, count, data, cached, damaged);
+
+    if (damaged) fail(request);
+    if (all) return;
+
+    for (int i = 0; i < count; ) {
+        if (cached[i]) {
+            i++;
+            continue;
+        }
+
+        int j = i;
+        while (j < count && !cached[j]) j++;
+
+        queue(request, false, static_cast<long>(firstBlockId + i) * BLOCK_SIZE, &data[i * BLOCK_SIZE],
+              (j - i) * BLOCK_SIZE);
+        i = j;
+    }
+}
+
+void IoEngine::write(AsyncRequest* request, int firstBlockId, int count, const char* data) {
+    if (!cache->writeCached(firstBlockId, count, data)) return;
+
+    queue(request, true, static_cast<long>(firstBlockId) * BLOCK_SIZE, const_cast<char*>(data),
+          count * BLOCK_SIZE);
+}
+
+void IoEngine::end(AsyncRequest* request) {
+    lock_guard<mutex> guard(lock);
+    release(request);
+}
+
+void IoEngine::cancel(AsyncRequest* request) {
+    lock_guard<mutex> guard(lock);
+
+    pair<int, int>& counters = busy[request->inodeId];
+    if (request->write) counters.second--; else counters.first--;
+    if (counters.first == 0 && counters.second == 0) busy.erase(request->inodeId);
+    requests--;
+
+    delete request;
+}
+
+void IoEngine::fail(AsyncRequest* request) {
+    lock_guard<mutex> guard(lock);
+    request->failed = true;
+}
+
+void IoEngine::submit() {
+    lock_guard<mutex> guard(lock);
+
+    submitLocked();
+    if (ringFd != -1) reapLocked();
+}
+
+void IoEngine::reap(bool wait, vector<AsyncRequest*>& finished) {
+    lock_guard<mutex> guard(lock);
+
+    submitLocked();
+    if (ringFd != -1) reapLocked();
+
+    while (wait && this->finished.empty() && waitLocked()) {}
+
+    finished.insert(finished.end(), this->finished.begin(), this->finished.end());
+    this->finished.clear();
+}
+
+void IoEngine::waitInode(int inodeId, bool writesOnly) {
+    lock_guard<mutex> guard(lock);
+    if (requests == 0) return;
+
+    submitLocked();
+
+    while (true) {
+        unordered_map<int, pair<int, int> >::iterator found = busy.find(inodeId);
+        if (found == busy.end()) return;
+        if (writesOnly && found->second.second == 0) return;
+
+        if (!waitLocked()) return;
+    }
+}
+
+void IoEngine::waitAll() {
+    lock_guard<mutex> guard(lock);
+
+    submitLocked();
+    while (waitLocked()) {}
+}
+
+void IoEngine::queue(AsyncRequest* request, bool write, long offset, char* data, int size) {
+    Transfer* transfer = new Transfer();
+    transfer->request = request;
+    transfer->write = write;
+    transfer->offset = offset;
+    transfer->data = data;
+    transfer->size = size;
+
+    lock_guard<mutex> guard(lock);
+
+    request->pending++;
+    queued.push_back(transfer);
+
+    if (queued.size() >= entries) submitLocked();
+}
+
+void IoEngine::submitLocked() {
+    if (queued.empty()) return;
+
+    if (ringFd == -1) {
+        // no ring, every transfer is done here and now
+        for (size_t i = 0; i < queued.size(); i++) complete(queued[i], -1);
+        queued.clear();
+        return;
+    }
+
+#ifdef FS_IO_URING
+    size_t next = 0;
+
+    while (next < queued.size()) {
+        // never more transfers in the kernel, than completions fit into the ring
+        while (inFlight >= static_cast<int>(cqEntries)) waitLocked();
+
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        unsigned tail = *sqTail;
+        unsigned count = 0;
+
+        while (next < queued.size() && tail - head < entries &&
+               inFlight + static_cast<int>(count) < static_cast<int>(cqEntries)) {
+            Transfer* transfer = queued[next++];
+
+            unsigned index = tail & *sqMask;
+            io_uring_sqe* sqe = &static_cast<io_uring_sqe*>(sqes)[index];
+            memset(sqe, 0, sizeof(io_uring_sqe));
+            sqe->opcode = transfer->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = deviceFd;
+            sqe->addr = reinterpret_cast<uintptr_t>(transfer->data);
+            sqe->len = transfer->size;
+            sqe->off = transfer->offset;
+            sqe->user_data = reinterpret_cast<uintptr_t>(transfer);
+
+            sqArray[index] = index;
+            tail++;
+            count++;
+        }
+
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+        // one system call for the whole batch
+        unsigned left = count;
+        while (left > 0) {
+            int submitted = syscall(__NR_io_uring_enter, ringFd, left, 0, 0, NULL, 0);
+
+            if (submitted > 0) {
+                left -= submitted;
+                inFlight += submitted;
+            } else if (submitted < 0 && errno == EINTR) {
+                continue;
+            } else if (submitted < 0 && (errno == EAGAIN || errno == EBUSY) && inFlight > 0) {
+                // kernel is out of resources, let it finish something first
+                waitLocked();
+            } else {
+                break;
+            }
+        }
+
+        if (left > 0) {
+            // take back, what the kernel didn't consume, and do it synchronously
+            unsigned consumed = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            for (unsigned i = consumed; i != tail; i++) {
+                io_uring_sqe* sqe = &static_cast<io_uring_sqe*>(sqes)[sqArray[i & *sqMask]];
+                complete(reinterpret_cast<Transfer*>(static_cast<uintptr_t>(sqe->user_data)), -1);
+            }
+            __atomic_store_n(sqTail, consumed, __ATOMIC_RELEASE);
+        }
+    }
+#endif
+
+    queued.clear();
+}
+
+bool IoEngine::waitLocked() {
+    if (inFlight == 0) return false;
+
+#ifdef FS_IO_URING
+    if (reapLocked() > 0) return true;
+
+    while (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+           errno == EINTR) {}
+
+    reapLocked();
+#endif
+
+    return true;
+}
+
+int IoEngine::reapLocked() {
+    int reaped = 0;
+
+#ifdef FS_IO_URING
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        io_uring_cqe* cqe = &static_cast<io_uring_cqe*>(cqes)[head & *cqMask];
+        Transfer* transfer = reinterpret_cast<Transfer*>(static_cast<uintptr_t>(cqe->user_data));
+        int result = cqe->res;
+
+        head++;
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+        inFlight--;
+        reaped++;
+        complete(transfer, result);
+    }
+#endif
+
+    return reaped;
+}
+
+// result is the number of bytes transferred by the ring, -1 if it wasn't used
+void IoEngine::complete(Transfer* transfer, int result) {
+    int done = max(result, 0);
+    bool ok = true;
+
+    // whatever the ring didn't finish (errors, short transfers, end of the file) is done by the device
+    if (done < transfer->size) {
+        if (transfer->write) {
+            ok = device->write(transfer->offset + done, &transfer->data[done], transfer->size - done);
+        } else {
+            ok = device->read(transfer->offset + done, &transfer->data[done], transfer->size - done);
+        }
+    }
+
+    if (transfer->write) {
+        cache->writeDone();
+    } else if (ok) {
+        ok = cache->verify(transfer->offset / BLOCK_SIZE, transfer->size / BLOCK_SIZE, transfer->data);
+    }
+    if (!ok) transfer->request->failed = true;
+
+    release(transfer->request);
+    delete transfer;
+}
+
+void IoEngine::release(AsyncRequest* request) {
+    if (--request->pending > 0) return;
+
+    pair<int, int>& counters = busy[request->inodeId];
+    if (request->write) counters.second--; else counters.first--;
+    if (counters.first == 0 && counters.second == 0) busy.erase(request->inodeId);
+    requests--;
+
+    finished.push_back(request);
+}
+
+bool IoEngine::setupRing(int depth) {
+#ifdef FS_IO_URING
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0) return false;
+
+    ringFd = fd;
+    entries = params.sq_entries;
+    cqEntries = params.cq_entries;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    // both rings may share one mapping
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) sqRing = NULL;
+
+    if (single) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) cqRing = NULL;
+    }
+
+    sqes = mmap(NULL, entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) sqes = NULL;
+
+    if (sqRing == NULL || cqRing == NULL || sqes == NULL) {
+        cout << "Error: can't map io_uring, async I/O is synchronous" << endl;
+        closeRing();
+        return false;
+    }
+
+    char* sq = static_cast<char*>(sqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(cqRing);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void IoEngine::closeRing() {
+#ifdef FS_IO_URING
+    if (sqes != NULL) munmap(sqes, entries * sizeof(io_uring_sqe));
+    if (cqRing != NULL && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing != NULL) munmap(sqRing, sqRingSize);
+    if (ringFd != -1) ::close(ringFd);
+#endif
+
+    ringFd = -1;
+    entries = SYNC_BATCH;
+    cqEntries = 0;
+    sqRing = NULL;
+    cqRing = NULL;
+    sqes = NULL;
+}
+
+}       // fs::namespace end
@@ -0,0 +1,113 @@
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include "blockcache.h"
+#include "blockdevice.h"
+#include "fs.h"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fs {
+
+/**
+ * @brief The AsyncRequest struct describes a readAsync() or writeAsync() call,
+ * it is finished, when all its device transfers are
+ */
+struct AsyncRequest {
+    int inodeId;
+    bool write;
+    int bytes;                                  // passed to the callback on success
+    int pending;                                // transfers in flight, +1 while queueing
+    bool failed;
+    IoCallback done;
+};
+
+/**
+ * @brief The IoEngine class runs device transfers of asynchronous requests.
+ * Transfers are queued and handed to io_uring in batches by submit(), finished
+ * ones are taken from the completion ring without a system call. Devices without
+ * a descriptor or systems without io_uring get the transfers done synchronously
+ * by submit(). Cached blocks are served by the block cache. Callbacks are never
+ * called by the engine, reap() gives finished requests to the caller
+ */
+class IoEngine {
+public:
+    IoEngine();
+    ~IoEngine();
+
+    void start(BlockDevice* device, BlockCache* cache, int depth);  // depth 0 disables io_uring
+    void stop();                                // waits for all the transfers
+
+    AsyncRequest* begin(int inodeId, bool write, int bytes, const IoCallback& done);
+    // whole blocks [firstBlockId, firstBlockId + count) of the request
+    void read(AsyncRequest* request, int firstBlockId, int count, char* data);
+    void write(AsyncRequest* request, int firstBlockId, int count, const char* data);
+    void end(AsyncRequest* request);            // all the transfers are queued
+    void cancel(AsyncRequest* request);         // nothing was queued, forgets the request
+    void fail(AsyncRequest* request);           // the callback gets -1, damaged data was read
+
+    void submit();                              // hands queued transfers to the device
+    // takes finished requests, waits for one, if wait and there are some in flight
+    void reap(bool wait, std::vector<AsyncRequest*>& finished);
+
+    // until no request of the inode (or only reads, if writesOnly) is in flight
+    void waitInode(int inodeId, bool writesOnly);
+    void waitAll();                             // finished requests are kept for reap()
+
+    bool usesRing() const;
+
+private:
+    struct Transfer {
+        AsyncRequest* request;
+        bool write;
+        long offset;
+        char* data;
+        int size;
+    };
+
+    bool setupRing(int depth);
+    void closeRing();
+    void queue(AsyncRequest* request, bool write, long offset, char* data, int size);
+    void submitLocked();
+    bool waitLocked();                          // reaps at least one transfer, false if none is in flight
+    int reapLocked();                           // number of reaped transfers
+    void complete(Transfer* transfer, int result);
+    void release(AsyncRequest* request);        // drops one pending transfer
+
+    BlockDevice* device;
+    BlockCache* cache;
+    int deviceFd;
+
+    std::mutex lock;
+    std::vector<Transfer*> queued;              // not submitted yet
+    std::deque<AsyncRequest*> finished;
+    std::unordered_map<int, std::pair<int, int> > busy;   // inode -> requests in flight (reads, writes)
+    int inFlight;                               // transfers given to the kernel
+    int requests;                               // requests not finished yet
+
+    // io_uring, ringFd is -1 if it isn't used
+    int ringFd;
+    unsigned entries;                           // size of the submission ring or of a batch
+    unsigned cqEntries;
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    void* sqes;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    void* cqes;
+};
+
+}       // fs::namespace end
+
+#endif // IOENGINE_H
@@ -0,0 +1,555 @@
+#include "journal.h"
+#include "checksums.h"
+#include "stats.h"
+
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <unordered_map>
+
+using namespace std;
+
+namespace fs {
+
+static thread_local int depth = 0;              // operations of the thread in progress
+
+// CRC32C of the transaction blocks, a torn log write doesn't pass it
+static unsigned checksum(unsigned hash, const char* data, int size) {
+    return crc32c(data, size, hash);
+}
+
+static const unsigned CHECKSUM_SEED = 0;
+
+Journal::Journal() :
+    cache(NULL), firstBlockId(0), blocksNumber(0), interval(0), journaled(0), head(1),
+    requested(0), finished(0), busy(false), stopping(false) {
+    running.sequence = 1;
+}
+
+Journal::~Journal() {
+    stop();
+}
+
+void Journal::format(BlockCache* cache, int firstBlockId, int blocksNumber) {
+    this->cache = cache;
+    this->firstBlockId = firstBlockId;
+    this->blocksNumber = blocksNumber;
+
+    restart(1);
+}
+
+int Journal::recover(BlockCache* cache, int firstBlockId, int blocksNumber) {
+    this->cache = cache;
+    this->firstBlockId = firstBlockId;
+    this->blocksNumber = blocksNumber;
+
+    JournalHeader header;
+    char block[BLOCK_SIZE];
+    cache->read(firstBlockId, block);
+    memcpy(&header, block, sizeof(JournalHeader));
+
+    if (header.magic != JOURNAL_MAGIC || header.blocksNumber != blocksNumber) {
+        restart(1);
+        return 0;
+    }
+
+    struct Logged {
+        int sequence;
+        vector<pair<int, vector<char> > > blocks;
+        vector<int> revoked;
+    };
+
+    // transactions follow each other until the first one, that isn't committed
+    vector<Logged> transactions;
+    int sequence = header.sequence;
+    int position = 1;
+
+    while (position < blocksNumber) {
+        Logged tx;
+        tx.sequence = sequence;
+
+        int start = position;
+        unsigned hash = CHECKSUM_SEED;
+        bool complete = false;
+
+        while (position < blocksNumber) {
+            JournalRecord record;
+            cache->read(firstBlockId + position, block);
+            memcpy(&record, block, sizeof(JournalRecord));
+
+            if (record.magic != JOURNAL_MAGIC || record.sequence != sequence) break;
+
+            if (record.type == RECORD_COMMIT) {
+                complete = record.count == position - start && record.checksum == hash;
+                position++;
+                break;
+            }
+
+            if (record.type != RECORD_DESCRIPTOR || record.count < 0 || record.count > JOURNAL_ENTRIES) break;
+
+            hash = checksum(hash, block, BLOCK_SIZE);
+            position++;
+
+            bool fits = true;
+            for (int i = 0; i < record.count && fits; i++) {
+                int entry = record.entries[i];
+
+                if (entry < 0) {
+                    tx.revoked.push_back(-entry - 1);
+                } else if (position < blocksNumber) {
+                    vector<char> image(BLOCK_SIZE);
+                    cache->read(firstBlockId + position, image.data());
+                    hash = checksum(hash, image.data(), BLOCK_SIZE);
+                    tx.blocks.push_back(make_pair(entry, move(image)));
+                    position++;
+                } else {
+                    fits = false;
+                }
+            }
+
+            if (!fits) break;
+        }
+
+        if (!complete) break;
+
+        transactions.push_back(move(tx));
+        sequence++;
+    }
+
+    // an image is stale, if its block was revoked by a later transaction
+    unordered_map<int, int> revokedBy;
+    for (size_t t = 0; t < transactions.size(); t++) {
+        for (size_t i = 0; i < transactions[t].revoked.size(); i++) {
+            revokedBy[transactions[t].revoked[i]] = transactions[t].sequence;
+        }
+    }
+
+    for (size_t t = 0; t < transactions.size(); t++) {
+        Logged& tx = transactions[t];
+
+        for (size_t i = 0; i < tx.blocks.size(); i++) {
+            unordered_map<int, int>::iterator revoke = revokedBy.find(tx.blocks[i].first);
+            if (revoke != revokedBy.end() && revoke->second > tx.sequence) continue;
+
+            cache->writeBlocks(tx.blocks[i].first, 1, tx.blocks[i].second.data());
+        }
+    }
+
+    if (!transactions.empty()) cache->sync();
+
+    // the log is started over after the transactions, that are on their places
+    restart(sequence);
+    return transactions.size();
+}
+
+void Journal::start(BlockCache* cache, int firstBlockId, int blocksNumber, int interval,
+                    function<void()> collect, function<void()> commitDone) {
+    this->cache = cache;
+    this->firstBlockId = firstBlockId;
+    this->blocksNumber = blocksNumber;
+    this->interval = interval;
+    this->collect = collect;
+    this->commitDone = commitDone;
+
+    JournalHeader header;
+    char block[BLOCK_SIZE];
+    cache->read(firstBlockId, block);
+    memcpy(&header, block, sizeof(JournalHeader));
+
+    running = Transaction();
+    running.sequence = header.magic == JOURNAL_MAGIC ? header.sequence : 1;
+    head = 1;
+    stopping = false;
+
+    worker = thread(&Journal::work, this);
+}
+
+void Journal::stop() {
+    if (!worker.joinable()) return;
+
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    done.notify_all();
+    worker.join();
+
+    // the device is left with everything on its place and an empty log
+    commitRunning();
+    checkpoint(INT_MAX);
+    restart(running.sequence);
+}
+
+void Journal::begin() {
+    if (depth++ > 0) return;
+
+    // a transaction larger than half of the log waits for the commit
+    if (worker.joinable()) {
+        unique_lock<mutex> guard(lock);
+
+        int limit = (blocksNumber - 1) / 2;
+        if (static_cast<int>(running.blocks.size()) >= limit) {
+            wake.notify_one();
+            done.wait(guard, [&] { return static_cast<int>(running.blocks.size()) < limit || stopping; });
+        }
+    }
+
+    opLock.lock_shared();
+}
+
+void Journal::end() {
+    if (--depth > 0) return;
+
+    opLock.unlock_shared();
+
+    bool synchronous;
+    {
+        lock_guard<mutex> guard(lock);
+        busy = true;
+        synchronous = interval == 0;
+
+        if (static_cast<int>(running.blocks.size()) >= (blocksNumber - 1) / 4) wake.notify_one();
+    }
+
+    if (synchronous) commit();
+}
+
+void Journal::write(int blockId, const char* data, int size, int shift) {
+    lock_guard<mutex> guard(lock);
+
+    map<int, vector<char> >::iterator it = running.blocks.find(blockId);
+
+    if (it == running.blocks.end()) {
+        vector<char> image(BLOCK_SIZE);
+
+        // a part of the block is changed over its last image
+        if (size < BLOCK_SIZE) {
+            const vector<char>* last = latest(blockId);
+            if (last != NULL) {
+                image = *last;
+            } else {
+                cache->read(blockId, image.data());
+            }
+        }
+
+        it = running.blocks.insert(make_pair(blockId, move(image))).first;
+        journaled++;
+    }
+
+    memcpy(&it->second[shift], data, size);
+}
+
+void Journal::writeBlocks(int firstBlockId, int count, const char* data) {
+    for (int i = 0; i < count; i++) {
+        write(firstBlockId + i, &data[static_cast<long>(i) * BLOCK_SIZE]);
+    }
+}
+
+bool Journal::read(int blockId, char* data, int size, int shift) {
+    if (journaled == 0) return false;
+
+    lock_guard<mutex> guard(lock);
+
+    const vector<char>* image = latest(blockId);
+    if (image == NULL) return false;
+
+    memcpy(data, &(*image)[shift], size);
+    return true;
+}
+
+void Journal::overlay(int firstBlockId, int count, char* data) {
+    if (journaled == 0) return;
+
+    lock_guard<mutex> guard(lock);
+
+    // newer images are copied over older ones
+    for (size_t t = 0; t <= committed.size(); t++) {
+        const Transaction& tx = t < committed.size() ? committed[t] : running;
+
+        map<int, vector<char> >::const_iterator it = tx.blocks.lower_bound(firstBlockId);
+        for (; it != tx.blocks.end() && it->first < firstBlockId + count; it++) {
+            memcpy(&data[static_cast<long>(it->first - firstBlockId) * BLOCK_SIZE], it->second.data(), BLOCK_SIZE);
+        }
+    }
+}
+
+void Journal::revoke(int firstBlockId, int count) {
+    lock_guard<mutex> guard(lock);
+    if (journaled == 0 && logged.empty()) return;
+
+    int end = firstBlockId + count;
+
+    for (size_t t = 0; t <= committed.size(); t++) {
+        Transaction& tx = t < committed.size() ? committed[t] : running;
+
+        map<int, vector<char> >::iterator first = tx.blocks.lower_bound(firstBlockId);
+        map<int, vector<char> >::iterator last = tx.blocks.lower_bound(end);
+
+        for (map<int, vector<char> >::iterator it = first; it != last; it++) journaled--;
+        tx.blocks.erase(first, last);
+    }
+
+    // images of the log must not be replayed over the new contents
+    set<int>::iterator it = logged.lower_bound(firstBlockId);
+    for (; it != logged.end() && *it < end; it++) running.revoked.insert(*it);
+}
+
+void Journal::visitRunning(function<void(int blockId, const char* data)> visit) {
+    lock_guard<mutex> guard(lock);
+
+    for (map<int, vector<char> >::iterator it = running.blocks.begin(); it != running.blocks.end(); it++) {
+        visit(it->first, it->second.data());
+    }
+}
+
+void Journal::commit() {
+    unique_lock<mutex> guard(lock);
+    if (!worker.joinable() || stopping) return;
+
+    long ticket = ++requested;
+    wake.notify_one();
+    done.wait(guard, [&] { return finished >= ticket || stopping; });
+}
+
+void Journal::work() {
+    unique_lock<mutex> guard(lock);
+
+    while (!stopping) {
+        int threshold = (blocksNumber - 1) / 4;
+        auto due = [&] {
+            return stopping || requested > finished || static_cast<int>(running.blocks.size()) >= threshold;
+        };
+
+        bool timer;
+        if (interval > 0) {
+            timer = !wake.wait_for(guard, chrono::milliseconds(interval), due);
+        } else {
+            wake.wait(guard, due);
+            timer = false;
+        }
+
+        if (stopping) break;
+
+        long ticket = requested;
+        bool pending = busy || ticket > finished || !running.blocks.empty();
+        guard.unlock();
+
+        bool committedAny = pending && commitRunning();
+
+        // the log is started over, when it fills up or nothing happens
+        bool idle = timer && !committedAny;
+        if (head > blocksNumber / 2 || (idle && head > 1)) {
+            checkpoint(INT_MAX);
+
+            guard.lock();
+            int sequence = running.sequence;
+            bool empty = committed.empty();
+            guard.unlock();
+
+            if (empty) restart(sequence);
+        }
+
+        guard.lock();
+        finished = max(finished, ticket);
+        done.notify_all();
+    }
+}
+
+bool Journal::commitRunning() {
+    vector<char> records;
+    int sequence;
+
+    // file data goes first, the sums of its blocks get into the transaction
+    cache->writeBack();
+
+    {
+        // no operation is in the middle, the transaction gets them whole
+        unique_lock<shared_mutex> operations(opLock);
+        if (collect) collect();
+
+        lock_guard<mutex> guard(lock);
+        busy = false;
+
+        if (running.blocks.empty() && running.revoked.empty()) return false;
+
+        vector<int> entries;
+        for (set<int>::iterator it = running.revoked.begin(); it != running.revoked.end(); it++) {
+            entries.push_back(-*it - 1);
+        }
+        for (map<int, vector<char> >::iterator it = running.blocks.begin(); it != running.blocks.end(); it++) {
+            entries.push_back(it->first);
+            logged.insert(it->first);
+        }
+
+        sequence = running.sequence;
+
+        // descriptors, every one is followed by the images of its entries
+        for (size_t i = 0; i < entries.size(); i += JOURNAL_ENTRIES) {
+            JournalRecord descriptor = JournalRecord();
+            descriptor.magic = JOURNAL_MAGIC;
+            descriptor.type = RECORD_DESCRIPTOR;
+            descriptor.sequence = sequence;
+            descriptor.count = min(JOURNAL_ENTRIES, static_cast<int>(entries.size() - i));
+
+            size_t offset = records.size();
+            records.resize(offset + BLOCK_SIZE, 0);
+
+            for (int j = 0; j < descriptor.count; j++) {
+                int entry = entries[i + j];
+                descriptor.entries[j] = entry;
+                if (entry < 0) continue;
+
+                const vector<char>& image = running.blocks[entry];
+                records.insert(records.end(), image.begin(), image.end());
+            }
+
+            memcpy(&records[offset], &descriptor, sizeof(JournalRecord));
+        }
+
+        committed.push_back(move(running));
+        running = Transaction();
+        running.sequence = sequence + 1;
+    }
+
+    // operations, that wait for space, may go on
+    done.notify_all();
+
+    int count = records.size() / BLOCK_SIZE + 1;
+
+    if (head + count > blocksNumber) {
+        // everything before the transaction goes home, it starts the log
+        checkpoint(sequence);
+        restart(sequence);
+    }
+
+    if (1 + count > blocksNumber) {
+        // the transaction can't be logged, it is written in place without atomicity
+        checkpoint(sequence + 1);
+        restart(sequence + 1);
+
+        if (commitDone) commitDone();
+        return true;
+    }
+
+    JournalRecord commitRecord = JournalRecord();
+    commitRecord.magic = JOURNAL_MAGIC;
+    commitRecord.type = RECORD_COMMIT;
+    commitRecord.sequence = sequence;
+    commitRecord.count = count - 1;
+    commitRecord.checksum = checksum(CHECKSUM_SEED, records.data(), records.size());
+
+    size_t offset = records.size();
+    records.resize(offset + BLOCK_SIZE, 0);
+    memcpy(&records[offset], &commitRecord, sizeof(JournalRecord));
+
+    // file data gets to the device with the log, by the same flush
+    writeLog(records);
+    cache->sync();
+
+    if (commitDone) commitDone();
+
+    FS_STAT_ADD(STAT_JOURNAL_COMMITS, 1);
+    FS_STAT_ADD(STAT_JOURNAL_BLOCKS, count);
+    return true;
+}
+
+void Journal::checkpoint(int untilSequence) {
+    bool written = false;
+
+    while (true) {
+        lock_guard<mutex> guard(lock);
+        if (committed.empty() || committed.front().sequence >= untilSequence) break;
+
+        Transaction& tx = committed.front();
+        if (tx.blocks.empty()) {
+            committed.pop_front();
+            continue;
+        }
+
+        writeHome(tx, CHECKPOINT_BATCH, untilSequence);
+        written = true;
+    }
+
+    if (written) cache->sync();
+}
+
+// the lock is held, blocks can't be revoked meanwhile
+void Journal::writeHome(Transaction& tx, int count, int untilSequence) {
+    vector<char> run;
+    int runStart = -1;
+
+    for (int i = 0; i < count && !tx.blocks.empty(); i++) {
+        map<int, vector<char> >::iterator it = tx.blocks.begin();
+        int blockId = it->first;
+
+        // a later transaction, that goes home before the log is started over, has a newer image
+        bool superseded = false;
+        for (size_t t = 1; t < committed.size() && committed[t].sequence < untilSequence && !superseded; t++) {
+            superseded = committed[t].blocks.count(blockId) > 0;
+        }
+
+        if (runStart != -1 && (superseded || runStart + static_cast<int>(run.size() / BLOCK_SIZE) != blockId)) {
+            cache->writeBlocks(runStart, run.size() / BLOCK_SIZE, run.data());
+            run.clear();
+            runStart = -1;
+        }
+
+        if (!superseded) {
+            if (runStart == -1) runStart = blockId;
+            run.insert(run.end(), it->second.begin(), it->second.end());
+        }
+
+        tx.blocks.erase(it);
+        journaled--;
+    }
+
+    if (runStart != -1) cache->writeBlocks(runStart, run.size() / BLOCK_SIZE, run.data());
+}
+
+void Journal::restart(int sequence) {
+    char block[BLOCK_SIZE] = {0};
+
+    JournalHeader header;
+    header.magic = JOURNAL_MAGIC;
+    header.blocksNumber = blocksNumber;
+    header.sequence = sequence;
+    memcpy(block, &header, sizeof(JournalHeader));
+
+    cache->writeBlocks(firstBlockId, 1, block);
+    cache->sync();
+
+    // only transactions, that aren't home yet, may be logged again
+    lock_guard<mutex> guard(lock);
+    head = 1;
+    logged.clear();
+
+    for (size_t t = 0; t < committed.size(); t++) {
+        const Transaction& tx = committed[t];
+        for (map<int, vector<char> >::const_iterator it = tx.blocks.begin(); it != tx.blocks.end(); it++) {
+            logged.insert(it->first);
+        }
+    }
+}
+
+void Journal::writeLog(const vector<char>& records) {
+    int count = records.size() / BLOCK_SIZE;
+    cache->writeBlocks(firstBlockId + head, count, records.data());
+
+    lock_guard<mutex> guard(lock);
+    head += count;
+}
+
+const vector<char>* Journal::latest(int blockId) const {
+    map<int, vector<char> >::const_iterator it = running.blocks.find(blockId);
+    if (it != running.blocks.end()) return &it->second;
+
+    for (size_t t = committed.size(); t > 0; t--) {
+        it = committed[t - 1].blocks.find(blockId);
+        if (it != committed[t - 1].blocks.end()) return &it->second;
+    }
+
+    return NULL;
+}
+
+}       // fs::namespace end
@@ -0,0 +1,153 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "blockcache.h"
+#include "fs.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+namespace fs {
+
+const int JOURNAL_MAGIC = 0x4a534653;           // "SFSJ"
+const int JOURNAL_MIN_BLOCKS = 64;
+const int JOURNAL_MAX_BLOCKS = 16384;           // 8 MB of log at most
+const int JOURNAL_RATIO = 64;                   // device blocks per journal block
+const int JOURNAL_ENTRIES = (BLOCK_SIZE - 4 * sizeof(int)) / sizeof(int);
+const int CHECKPOINT_BATCH = 64;                // blocks written home under the journal lock
+
+/**
+ * @brief The JournalHeader struct describes the log, it lives in the first
+ * journal block. Transactions are laid out from the next block on, the first
+ * one has the header sequence, every next one the following number
+ */
+struct JournalHeader {
+    int magic;                                  // JOURNAL_MAGIC
+    int blocksNumber;                           // journal blocks, the header included
+    int sequence;                               // transaction, that starts the log
+};
+
+/**
+ * @brief The JournalRecord struct is a descriptor or a commit block of a
+ * transaction. Descriptor entries are block ids, each is followed by its new
+ * image in the log, or revoked blocks as -(blockId + 1). The commit block
+ * closes the transaction, count is the number of its blocks before the
+ * commit and checksum covers them
+ */
+struct JournalRecord {
+    int magic;                                  // JOURNAL_MAGIC
+    int type;                                   // RECORD_DESCRIPTOR or RECORD_COMMIT
+    int sequence;
+    int count;                                  // entries of a descriptor, blocks of a commit
+    union {
+        int entries[JOURNAL_ENTRIES];
+        unsigned checksum;
+    };
+};
+
+static_assert(sizeof(JournalRecord) <= BLOCK_SIZE, "JournalRecord doesn't fit into its block");
+
+const int RECORD_DESCRIPTOR = 1;
+const int RECORD_COMMIT = 2;
+
+/**
+ * @brief The Journal class is a write-ahead log of metadata blocks. Operations
+ * put new block images into the running transaction, which is committed with
+ * all the operations, that got into it, by one sequential log write (group
+ * commit) every interval, on sync or when it grows large. File data is written
+ * before the commit (ordered mode). Committed images are read over the cache
+ * until the worker writes them to their places (checkpoint) and the log is
+ * started over. Blocks freed after they were logged are revoked, so recovery
+ * doesn't write stale images over their new contents
+ */
+class Journal {
+public:
+    Journal();
+    ~Journal();
+
+    // writes an empty log at [firstBlockId, firstBlockId + blocksNumber)
+    void format(BlockCache* cache, int firstBlockId, int blocksNumber);
+    // writes committed transactions of the log to their places, returns their number
+    int recover(BlockCache* cache, int firstBlockId, int blocksNumber);
+
+    // collect is called at every commit, while no operation runs, to put the
+    // blocks changed in memory into the transaction, commitDone - after the
+    // transaction is on the device; interval 0 commits every operation
+    void start(BlockCache* cache, int firstBlockId, int blocksNumber, int interval,
+               std::function<void()> collect, std::function<void()> commitDone);
+    void stop();                                // commits, checkpoints and joins the worker
+
+    // operations are put into transactions whole, calls may nest
+    void begin();
+    void end();
+
+    void write(int blockId, const char* data, int size = BLOCK_SIZE, int shift = 0);
+    void writeBlocks(int firstBlockId, int count, const char* data);
+    bool read(int blockId, char* data, int size = BLOCK_SIZE, int shift = 0);   // false, if not journaled
+    void overlay(int firstBlockId, int count, char* data);   // copies journaled images over blocks read
+    void revoke(int firstBlockId, int count);   // blocks are freed
+    // images of the running transaction, collect may look at them
+    void visitRunning(std::function<void(int blockId, const char* data)> visit);
+
+    void commit();                              // returns when the operations done are on the device
+
+private:
+    struct Transaction {
+        int sequence;
+        std::map<int, std::vector<char> > blocks;   // new images by block id
+        std::set<int> revoked;
+    };
+
+    void work();
+    bool commitRunning();                       // false, if there was nothing to commit
+    void checkpoint(int untilSequence);         // transactions before untilSequence
+    void restart(int sequence);                 // empty log starts with sequence
+    void writeLog(const std::vector<char>& records);
+    void writeHome(Transaction& tx, int count, int untilSequence);
+    const std::vector<char>* latest(int blockId) const;
+
+    BlockCache* cache;
+    int firstBlockId;
+    int blocksNumber;
+    int interval;                               // ms between commits
+    std::function<void()> collect;
+    std::function<void()> commitDone;
+
+    std::shared_mutex opLock;                   // shared by operations, exclusive to close a transaction
+    std::mutex lock;                            // guards the transactions
+    std::condition_variable wake;               // the worker has something to do
+    std::condition_variable done;               // a commit is over, transaction got smaller
+
+    Transaction running;
+    std::deque<Transaction> committed;          // oldest first, not written home yet
+    std::set<int> logged;                       // blocks in the log since it was started
+    std::atomic<int> journaled;                 // images in memory, reads skip the journal if 0
+    int head;                                   // next free log block
+    long requested;                             // commits asked for
+    long finished;                              // commits done
+    bool busy;                                  // operations ran since the last commit
+    bool stopping;
+    std::thread worker;
+};
+
+/**
+ * @brief The JournalHandle struct puts an operation into the running transaction
+ */
+struct JournalHandle {
+    explicit JournalHandle(Journal& journal) : journal(journal) { journal.begin(); }
+    ~JournalHandle() { journal.end(); }
+
+    Journal& journal;
+};
+
+}       // fs::namespace end
+
+#endif // JOURNAL_H
@@ -14,7 +14,7 @@ int main() {
     formatDevice(FILE_NAME);
     mount(FILE_NAME);
 
-    filestat(25);
+    filestat(ROOT_INODE_ID);
     mkdir("dir1");
     symlink("dir1", "symlink");
     mkdir("symlink/dir2");
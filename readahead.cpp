@@ -0,0 +1,135 @@
+#include "readahead.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace fs {
+
+Readahead::Readahead() : cache(NULL), maxWindow(0), stopping(false) {
+}
+
+Readahead::~Readahead() {
+    stop();
+}
+
+void Readahead::start(BlockCache* cache, int maxWindow, bool background) {
+    stop();
+
+    this->cache = cache;
+    this->maxWindow = max(maxWindow, 0);
+    stopping = false;
+
+    if (background && this->maxWindow > 0) worker = thread(&Readahead::work, this);
+}
+
+void Readahead::stop() {
+    {
+        lock_guard<mutex> guard(queueLock);
+        stopping = true;
+        queue.clear();
+    }
+    queueReady.notify_all();
+
+    if (worker.joinable()) worker.join();
+
+    lock_guard<mutex> guard(lock);
+    files.clear();
+}
+
+void Readahead::open(int inodeId) {
+    if (maxWindow == 0) return;
+
+    lock_guard<mutex> guard(lock);
+    files[inodeId];
+}
+
+void Readahead::close(int inodeId) {
+    lock_guard<mutex> guard(lock);
+    files.erase(inodeId);
+}
+
+void Readahead::advise(int inodeId, Advice advice) {
+    // willneed is a one-time prefetch, it doesn't change the access pattern
+    if (maxWindow == 0 || advice == ADVICE_WILLNEED) return;
+
+    lock_guard<mutex> guard(lock);
+    State& state = files[inodeId];
+    state.advice = advice;
+    state.window = 0;
+    state.aheadEnd = 0;
+}
+
+bool Readahead::onRead(int inodeId, int firstBlock, int lastBlock, int fileBlocks, int& from, int& to) {
+    if (maxWindow == 0) return false;
+
+    lock_guard<mutex> guard(lock);
+
+    // file may be read without open(), it is tracked from the first read until it is closed or freed
+    State& state = files[inodeId];
+
+    // reads, that aren't block aligned, start at the last block of the previous one
+    bool sequential = state.advice == ADVICE_SEQUENTIAL || firstBlock == state.nextBlock ||
+                      firstBlock + 1 == state.nextBlock;
+    state.nextBlock = lastBlock + 1;
+
+    if (state.advice == ADVICE_RANDOM || !sequential) {
+        state.window = 0;
+        state.aheadEnd = 0;
+        return false;
+    }
+
+    if (state.window == 0) {
+        state.window = state.advice == ADVICE_SEQUENTIAL ? maxWindow : min(READAHEAD_MIN_WINDOW, maxWindow);
+        from = lastBlock + 1;
+    } else {
+        // half of the window is still ahead of the reader
+        if (state.aheadEnd - lastBlock - 1 > state.window / 2) return false;
+
+        state.window = min(state.window * 2, maxWindow);
+        from = max(state.aheadEnd, lastBlock + 1);
+    }
+
+    to = min(from + state.window, fileBlocks);
+    if (from >= to) return false;
+
+    state.aheadEnd = to;
+    return true;
+}
+
+void Readahead::prefetch(int blockId, int count) {
+    if (cache == NULL || count <= 0) return;
+
+    if (!worker.joinable()) {
+        cache->prefetch(blockId, count);
+        return;
+    }
+
+    {
+        lock_guard<mutex> guard(queueLock);
+
+        // the worker is behind, readahead would only compete with the readers
+        if (stopping || static_cast<int>(queue.size()) >= READAHEAD_QUEUE) return;
+        queue.push_back(make_pair(blockId, count));
+    }
+    queueReady.notify_one();
+}
+
+void Readahead::work() {
+    while (true) {
+        pair<int, int> run;
+        {
+            unique_lock<mutex> guard(queueLock);
+            queueReady.wait(guard, [this] { return stopping || !queue.empty(); });
+
+            if (stopping) return;
+
+            run = queue.front();
+            queue.pop_front();
+        }
+
+        cache->prefetch(run.first, run.second);
+    }
+}
+
+}       // fs::namespace end
@@ -0,0 +1,70 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "blockcache.h"
+#include "fs.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace fs {
+
+const int READAHEAD_MIN_WINDOW = 8;             // blocks read ahead, when a stream is detected
+const int READAHEAD_QUEUE = 64;                 // pending prefetches, others are dropped
+
+/**
+ * @brief The Readahead class detects sequential reads of files and prefetches
+ * the blocks that follow into the block cache. Every file has a window, that
+ * starts at READAHEAD_MIN_WINDOW and doubles up to the maximum while reads stay
+ * sequential; a random read closes it. The next window is issued, when the
+ * reader has consumed half of the previous one. Prefetches are done by a
+ * worker thread or, without it, by the reader itself
+ */
+class Readahead {
+public:
+    Readahead();
+    ~Readahead();
+
+    void start(BlockCache* cache, int maxWindow, bool background);   // maxWindow 0 disables it
+    void stop();                                // drops pending prefetches and joins the worker
+
+    void open(int inodeId);
+    void close(int inodeId);                    // forgets the file state, the file is closed or freed
+    void advise(int inodeId, Advice advice);
+
+    // registers the read of file blocks [firstBlock, lastBlock], returns false
+    // if nothing has to be prefetched, else file blocks [from, to)
+    bool onRead(int inodeId, int firstBlock, int lastBlock, int fileBlocks, int& from, int& to);
+
+    void prefetch(int blockId, int count);      // device blocks, queued if there is a worker
+
+private:
+    struct State {
+        Advice advice = ADVICE_NORMAL;
+        int nextBlock = 0;                      // block a sequential read would start at
+        int window = 0;                         // blocks prefetched at once, 0 - no stream
+        int aheadEnd = 0;                       // first block, that isn't prefetched yet
+    };
+
+    void work();
+
+    BlockCache* cache;
+    int maxWindow;
+
+    std::mutex lock;                            // guards files
+    std::unordered_map<int, State> files;
+
+    std::mutex queueLock;
+    std::condition_variable queueReady;
+    std::deque<std::pair<int, int> > queue;     // runs of device blocks to prefetch
+    bool stopping;
+    std::thread worker;
+};
+
+}       // fs::namespace end
+
+#endif // READAHEAD_H
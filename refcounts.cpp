@@ -0,0 +1,108 @@
+#include "refcounts.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace fs {
+
+RefCounts::RefCounts() : tableBlockId(0), firstBlockId(0), blocksNumber(0), sharedNumber(0) {}
+
+bool RefCounts::load(BlockCache& cache, int tableBlockId, int firstBlockId, int blocksNumber) {
+    this->tableBlockId = tableBlockId;
+    this->firstBlockId = firstBlockId;
+    this->blocksNumber = blocksNumber;
+
+    int tableBlocks = (blocksNumber + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    counts.assign(static_cast<long>(tableBlocks) * BLOCK_SIZE, 0);
+    dirtyBlocks.assign(tableBlocks, false);
+
+    bool verified = true;
+    for (int b = 0; b < tableBlocks; b++) {
+        if (!cache.read(tableBlockId + b, reinterpret_cast<char*>(&counts[static_cast<long>(b) * BLOCK_SIZE]))) {
+            verified = false;
+        }
+    }
+
+    counts.resize(blocksNumber);
+    sharedNumber = blocksNumber - count(counts.begin(), counts.end(), 0);
+
+    return verified;
+}
+
+void RefCounts::flush(Journal& journal) {
+    char block[BLOCK_SIZE];
+
+    for (int b = 0; b < static_cast<int>(dirtyBlocks.size()); b++) {
+        if (!dirtyBlocks[b]) continue;
+
+        // bytes past the end of the device are kept zero
+        long first = static_cast<long>(b) * BLOCK_SIZE;
+        long size = min(static_cast<long>(BLOCK_SIZE), blocksNumber - first);
+
+        memset(block, 0, BLOCK_SIZE);
+        memcpy(block, &counts[first], size);
+
+        journal.write(tableBlockId + b, block);
+        dirtyBlocks[b] = false;
+    }
+}
+
+void RefCounts::clear() {
+    counts.clear();
+    dirtyBlocks.clear();
+    blocksNumber = 0;
+    sharedNumber = 0;
+}
+
+int RefCounts::shares(int blockId) const {
+    return counts[blockId - firstBlockId];
+}
+
+bool RefCounts::isShared(int firstBlockId, int count) const {
+    if (sharedNumber == 0) return false;
+
+    const unsigned char* first = &counts[firstBlockId - this->firstBlockId];
+    return find_if(first, first + count, [](unsigned char shares) { return shares != 0; }) != first + count;
+}
+
+bool RefCounts::canShare(int firstBlockId, int count) const {
+    const unsigned char* first = &counts[firstBlockId - this->firstBlockId];
+    return find(first, first + count, MAX_SHARES) == first + count;
+}
+
+void RefCounts::share(int firstBlockId, int count) {
+    for (int i = firstBlockId - this->firstBlockId; i < firstBlockId - this->firstBlockId + count; i++) {
+        if (counts[i]++ == 0) sharedNumber++;
+        markDirty(i);
+    }
+}
+
+bool RefCounts::drop(int blockId) {
+    int i = blockId - firstBlockId;
+    if (counts[i] == 0) return false;
+
+    if (--counts[i] == 0) sharedNumber--;
+    markDirty(i);
+    return true;
+}
+
+void RefCounts::setShares(int blockId, int shares) {
+    int i = blockId - firstBlockId;
+
+    sharedNumber += (shares != 0) - (counts[i] != 0);
+    counts[i] = shares;
+    markDirty(i);
+}
+
+long RefCounts::sharedBlocks() const {
+    return sharedNumber;
+}
+
+void RefCounts::markDirty(int index) {
+    dirtyBlocks[index / BLOCK_SIZE] = true;
+}
+
+}       // fs::namespace end
@@ -0,0 +1,49 @@
+#ifndef REFCOUNTS_H
+#define REFCOUNTS_H
+
+#include "blockcache.h"
+#include "journal.h"
+
+#include <vector>
+
+namespace fs {
+
+const int MAX_SHARES = 255;                     // owners of a block besides the first one
+
+/**
+ * @brief The RefCounts class keeps the device table of block shares in memory,
+ * the table is stored from block tableBlockId on, byte i tells how many files
+ * share block (firstBlockId + i) besides the first one. Blocks are shared by
+ * clones and snapshots, a shared block is freed, when its last owner drops it,
+ * and is copied, before one of them writes it
+ */
+class RefCounts {
+public:
+    RefCounts();
+
+    bool load(BlockCache& cache, int tableBlockId, int firstBlockId, int blocksNumber);   // false, if damaged
+    void flush(Journal& journal);               // writes dirty table blocks back
+    void clear();
+
+    int shares(int blockId) const;
+    bool isShared(int firstBlockId, int count) const;   // true, if any of the blocks is
+    bool canShare(int firstBlockId, int count) const;   // false, if one of them has MAX_SHARES
+    void share(int firstBlockId, int count);    // adds an owner to the blocks
+    bool drop(int blockId);                     // removes an owner, false if the block had one
+    void setShares(int blockId, int shares);
+    long sharedBlocks() const;                  // blocks with more than one owner
+
+private:
+    void markDirty(int index);
+
+    std::vector<unsigned char> counts;          // shares by block, from firstBlockId on
+    std::vector<bool> dirtyBlocks;              // table blocks changed since flush
+    int tableBlockId;                           // first block of the table
+    int firstBlockId;                           // block described by byte 0
+    int blocksNumber;
+    long sharedNumber;
+};
+
+}       // fs::namespace end
+
+#endif // REFCOUNTS_H
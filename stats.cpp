@@ -0,0 +1,187 @@
+#include "stats.h"
+#include "volume.h"
+
+#include <sstream>
+
+using namespace std;
+
+namespace fs {
+
+static const char* OP_NAMES[OPS_NUMBER] = {
+    "mount", "umount", "sync", "flush", "create", "open", "close", "read", "write", "truncate",
+    "link", "unlink", "mkdir", "rmdir", "symlink", "ls", "readdir", "clone", "snapshot", "cd", "lookup"
+};
+
+static const char* COUNTER_NAMES[COUNTERS_NUMBER] = {
+    "blocks_read", "blocks_written", "bitmap_probes", "dir_entries_scanned", "journal_commits",
+    "journal_blocks", "clusters_compressed", "clusters_raw", "blocks_verified", "checksum_errors",
+    "checksums_resealed"
+};
+
+#ifdef FS_ENABLE_STATS
+
+// log-linear buckets: values below SUB_BUCKETS are exact, every next power
+// of two is split into SUB_BUCKETS equal buckets
+const int SUB_BITS = 5;
+const int SUB_BUCKETS = 1 << SUB_BITS;
+const int MAX_EXPONENT = 40;                    // values from 2^41 ns (~36 min) on share the last bucket
+const int BUCKETS = SUB_BUCKETS * (MAX_EXPONENT - SUB_BITS + 2);
+
+/**
+ * @brief The Histogram struct counts latencies of an API call
+ */
+struct Histogram {
+    atomic<long> buckets[BUCKETS];
+    atomic<long> count;
+    atomic<long> total;
+    atomic<long> min;
+    atomic<long> max;
+};
+
+atomic<long> statCounters[COUNTERS_NUMBER];
+static Histogram histograms[OPS_NUMBER];
+
+static int bucketIndex(long ns) {
+    if (ns < SUB_BUCKETS) return ns < 0 ? 0 : static_cast<int>(ns);
+
+    int exponent = 63 - __builtin_clzl(ns);
+    if (exponent > MAX_EXPONENT) return BUCKETS - 1;
+
+    int sub = static_cast<int>(ns >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// the largest value, that falls into the bucket
+static long bucketValue(int index) {
+    if (index < SUB_BUCKETS) return index;
+
+    int exponent = index / SUB_BUCKETS + SUB_BITS - 1;
+    long width = 1L << (exponent - SUB_BITS);
+
+    return (SUB_BUCKETS + index % SUB_BUCKETS) * width + width - 1;
+}
+
+void recordLatency(StatOp op, long ns) {
+    Histogram& histogram = histograms[op];
+
+    histogram.buckets[bucketIndex(ns)].fetch_add(1, memory_order_relaxed);
+    histogram.count.fetch_add(1, memory_order_relaxed);
+    histogram.total.fetch_add(ns, memory_order_relaxed);
+
+    long min = histogram.min.load(memory_order_relaxed);
+    while ((min == 0 || ns < min) && !histogram.min.compare_exchange_weak(min, ns, memory_order_relaxed)) {}
+
+    long max = histogram.max.load(memory_order_relaxed);
+    while (ns > max && !histogram.max.compare_exchange_weak(max, ns, memory_order_relaxed)) {}
+}
+
+static long percentile(const vector<long>& buckets, long count, long max, double fraction) {
+    long rank = static_cast<long>(fraction * count + 0.5);
+    if (rank < 1) rank = 1;
+
+    long seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) return std::min(bucketValue(i), max);
+    }
+
+    return max;
+}
+
+static void snapshot(StatOp op, LatencyStats& latency) {
+    Histogram& histogram = histograms[op];
+
+    vector<long> buckets(BUCKETS);
+    long count = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        buckets[i] = histogram.buckets[i].load(memory_order_relaxed);
+        count += buckets[i];
+    }
+
+    latency.count = count;
+    latency.totalNs = histogram.total.load(memory_order_relaxed);
+    latency.minNs = histogram.min.load(memory_order_relaxed);
+    latency.maxNs = histogram.max.load(memory_order_relaxed);
+
+    if (count == 0) return;
+
+    latency.p50Ns = percentile(buckets, count, latency.maxNs, 0.5);
+    latency.p90Ns = percentile(buckets, count, latency.maxNs, 0.9);
+    latency.p99Ns = percentile(buckets, count, latency.maxNs, 0.99);
+    latency.p999Ns = percentile(buckets, count, latency.maxNs, 0.999);
+}
+
+#endif
+
+Stats stats() {
+    Stats result = Stats();
+    if (vol != NULL) result.cache = vol->cache.stats();
+
+#ifdef FS_ENABLE_STATS
+    result.enabled = true;
+
+    for (int op = 0; op < OPS_NUMBER; op++) snapshot(static_cast<StatOp>(op), result.ops[op]);
+    for (int i = 0; i < COUNTERS_NUMBER; i++) result.counters[i] = statCounters[i].load(memory_order_relaxed);
+#endif
+
+    return result;
+}
+
+void resetStats() {
+    if (vol != NULL) vol->cache.resetStats();
+
+#ifdef FS_ENABLE_STATS
+    for (int op = 0; op < OPS_NUMBER; op++) {
+        Histogram& histogram = histograms[op];
+
+        for (int i = 0; i < BUCKETS; i++) histogram.buckets[i].store(0, memory_order_relaxed);
+        histogram.count.store(0, memory_order_relaxed);
+        histogram.total.store(0, memory_order_relaxed);
+        histogram.min.store(0, memory_order_relaxed);
+        histogram.max.store(0, memory_order_relaxed);
+    }
+
+    for (int i = 0; i < COUNTERS_NUMBER; i++) statCounters[i].store(0, memory_order_relaxed);
+#endif
+}
+
+string statsJson() {
+    Stats snapshot = stats();
+    ostringstream out;
+
+    out << "{\"enabled\": " << (snapshot.enabled ? "true" : "false");
+
+    out << ", \"ops\": {";
+    for (int op = 0; op < OPS_NUMBER; op++) {
+        const LatencyStats& latency = snapshot.ops[op];
+
+        out << (op > 0 ? ", " : "") << "\"" << OP_NAMES[op] << "\": {";
+        out << "\"count\": " << latency.count;
+        out << ", \"mean_ns\": " << (latency.count > 0 ? latency.totalNs / latency.count : 0);
+        out << ", \"min_ns\": " << latency.minNs;
+        out << ", \"p50_ns\": " << latency.p50Ns;
+        out << ", \"p90_ns\": " << latency.p90Ns;
+        out << ", \"p99_ns\": " << latency.p99Ns;
+        out << ", \"p999_ns\": " << latency.p999Ns;
+        out << ", \"max_ns\": " << latency.maxNs << "}";
+    }
+    out << "}";
+
+    out << ", \"counters\": {";
+    for (int i = 0; i < COUNTERS_NUMBER; i++) {
+        out << (i > 0 ? ", " : "") << "\"" << COUNTER_NAMES[i] << "\": " << snapshot.counters[i];
+    }
+    out << "}";
+
+    const CacheStats& cache = snapshot.cache;
+    out << ", \"cache\": {\"hits\": " << cache.hits << ", \"misses\": " << cache.misses
+        << ", \"evictions\": " << cache.evictions << ", \"writebacks\": " << cache.writebacks
+        << ", \"device_reads\": " << cache.deviceReads << ", \"device_writes\": " << cache.deviceWrites
+        << ", \"prefetched\": " << cache.prefetched
+        << ", \"direct_accesses\": " << cache.directAccesses << "}";
+
+    out << "}";
+    return out.str();
+}
+
+}       // fs::namespace end
@@ -0,0 +1,46 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "fs.h"
+
+#include <atomic>
+#include <chrono>
+
+namespace fs {
+
+#ifdef FS_ENABLE_STATS
+
+extern std::atomic<long> statCounters[COUNTERS_NUMBER];
+
+void recordLatency(StatOp op, long ns);
+
+/**
+ * @brief The OpTimer struct records the latency of an API call, when it goes
+ * out of scope
+ */
+struct OpTimer {
+    explicit OpTimer(StatOp op) : op(op), start(std::chrono::steady_clock::now()) {}
+
+    ~OpTimer() {
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+        recordLatency(op, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    StatOp op;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define FS_STAT_OP(op) fs::OpTimer opTimer(op)
+#define FS_STAT_ADD(counter, value) fs::statCounters[counter].fetch_add(value, std::memory_order_relaxed)
+
+#else
+
+// nothing is recorded, the arguments aren't evaluated
+#define FS_STAT_OP(op) do {} while (0)
+#define FS_STAT_ADD(counter, value) do {} while (0)
+
+#endif
+
+}       // fs::namespace end
+
+#endif // STATS_H
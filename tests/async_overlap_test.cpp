@@ -0,0 +1,78 @@
+#include "fs.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+// async reads queued before an async write of the same blocks get whole data, old or new one
+int main() {
+    const char* image = "async_overlap_test.img";
+    const int FILE_SIZE = 1 << 20;
+    const int IO_SIZE = 64 << 10;
+    const int ROUNDS = 32;
+
+    remove(image);
+    FILE* file = fopen(image, "w");
+    if (file == NULL || ftruncate(fileno(file), 32L << 20) != 0) return 2;
+    fclose(file);
+
+    fs::MountOptions options;
+    options.useMmap = false;
+    options.cacheBlocks = 0;
+    if (!fs::mount(image, options)) return 2;
+
+    vector<char> oldData(FILE_SIZE, 'a');
+    vector<char> newData(FILE_SIZE, 'b');
+
+    int fileId = fs::create("/f");
+    fs::write(fileId, oldData.data(), FILE_SIZE, 0);
+    fs::sync();
+
+    // damaged blocks are reported to cout
+    ostringstream output;
+    streambuf* saved = cout.rdbuf(output.rdbuf());
+
+    int bad = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        const vector<char>& data = round % 2 == 0 ? newData : oldData;
+        vector<vector<char> > buffers(FILE_SIZE / IO_SIZE, vector<char>(IO_SIZE));
+
+        for (size_t i = 0; i < buffers.size(); i++) {
+            fs::readAsync(fileId, buffers[i].data(), IO_SIZE, i * IO_SIZE, [&bad](int result) {
+                if (result != IO_SIZE) bad++;
+            });
+        }
+        for (int shift = 0; shift < FILE_SIZE; shift += IO_SIZE) {
+            fs::writeAsync(fileId, &data[shift], IO_SIZE, shift, [&bad](int result) {
+                if (result != IO_SIZE) bad++;
+            });
+        }
+        while (fs::poll(true) > 0) {}
+
+        for (size_t i = 0; i < buffers.size(); i++) {
+            for (int j = 0; j < IO_SIZE; j++) {
+                if (buffers[i][j] != 'a' && buffers[i][j] != 'b') {
+                    bad++;
+                    break;
+                }
+            }
+        }
+    }
+
+    cout.rdbuf(saved);
+    fs::umount();
+    remove(image);
+
+    if (bad != 0 || output.str().find("damaged") != string::npos) {
+        cout << "Error: " << bad << " requests got bad data" << endl << output.str();
+        return 1;
+    }
+
+    cout << "async overlap: ok" << endl;
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "fs.h"
+#include "fsck.h"
+
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// file data overwritten after the last commit of a crash is reported, not resealed by reads,
+// fsck takes it as it is
+int main() {
+    const char* image = "checksum_crash_test.img";
+    const int FILE_SIZE = 16 * fs::BLOCK_SIZE;
+
+    remove(image);
+    FILE* file = fopen(image, "w");
+    if (file == NULL || ftruncate(fileno(file), 16L << 20) != 0) return 2;
+    fclose(file);
+
+    fs::MountOptions options;
+    options.useMmap = false;
+    options.cacheBlocks = 0;                    // file data goes to the device at once
+    options.journalInterval = 60000;            // nothing is committed by the interval
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!fs::mount(image, options)) _exit(2);
+
+        vector<char> oldData(FILE_SIZE, 'a');
+        int fileId = fs::create("/f");
+        fs::write(fileId, oldData.data(), FILE_SIZE, 0);
+        fs::sync();
+
+        // the blocks are overwritten in place, their new sums aren't committed
+        vector<char> newData(FILE_SIZE, 'b');
+        fs::write(fileId, newData.data(), FILE_SIZE, 0);
+        fs::flush(fileId);
+
+        _exit(0);                               // crash, no commit
+    }
+    waitpid(pid, NULL, 0);
+
+    if (!fs::mount(image, options)) {
+        cout << "Error: the device doesn't mount after the crash" << endl;
+        return 1;
+    }
+
+    vector<char> data(FILE_SIZE);
+    int fileId = fs::open("/f");
+    int bytesRead = fs::read(fileId, data.data(), FILE_SIZE, 0);
+    fs::umount();
+
+    if (bytesRead != -1) {
+        cout << "Error: blocks newer than their sums were read without an error" << endl;
+        return 1;
+    }
+
+    fs::FsckOptions fsckOptions;
+    fsckOptions.repair = true;
+    fs::FsckReport report = fs::fsck(image, fsckOptions);
+
+    if (report.errors == 0 || report.remaining != 0) {
+        cout << "Error: fsck found " << report.errors << " problems, left " << report.remaining << endl;
+        return 1;
+    }
+
+    fs::mount(image, options);
+    fileId = fs::open("/f");
+    bytesRead = fs::read(fileId, data.data(), FILE_SIZE, 0);
+    fs::umount();
+    remove(image);
+
+    if (bytesRead != FILE_SIZE) {
+        cout << "Error: the file isn't read after the repair" << endl;
+        return 1;
+    }
+
+    cout << "checksum crash: ok" << endl;
+    return 0;
+}
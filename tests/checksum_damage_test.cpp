@@ -0,0 +1,118 @@
+#include "fs.h"
+#include "fsck.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+// flips a byte of block blockId of the image
+static bool damage(const char* image, long blockId) {
+    FILE* file = fopen(image, "r+b");
+    if (file == NULL) return false;
+
+    unsigned char byte = 0;
+    fseek(file, blockId * fs::BLOCK_SIZE + 100, SEEK_SET);
+    bool done = fread(&byte, 1, 1, file) == 1;
+
+    byte ^= 0xff;
+    fseek(file, blockId * fs::BLOCK_SIZE + 100, SEEK_SET);
+    done = done && fwrite(&byte, 1, 1, file) == 1;
+
+    fclose(file);
+    return done;
+}
+
+// first block of the image filled with fill, -1 if there is none
+static long findBlock(const char* image, char fill) {
+    FILE* file = fopen(image, "rb");
+    if (file == NULL) return -1;
+
+    vector<char> block(fs::BLOCK_SIZE);
+    vector<char> pattern(fs::BLOCK_SIZE, fill);
+
+    for (long blockId = 0; fread(block.data(), 1, fs::BLOCK_SIZE, file) == fs::BLOCK_SIZE; blockId++) {
+        if (block == pattern) {
+            fclose(file);
+            return blockId;
+        }
+    }
+
+    fclose(file);
+    return -1;
+}
+
+// reads of a block, that doesn't match its checksum, fail; damaged metadata fails the mount
+static bool check(bool useMmap) {
+    const char* image = "checksum_damage_test.img";
+    const int FILE_SIZE = 16 * fs::BLOCK_SIZE;
+
+    remove(image);
+    FILE* file = fopen(image, "w");
+    if (file == NULL || ftruncate(fileno(file), 16L << 20) != 0) return false;
+    fclose(file);
+
+    fs::MountOptions options;
+    options.useMmap = useMmap;
+
+    if (!fs::mount(image, options)) return false;
+    vector<char> data(FILE_SIZE, 'Q');
+    int fileId = fs::create("/f");
+    fs::write(fileId, data.data(), FILE_SIZE, 0);
+    fs::umount();
+
+    long dataBlock = findBlock(image, 'Q');
+    if (dataBlock == -1 || !damage(image, dataBlock)) return false;
+
+    if (!fs::mount(image, options)) {
+        cout << "Error: damaged file data fails the mount" << endl;
+        return false;
+    }
+
+    fileId = fs::open("/f");
+    int bytesRead = fs::read(fileId, data.data(), FILE_SIZE, 0);
+    char* copy = fs::read(fileId, fs::BLOCK_SIZE, 0);
+
+    int asyncResult = 0;
+    fs::readAsync(fileId, data.data(), FILE_SIZE, 0, [&asyncResult](int result) { asyncResult = result; });
+    while (fs::poll(true) > 0) {}
+
+    fs::umount();
+
+    if (bytesRead != -1 || copy != NULL || asyncResult != -1) {
+        cout << "Error: a damaged block was read as data, mmap " << useMmap << endl;
+        delete[] copy;
+        return false;
+    }
+
+    // a damaged bitmask would give used blocks away
+    if (!damage(image, fs::BITMASK_BLOCK_ID)) return false;
+
+    if (fs::mount(image, options)) {
+        fs::umount();
+        cout << "Error: a device with a damaged bitmask was mounted, mmap " << useMmap << endl;
+        return false;
+    }
+
+    // fsck finds both blocks
+    fs::FsckReport report = fs::fsck(image);
+    remove(image);
+
+    if (report.errors < 2) {
+        cout << "Error: fsck found " << report.errors << " problems of 2 damaged blocks" << endl;
+        for (size_t i = 0; i < report.problems.size(); i++) cout << "    " << report.problems[i] << endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main() {
+    if (!check(true) || !check(false)) return 1;
+
+    cout << "checksum damage: ok" << endl;
+    return 0;
+}
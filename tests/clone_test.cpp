@@ -0,0 +1,89 @@
+#include "fs.h"
+#include "blockdevice.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static bool contentsAre(const char* name, const string& expected) {
+    vector<char> data(expected.size() + 1);
+    int fileId = fs::open(name);
+    int got = fs::read(fileId, data.data(), data.size());
+    fs::close(fileId);
+    return got == static_cast<int>(expected.size()) && !memcmp(data.data(), expected.data(), got);
+}
+
+// a clone must take no data blocks, a write to either file must copy only the blocks it touches and
+// leave the other file as it was; shared blocks must be freed by their last owner
+int main() {
+    fs::RamDevice device(4L << 20);
+    fs::mount(&device);
+    int baseFree = fs::statfs().freeBlocks;
+
+    string original;
+    for (int i = 0; i < 40 * fs::BLOCK_SIZE; i++) original += 'a' + (i / fs::BLOCK_SIZE) % 26;
+
+    int originalId = fs::create("/original");
+    fs::write(originalId, original.data(), original.size());
+    fs::sync();
+    int fileFree = fs::statfs().freeBlocks;
+
+    if (fs::clone("/original", "/copy") == -1) {
+        cout << "Error: the file wasn't cloned" << endl;
+        return 1;
+    }
+    fs::sync();
+
+    // the clone takes an inode and at most a block of its map
+    if (fileFree - fs::statfs().freeBlocks > 1) {
+        cout << "Error: the clone took " << fileFree - fs::statfs().freeBlocks << " blocks" << endl;
+        return 1;
+    }
+
+    string copy = original;
+    string patch(10, 'X');
+    int patchShift = 5 * fs::BLOCK_SIZE + 100;
+    int copyId = fs::open("/copy");
+    fs::write(copyId, patch.data(), patch.size(), patchShift);
+    fs::close(copyId);
+    copy.replace(patchShift, patch.size(), patch);
+    fs::umount();
+
+    fs::mount(&device);
+    if (!contentsAre("/original", original) || !contentsAre("/copy", copy)) {
+        cout << "Error: a write to the clone changed the original or was lost" << endl;
+        return 1;
+    }
+
+    // the original is written the other way round
+    originalId = fs::open("/original");
+    fs::write(originalId, "Y", 1, 0);
+    fs::close(originalId);
+    original[0] = 'Y';
+    if (!contentsAre("/original", original) || !contentsAre("/copy", copy)) {
+        cout << "Error: a write to the original changed the clone" << endl;
+        return 1;
+    }
+
+    fs::unlink("/original");
+    if (!contentsAre("/copy", copy)) {
+        cout << "Error: the clone lost its blocks with the original" << endl;
+        return 1;
+    }
+
+    fs::unlink("/copy");
+    fs::sync();
+    int leftFree = fs::statfs().freeBlocks;
+    fs::umount();
+
+    if (leftFree != baseFree) {
+        cout << "Error: " << baseFree - leftFree << " blocks are left after both files are removed" << endl;
+        return 1;
+    }
+
+    cout << "clone: ok" << endl;
+    return 0;
+}
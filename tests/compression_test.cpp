@@ -0,0 +1,122 @@
+#include "fs.h"
+#include "blockdevice.h"
+#include "compression.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// cluster contents of a kind: 0 - random, 1 - few letters, 2 - zeros, 3 - short period, 4 - repeats
+static void fill(vector<char>& data, int kind) {
+    for (size_t i = 0; i < data.size(); i++) {
+        if (kind == 0) data[i] = rand();
+        else if (kind == 1) data[i] = 'a' + rand() % 3;
+        else if (kind == 2) data[i] = 0;
+        else if (kind == 3) data[i] = (i / 7) % 13;
+        else data[i] = i > 20 && rand() % 4 ? data[i - 1 - rand() % 20] : rand();
+    }
+}
+
+// streams of the codec must give back what was compressed, damaged ones must be refused or decoded
+// without overruns; compressed files must read back the same after a remount and take fewer blocks
+int main() {
+    srand(1);
+
+    for (int t = 0; t < 2000; t++) {
+        int size = t % 50 == 0 ? fs::CLUSTER_SIZE : rand() % (fs::CLUSTER_SIZE + 1);
+        vector<char> data(size);
+        fill(data, t % 5);
+
+        vector<char> stream(size + 64);
+        int streamSize = fs::lzCompress(data.data(), size, stream.data(), stream.size());
+        if (streamSize == 0) {
+            if (t % 5 != 0 && size > 100) {
+                cout << "Error: " << size << " B of kind " << t % 5 << " weren't compressed" << endl;
+                return 1;
+            }
+            continue;
+        }
+
+        vector<char> decoded(size);
+        if (!fs::lzDecompress(stream.data(), streamSize, decoded.data(), size)
+                || memcmp(decoded.data(), data.data(), size)) {
+            cout << "Error: " << size << " B of kind " << t % 5 << " didn't round-trip" << endl;
+            return 1;
+        }
+
+        if (size > 0 && fs::lzDecompress(stream.data(), streamSize, decoded.data(), size - 1)) {
+            cout << "Error: a stream of " << size << " B was decoded into fewer bytes" << endl;
+            return 1;
+        }
+
+        stream[rand() % streamSize] ^= 1 << (rand() % 8);
+        fs::lzDecompress(stream.data(), streamSize, decoded.data(), size);
+    }
+
+    vector<char> stream(16);
+    vector<char> repeated(fs::CLUSTER_SIZE, 'x');
+    if (fs::lzCompress(repeated.data(), repeated.size(), stream.data(), stream.size()) != 0) {
+        cout << "Error: a stream was written past the capacity" << endl;
+        return 1;
+    }
+
+    fs::RamDevice device(8L << 20);
+    fs::mount(&device);
+
+    // clusters of every kind, the last one is partial
+    const int clusters = 5;
+    vector<char> contents(clusters * fs::CLUSTER_SIZE - 100);
+    for (int i = 0; i < clusters; i++) {
+        vector<char> cluster(fs::CLUSTER_SIZE);
+        fill(cluster, i);
+        int size = min(fs::CLUSTER_SIZE, static_cast<int>(contents.size()) - i * fs::CLUSTER_SIZE);
+        memcpy(&contents[i * fs::CLUSTER_SIZE], cluster.data(), size);
+    }
+
+    int rawId = fs::create("/raw");
+    int packedId = fs::create("/packed");
+    if (!fs::setCompression(packedId, true)) {
+        cout << "Error: an empty file wasn't made compressed" << endl;
+        return 1;
+    }
+
+    int freeBefore = fs::statfs().freeBlocks;
+    fs::write(rawId, contents.data(), contents.size());
+    fs::sync();
+    int rawBlocks = freeBefore - fs::statfs().freeBlocks;
+
+    freeBefore = fs::statfs().freeBlocks;
+    fs::write(packedId, contents.data(), contents.size());
+    fs::sync();
+    int packedBlocks = freeBefore - fs::statfs().freeBlocks;
+
+    // an overwrite across clusters recompresses both
+    string patch(3000, 'p');
+    int patchShift = fs::CLUSTER_SIZE - 1000;
+    fs::write(packedId, patch.data(), patch.size(), patchShift);
+    memcpy(&contents[patchShift], patch.data(), patch.size());
+    fs::umount();
+
+    fs::mount(&device);
+    vector<char> readBack(contents.size());
+    int got = fs::read(fs::open("/packed"), readBack.data(), readBack.size());
+    fs::umount();
+
+    if (got != static_cast<int>(contents.size()) || memcmp(readBack.data(), contents.data(), got)) {
+        cout << "Error: the compressed file reads back other data" << endl;
+        return 1;
+    }
+
+    if (packedBlocks >= rawBlocks) {
+        cout << "Error: the compressed file took " << packedBlocks << " blocks, the raw one "
+             << rawBlocks << endl;
+        return 1;
+    }
+
+    cout << "compression: ok" << endl;
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "fs.h"
+#include "blockdevice.h"
+
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+// id the path resolves to, the lookup is repeated, so the second one is served by the cache
+static int lookup(const char* path) {
+    int fileId = -1;
+    for (int i = 0; i < 2; i++) {
+        fileId = fs::open(path);
+        if (fileId != -1) fs::close(fileId);
+    }
+    return fileId;
+}
+
+static bool expect(const char* path, int expected, const char* change) {
+    int fileId = lookup(path);
+    if (fileId == expected) return true;
+
+    cout << "Error: after " << change << " " << path << " resolves to " << fileId << ", not " << expected << endl;
+    return false;
+}
+
+// cached names, negative ones and symlinks included, must follow every change of the dir records
+int main() {
+    fs::RamDevice device(4L << 20);
+    fs::mount(&device);
+
+    fs::mkdir("/d");
+    fs::mkdir("/e");
+    int fileId = fs::create("/d/file");
+    int otherId = fs::create("/e/moved");
+    fs::symlink(const_cast<char*>("/d"), "/s");
+
+    if (!expect("/d/file", fileId, "create") || !expect("/moved", -1, "create")
+            || !expect("/s/file", fileId, "symlink")) return 1;
+
+    // rename by a link and an unlink, hard links are made in the root
+    fs::link("/d/file", "moved");
+    fs::unlink("/d/file");
+    if (!expect("/d/file", -1, "unlink") || !expect("/s/file", -1, "unlink")
+            || !expect("/moved", fileId, "link")) return 1;
+
+    // a negative entry goes away with the create
+    int newId = fs::create("/d/file");
+    if (!expect("/d/file", newId, "a create over a missing name")) return 1;
+
+    // names behind a symlink follow the dir, a new symlink replaces a negative entry
+    if (!expect("/s/file", newId, "the create") || !expect("/t/moved", -1, "the create")) return 1;
+    fs::symlink(const_cast<char*>("e"), "/t");
+    if (!expect("/t/moved", otherId, "the symlink create")) return 1;
+
+    // the dir is removed and made again under the same name
+    fs::unlink("/d/file");
+    fs::rmdir("/d");
+    if (!expect("/d/file", -1, "rmdir")) return 1;
+    fs::mkdir("/d");
+    int againId = fs::create("/d/file");
+    if (!expect("/d/file", againId, "mkdir")) return 1;
+    fs::umount();
+
+    cout << "dentry cache: ok" << endl;
+    return 0;
+}
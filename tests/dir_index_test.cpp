@@ -0,0 +1,88 @@
+#include "fs.h"
+#include "blockdevice.h"
+#include "dirindex.h"
+#include "fsck.h"
+#include "volume.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// level of the index root of the dir, -1 if it has no index
+static int indexLevel(const char* dirName) {
+    fs::DirCursor cursor;
+    fs::opendir(dirName, cursor);
+
+    fs::Inode inode;
+    fs::readInode(cursor.dirId, &inode);
+    if (inode.indexRoot == 0) return -1;
+
+    fs::IndexNode root;
+    fs::readBlock(inode.indexRoot, reinterpret_cast<char*>(&root), sizeof(root));
+    return root.level;
+}
+
+// names of a large dir must be found by its index after the leaves and nodes split, records removed
+// must be gone from it and the rest must be found after a remount; fsck must find the index sound
+int main() {
+    fs::RamDevice device(8L << 20);
+    fs::MountOptions options;
+    options.dentryEntries = 0;                  // lookups go to the index every time
+
+    fs::mount(&device, options);
+    int filesNumber = min(3000, fs::statfs().freeInodes - 2);
+
+    fs::mkdir("/big");
+    vector<int> ids(filesNumber);
+    for (int i = 0; i < filesNumber; i++) {
+        ids[i] = fs::create(("/big/f" + to_string(i)).c_str());
+    }
+
+    // 62 entries a leaf: the root must have been split into nodes above the leaves
+    if (indexLevel("/big") < 1) {
+        cout << "Error: " << filesNumber << " records didn't split the index, level "
+             << indexLevel("/big") << endl;
+        return 1;
+    }
+
+    for (int i = 0; i < filesNumber; i += 3) {
+        fs::unlink(("/big/f" + to_string(i)).c_str());
+        ids[i] = -1;
+    }
+    fs::umount();
+
+    for (int pass = 0; pass < 2; pass++) {
+        fs::mount(&device, options);
+
+        for (int i = 0; i < filesNumber; i++) {
+            int fileId = fs::open(("/big/f" + to_string(i)).c_str());
+            if (fileId != ids[i]) {
+                cout << "Error: /big/f" << i << " was found as " << fileId << ", not " << ids[i] << endl;
+                return 1;
+            }
+            if (fileId != -1) fs::close(fileId);
+        }
+
+        // the names removed come back, a half of them is removed again
+        if (pass == 0) {
+            for (int i = 0; i < filesNumber; i += 3) ids[i] = fs::create(("/big/f" + to_string(i)).c_str());
+            for (int i = 0; i < filesNumber; i += 6) {
+                fs::unlink(("/big/f" + to_string(i)).c_str());
+                ids[i] = -1;
+            }
+        }
+        fs::umount();
+    }
+
+    fs::FsckReport report = fs::fsck(&device);
+    if (!report.checked || report.errors != 0) {
+        cout << "Error: fsck found " << report.errors << " problems in the indexed dir" << endl;
+        for (size_t i = 0; i < report.problems.size(); i++) cout << report.problems[i] << endl;
+        return 1;
+    }
+
+    cout << "dir index: ok" << endl;
+    return 0;
+}
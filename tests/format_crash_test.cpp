@@ -0,0 +1,56 @@
+#include "fs.h"
+#include "fsck.h"
+
+#include <cstdio>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// a device formatted by a process, that dies before the first commit, must mount with a sane root
+int main() {
+    const char* image = "format_crash_test.img";
+    const long capacity = 16L << 20;
+
+    remove(image);
+    FILE* file = fopen(image, "w");
+    if (file == NULL || ftruncate(fileno(file), capacity) != 0) return 2;
+    fclose(file);
+
+    fs::MountOptions options;
+    options.useMmap = false;
+    options.journalInterval = 60000;            // nothing is committed by the interval
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        fs::mount(image, options);
+        _exit(0);                               // crash, no umount
+    }
+    waitpid(pid, NULL, 0);
+
+    if (!fs::mount(image, options)) {
+        cout << "Error: the formatted device doesn't mount" << endl;
+        return 1;
+    }
+
+    int fileId = fs::create("/x");
+    fs::umount();
+
+    if (fileId == fs::ROOT_INODE_ID) {
+        cout << "Error: a new file got the inode of the root" << endl;
+        return 1;
+    }
+
+    fs::FsckReport report = fs::fsck(image);
+    remove(image);
+
+    if (!report.checked || report.errors != 0) {
+        cout << "Error: fsck found " << report.errors << " errors after the crash" << endl;
+        for (size_t i = 0; i < report.problems.size(); i++) cout << "    " << report.problems[i] << endl;
+        return 1;
+    }
+
+    cout << "format crash: ok" << endl;
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "fs.h"
+
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// blocks freed by a transaction, that doesn't get to the device, keep the data of their old file
+int main() {
+    const char* image = "freed_blocks_crash_test.img";
+    const int FILE_SIZE = 256 << 10;
+
+    remove(image);
+    FILE* file = fopen(image, "w");
+    if (file == NULL || ftruncate(fileno(file), 16L << 20) != 0) return 2;
+    fclose(file);
+
+    fs::MountOptions options;
+    options.useMmap = false;
+    options.cacheBlocks = 0;                    // file data goes to the device at once
+    options.journalInterval = 60000;            // nothing is committed by the interval
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!fs::mount(image, options)) _exit(2);
+
+        vector<char> oldData(FILE_SIZE, 'a');
+        int oldId = fs::create("/old");
+        fs::write(oldId, oldData.data(), FILE_SIZE, 0);
+
+        // the rest of the device is taken, new data may only get the blocks of the old file
+        int fillId = fs::create("/fill");
+        vector<char> fillData(static_cast<long>(fs::statfs().freeBlocks - 64) * fs::BLOCK_SIZE, 'c');
+        fs::write(fillId, fillData.data(), fillData.size(), 0);
+        fs::sync();
+
+        // the unlink stays in the running transaction, the new data is written
+        fs::unlink("/old");
+
+        vector<char> newData(FILE_SIZE, 'b');
+        int newId = fs::create("/new");
+        int bytesWritten = fs::write(newId, newData.data(), FILE_SIZE, 0);
+        fs::flush(newId);
+
+        _exit(bytesWritten == FILE_SIZE ? 0 : 1);   // crash, no commit
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cout << "Error: the blocks of the unlinked file weren't taken by the new one" << endl;
+        return 1;
+    }
+
+    if (!fs::mount(image, options)) {
+        cout << "Error: the device doesn't mount after the crash" << endl;
+        return 1;
+    }
+
+    // the write may commit the unlink to get the blocks, then the old file is gone
+    int oldId = fs::open("/old");
+    vector<char> data(FILE_SIZE, 'a');
+    int bytesRead = oldId == -1 ? FILE_SIZE : fs::read(oldId, data.data(), FILE_SIZE, 0);
+    fs::umount();
+    remove(image);
+
+    if (bytesRead != FILE_SIZE) {
+        cout << "Error: the file of the last commit is cut" << endl;
+        return 1;
+    }
+
+    for (int i = 0; i < FILE_SIZE; i++) {
+        if (data[i] != 'a') {
+            cout << "Error: the file of the last commit got other data at " << i << endl;
+            return 1;
+        }
+    }
+
+    cout << "freed blocks crash: ok" << endl;
+    return 0;
+}
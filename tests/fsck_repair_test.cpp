@@ -0,0 +1,99 @@
+#include "fs.h"
+#include "blockdevice.h"
+#include "fsck.h"
+#include "journal.h"
+#include "volume.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// problems made on purpose: a block of a file marked free, a free block marked used, a wrong link
+// count and an inode without records; fsck must find them all without changing the device, the
+// repair must fix them and the files must read back the same after it
+int main() {
+    fs::RamDevice device(4L << 20);
+    fs::mount(&device);
+    int baseFree = fs::statfs().freeBlocks;
+
+    fs::mkdir("/dir");
+    int fileId = fs::create("/dir/file");
+    string contents(4 * fs::BLOCK_SIZE, 'f');
+    fs::write(fileId, contents.data(), contents.size());
+    int linkedId = fs::create("/linked");
+    fs::sync();
+    int usedFree = fs::statfs().freeBlocks;
+
+    {
+        fs::JournalHandle handle(fs::vol->journal);
+
+        fs::Inode inode;
+        fs::readInode(fileId, &inode);
+        fs::setBlockUnused(inode.extents[0].physical + 1);
+
+        int leakedBlock = 0;
+        for (int i = inode.extents[0].physical + inode.extents[0].length; leakedBlock == 0; i++) {
+            if (!fs::isBlockUsed(i)) leakedBlock = i;
+        }
+        fs::setBlockUsed(leakedBlock);
+
+        fs::readInode(linkedId, &inode);
+        inode.links = 3;
+        fs::writeInode(linkedId, &inode);
+
+        int orphanId = fs::allocateInode();
+        memset(&inode, 0, sizeof(inode));
+        inode.links = 1;
+        fs::writeInode(orphanId, &inode);
+    }
+    fs::umount();
+
+    fs::FsckReport report = fs::fsck(&device);
+    fs::FsckReport again = fs::fsck(&device);
+    if (!report.checked || report.errors != 4 || again.errors != report.errors) {
+        cout << "Error: fsck found " << report.errors << " and then " << again.errors << " of 4 problems" << endl;
+        for (size_t i = 0; i < report.problems.size(); i++) cout << report.problems[i] << endl;
+        return 1;
+    }
+
+    fs::FsckOptions options;
+    options.repair = true;
+    report = fs::fsck(&device, options);
+    again = fs::fsck(&device);
+    if (report.errors != 4 || report.remaining != 0 || again.errors != 0) {
+        cout << "Error: the repair left " << report.remaining << " problems, a check after it found "
+             << again.errors << endl;
+        for (size_t i = 0; i < again.problems.size(); i++) cout << again.problems[i] << endl;
+        return 1;
+    }
+
+    fs::mount(&device);
+    vector<char> data(contents.size() + 1);
+    fileId = fs::open("/dir/file");
+    int got = fs::read(fileId, data.data(), data.size());
+    fs::close(fileId);
+    int repairedFree = fs::statfs().freeBlocks;
+
+    fs::unlink("/dir/file");
+    fs::unlink("/linked");
+    fs::rmdir("/dir");
+    fs::sync();
+    int leftFree = fs::statfs().freeBlocks;
+    fs::umount();
+
+    if (got != static_cast<int>(contents.size()) || string(data.data(), got) != contents) {
+        cout << "Error: the repaired file reads back other data" << endl;
+        return 1;
+    }
+
+    if (repairedFree != usedFree || leftFree != baseFree) {
+        cout << "Error: the repaired bitmask counts " << usedFree - repairedFree << " blocks more" << endl;
+        return 1;
+    }
+
+    cout << "fsck repair: ok" << endl;
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include "fs.h"
+#include "blockdevice.h"
+#include "fsck.h"
+#include "volume.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static bool contentsAre(int fileId, const string& expected) {
+    vector<char> data(expected.size() + fs::BLOCK_SIZE);
+    int got = fs::read(fileId, data.data(), data.size());
+    return got == static_cast<int>(expected.size()) && !memcmp(data.data(), expected.data(), got);
+}
+
+static int depthOf(int fileId) {
+    fs::Inode inode;
+    fs::readInode(fileId, &inode);
+    return inode.depth;
+}
+
+// a file must stay in its inode up to INLINE_SIZE bytes and take no block, the first byte past it must
+// move the contents to a block; the data must survive the move, a remount and a truncate back
+int main() {
+    fs::RamDevice device(4L << 20);
+    fs::mount(&device);
+    int baseFree = fs::statfs().freeBlocks;
+
+    int fileId = fs::create("/file");
+    string contents(fs::INLINE_SIZE, 'i');
+    fs::write(fileId, contents.data(), contents.size());
+    fs::sync();
+
+    if (depthOf(fileId) != fs::INLINE_DEPTH || fs::statfs().freeBlocks != baseFree) {
+        cout << "Error: " << fs::INLINE_SIZE << " B weren't kept in the inode" << endl;
+        return 1;
+    }
+
+    fs::write(fileId, "e", 1, fs::INLINE_SIZE);
+    contents += 'e';
+    fs::sync();
+
+    if (depthOf(fileId) != 0 || fs::statfs().freeBlocks != baseFree - 1 || !contentsAre(fileId, contents)) {
+        cout << "Error: " << fs::INLINE_SIZE + 1 << " B weren't moved to a block" << endl;
+        return 1;
+    }
+
+    // a write past the end of an inline file leaves zeros before it
+    int sparseId = fs::create("/sparse");
+    fs::write(sparseId, "ab", 2);
+    fs::write(sparseId, "z", 1, 3 * fs::BLOCK_SIZE);
+    string sparse = "ab" + string(3 * fs::BLOCK_SIZE - 2, '\0') + "z";
+
+    // symlinks with long targets go to a block too
+    fs::mkdir("/dir");
+    int targetId = fs::create("/dir/target");
+    string longTarget = "dir";
+    while (static_cast<int>(longTarget.size()) <= fs::INLINE_SIZE) longTarget += "/.";
+    fs::symlink(const_cast<char*>("dir"), "/short");
+    fs::symlink(const_cast<char*>(longTarget.c_str()), "/long");
+    fs::umount();
+
+    fs::mount(&device);
+    if (!contentsAre(fs::open("/file"), contents) || !contentsAre(fs::open("/sparse"), sparse)) {
+        cout << "Error: the converted files read back other data" << endl;
+        return 1;
+    }
+
+    if (fs::open("/short/target") != targetId || fs::open("/long/target") != targetId) {
+        cout << "Error: symlinks don't resolve after a remount" << endl;
+        return 1;
+    }
+
+    fs::truncate(fs::open("/file"), 10);
+    if (!contentsAre(fs::open("/file"), contents.substr(0, 10))) {
+        cout << "Error: the truncated file reads back other data" << endl;
+        return 1;
+    }
+    fs::umount();
+
+    fs::FsckReport report = fs::fsck(&device);
+    if (!report.checked || report.errors != 0) {
+        cout << "Error: fsck found " << report.errors << " problems in inline files" << endl;
+        for (size_t i = 0; i < report.problems.size(); i++) cout << report.problems[i] << endl;
+        return 1;
+    }
+
+    cout << "inline data: ok" << endl;
+    return 0;
+}
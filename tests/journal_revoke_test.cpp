@@ -0,0 +1,107 @@
+#include "fs.h"
+#include "fsck.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// blocks of a dir, that are in the log and are freed, may become file data; replay of the log after
+// a crash must skip their old images, the revoke of a later transaction tells it so
+int main() {
+    const char* image = "journal_revoke_test.img";
+    const int FILES_NUMBER = 200;
+
+    remove(image);
+    FILE* file = fopen(image, "w");
+    if (file == NULL || ftruncate(fileno(file), 16L << 20) != 0) return 2;
+    fclose(file);
+
+    fs::MountOptions options;
+    options.useMmap = false;
+    options.cacheBlocks = 0;                    // file data goes to the device at once
+    options.journalInterval = 60000;            // the log is only committed by sync, never checkpointed
+
+    int dataSize = 0;
+    int pipeIds[2];
+    if (pipe(pipeIds) != 0) return 2;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!fs::mount(image, options)) _exit(2);
+
+        int fillId = fs::create("/fill");
+        vector<char> fillData(static_cast<long>(fs::statfs().freeBlocks - 64) * fs::BLOCK_SIZE, 'c');
+        fs::write(fillId, fillData.data(), fillData.size(), 0);
+        fs::sync();
+
+        // the dir takes blocks of records and of its index, they are logged by the commit
+        fs::mkdir("/d");
+        for (int i = 0; i < FILES_NUMBER; i++) fs::create(("/d/f" + to_string(i)).c_str());
+        fs::sync();
+
+        for (int i = 0; i < FILES_NUMBER; i++) fs::unlink(("/d/f" + to_string(i)).c_str());
+        fs::rmdir("/d");
+        fs::sync();
+
+        // the data can only fit, if it takes the blocks of the dir
+        int size = (fs::statfs().freeBlocks - 4) * fs::BLOCK_SIZE;
+        vector<char> data(size, 'x');
+        int dataId = fs::create("/data");
+        int bytesWritten = fs::write(dataId, data.data(), size, 0);
+        fs::sync();
+
+        if (write(pipeIds[1], &size, sizeof(size)) != sizeof(size)) _exit(2);
+        _exit(bytesWritten == size ? 0 : 1);    // crash, the log isn't written home
+    }
+
+    close(pipeIds[1]);
+    if (read(pipeIds[0], &dataSize, sizeof(dataSize)) != sizeof(dataSize)) dataSize = 0;
+    close(pipeIds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || dataSize <= 0) {
+        cout << "Error: the file didn't take the blocks of the removed dir" << endl;
+        return 1;
+    }
+
+    if (!fs::mount(image, options)) {
+        cout << "Error: the device doesn't mount after the crash" << endl;
+        return 1;
+    }
+
+    vector<char> data(dataSize);
+    int dataId = fs::open("/data");
+    int bytesRead = dataId == -1 ? -1 : fs::read(dataId, data.data(), dataSize, 0);
+    fs::umount();
+
+    if (bytesRead != dataSize) {
+        cout << "Error: the file read " << bytesRead << " B of " << dataSize << " after the crash" << endl;
+        return 1;
+    }
+
+    for (int i = 0; i < dataSize; i++) {
+        if (data[i] != 'x') {
+            cout << "Error: an image of the removed dir was replayed over the file at " << i << endl;
+            return 1;
+        }
+    }
+
+    fs::FsckReport report = fs::fsck(image);
+    remove(image);
+
+    if (!report.checked || report.errors != 0) {
+        cout << "Error: fsck found " << report.errors << " problems after the replay" << endl;
+        for (size_t i = 0; i < report.problems.size(); i++) cout << report.problems[i] << endl;
+        return 1;
+    }
+
+    cout << "journal revoke: ok" << endl;
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "fs.h"
+#include "blockdevice.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// contents of the file, "-" if there is no such file
+static string contentsOf(const char* name) {
+    int fileId = fs::open(name);
+    if (fileId == -1) return "-";
+
+    vector<char> data(4 * fs::BLOCK_SIZE);
+    int got = fs::read(fileId, data.data(), data.size());
+    fs::close(fileId);
+    return got < 0 ? "-" : string(data.data(), got);
+}
+
+// a snapshot must keep the tree as it was, while the originals are written, removed and added to;
+// its objects can't be changed, and its removal must give back every block, it doesn't share
+int main() {
+    fs::RamDevice device(4L << 20);
+    fs::mount(&device);
+    int baseFree = fs::statfs().freeBlocks;
+
+    fs::mkdir("/dir");
+    int fileId = fs::create("/dir/file");
+    string before(3 * fs::BLOCK_SIZE, 'o');
+    fs::write(fileId, before.data(), before.size());
+    int goneId = fs::create("/dir/gone");
+    fs::write(goneId, "gone", 4);
+
+    if (!fs::snapshot("/snap")) {
+        cout << "Error: the snapshot wasn't made" << endl;
+        return 1;
+    }
+
+    string after = before;
+    after.replace(fs::BLOCK_SIZE, 5, "NEWER");
+    fs::write(fileId, "NEWER", 5, fs::BLOCK_SIZE);
+    fs::unlink("/dir/gone");
+    fs::create("/dir/added");
+    fs::umount();
+
+    fs::mount(&device);
+    if (contentsOf("/dir/file") != after || contentsOf("/snap/dir/file") != before) {
+        cout << "Error: a write to the original got into the snapshot" << endl;
+        return 1;
+    }
+
+    if (contentsOf("/dir/gone") != "-" || contentsOf("/snap/dir/gone") != "gone"
+            || contentsOf("/snap/dir/added") != "-") {
+        cout << "Error: records of the original dir changed the snapshot" << endl;
+        return 1;
+    }
+
+    if (fs::snapshot("/snap2") && contentsOf("/snap2/snap/dir/file") != "-") {
+        cout << "Error: a snapshot was copied into another one" << endl;
+        return 1;
+    }
+    fs::removeSnapshot("/snap2");
+
+    // objects of the snapshot are read-only
+    int copyId = fs::open("/snap/dir/file");
+    fs::write(copyId, "X", 1, 0);
+    fs::close(copyId);
+    fs::create("/snap/dir/new");
+    fs::unlink("/snap/dir/gone");
+    if (contentsOf("/snap/dir/file") != before || contentsOf("/snap/dir/new") != "-"
+            || contentsOf("/snap/dir/gone") != "gone") {
+        cout << "Error: the snapshot was changed" << endl;
+        return 1;
+    }
+
+    if (!fs::removeSnapshot("/snap") || contentsOf("/snap/dir/file") != "-"
+            || contentsOf("/dir/file") != after) {
+        cout << "Error: the snapshot wasn't removed apart from the originals" << endl;
+        return 1;
+    }
+
+    fs::unlink("/dir/file");
+    fs::unlink("/dir/added");
+    fs::rmdir("/dir");
+    fs::sync();
+    int leftFree = fs::statfs().freeBlocks;
+    fs::umount();
+
+    if (leftFree != baseFree) {
+        cout << "Error: " << baseFree - leftFree << " blocks are left after the snapshot is removed" << endl;
+        return 1;
+    }
+
+    cout << "snapshot: ok" << endl;
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "fs.h"
+#include "blockdevice.h"
+
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+// a device of another format version must be refused and left as it is, not formatted over
+int main() {
+    fs::RamDevice device(4L << 20);
+
+    fs::mount(&device);
+    int fileId = fs::create("/keep");
+    fs::umount();
+
+    fs::Superblock super;
+    char block[fs::BLOCK_SIZE];
+    device.read(fs::SUPERBLOCK_ID * fs::BLOCK_SIZE, block, fs::BLOCK_SIZE);
+    memcpy(&super, block, sizeof(super));
+
+    super.version = fs::FS_VERSION - 1;
+    memcpy(block, &super, sizeof(super));
+    device.write(fs::SUPERBLOCK_ID * fs::BLOCK_SIZE, block, fs::BLOCK_SIZE);
+
+    if (fs::mount(&device)) {
+        fs::umount();
+        cout << "Error: a device of version " << super.version << " was mounted" << endl;
+        return 1;
+    }
+
+    super.version = fs::FS_VERSION;
+    memcpy(block, &super, sizeof(super));
+    device.write(fs::SUPERBLOCK_ID * fs::BLOCK_SIZE, block, fs::BLOCK_SIZE);
+
+    if (!fs::mount(&device)) {
+        cout << "Error: the device doesn't mount after its version is restored" << endl;
+        return 1;
+    }
+
+    int openedId = fs::open("/keep");
+    fs::umount();
+
+    if (openedId != fileId) {
+        cout << "Error: the refused device lost its files" << endl;
+        return 1;
+    }
+
+    cout << "superblock version: ok" << endl;
+    return 0;
+}
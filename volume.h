@@ -0,0 +1,126 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "bitmap.h"
+#include "blockcache.h"
+#include "blockdevice.h"
+#include "checksums.h"
+#include "dentrycache.h"
+#include "inodetable.h"
+#include "ioengine.h"
+#include "journal.h"
+#include "readahead.h"
+#include "refcounts.h"
+#include "writebuffer.h"
+
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+
+namespace fs {
+
+const int INODE_LOCK_STRIPES = 256;             // inode locks are shared by id modulo this
+
+/**
+ * @brief The Volume struct keeps the whole state of a mounted device.
+ * Lock order: the journal handle, inode locks (by stripe index), then allocatorLock,
+ * descriptorsLock and wdLock; the caches, the inode table and the engine lock themselves
+ */
+struct Volume {
+    BlockDevice* device;                        // mounted device
+    std::unique_ptr<BlockDevice> ownedDevice;   // device opened by mount() itself
+    BlockCache cache;                           // cache of the device blocks
+    DentryCache dentries;                       // cache of the name lookups
+    Readahead readahead;                        // prefetcher of sequentially read files
+    IoEngine engine;                            // transfers of async requests
+    WriteBuffer writeBuffer;                    // file data, that has no blocks yet
+    Journal journal;                            // metadata blocks on their way to the device
+
+    Superblock superblock;                      // as it was found on mount, clean flag included
+    long device_capacity;
+    int bitmask_blocks;                         // number of blocks, which bitmask occupies
+    int data_blocks;                            // number of blocks on the device
+    int inode_blocks;                           // number of blocks, which inode table occupies
+    int inodes_number;                          // size of the inode table
+    int root_inode_id;                          // root fd
+
+    Bitmap bitmap;                              // in-memory copy of the bitmask
+    std::mutex allocatorLock;                   // guards bitmap and reservedBlocks
+    int reservedBlocks;                         // free blocks promised to the buffered data
+    RefCounts refCounts;                        // shares of the blocks, guarded by allocatorLock too
+    bool compression;                           // new files are compressed
+    Checksums checksums;                        // sums of the blocks, locks itself
+    InodeTable inodes;                          // in-memory copy of the inode table
+
+    std::set<int> openedDescriptors;            // list of opened descriptors
+    std::mutex descriptorsLock;
+
+    std::string wd;                             // current work dir
+    std::mutex wdLock;
+
+    std::shared_mutex inodeLocks[INODE_LOCK_STRIPES];
+
+    std::shared_mutex& inodeLock(int inodeId) {
+        return inodeLocks[static_cast<unsigned>(inodeId) % INODE_LOCK_STRIPES];
+    }
+};
+
+/**
+ * @brief The InodesLock struct exclusively locks two inodes without deadlocks
+ */
+struct InodesLock {
+    InodesLock(Volume* vol, int firstId, int secondId);
+    ~InodesLock();
+
+    std::shared_mutex* first;
+    std::shared_mutex* second;                  // NULL, if both inodes share a stripe
+};
+
+/**
+ * @brief The AllInodesLock struct exclusively locks all the inodes, no operation
+ * runs on the volume meanwhile
+ */
+struct AllInodesLock {
+    explicit AllInodesLock(Volume* vol);
+    ~AllInodesLock();
+
+    Volume* vol;
+};
+
+extern Volume* vol;                             // currently mounted volume
+
+// block level helpers, shared by the fs modules
+// false, if the block doesn't match its checksum, data is zeroed
+bool readBlock(int block_id, char* data, int size = BLOCK_SIZE, int shift = 0);
+// metadata writes go to the journal, file data is written with vol->cache
+void writeBlock(int block_id, const char* data, int size = BLOCK_SIZE, int shift = 0);
+void clearBlock(int blockId, int size = BLOCK_SIZE, int shift = 0);
+int allocateBlock();
+// reserved - the blocks were reserved by the caller with reserveBlocks()
+int allocateRun(int wanted, int goal, int& length, bool reserved = false);
+bool reserveBlocks(int count);
+void unreserveBlocks(int count);
+void freeRun(int blockId, int length);
+void readInode(int inodeId, Inode* inode);
+void writeInode(int inodeId, const Inode* inode);
+int allocateInode();
+void freeInode(int inodeId);
+bool isBlockUsed(int block_id);
+void setBlockUsed(int block_id);
+void setBlockUnused(int block_id);
+int divCeil(int a, int b);
+int divFloor(int a, int b);
+
+// file contents by the block map, whole blocks are queued to the engine, if there is a request;
+// false, if some blocks are damaged
+bool readExtents(const Extent* extents, int extentsNumber, char* buff, int size, int shift,
+                 AsyncRequest* request = NULL);
+bool writeData(int inodeId, int size, const char* data, int shift = 0, AsyncRequest* request = NULL);
+void truncateData(int inodeId, int newSize);
+Link* getLinks(int dirId, int& linksNumber);  // records of the dir, delete[] them
+
+}       // fs::namespace end
+
+#endif // VOLUME_H
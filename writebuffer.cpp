@@ -0,0 +1,134 @@
+#include "writebuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace fs {
+
+WriteBuffer::WriteBuffer() : capacity(0), blocksNumber(0) {}
+
+void WriteBuffer::setCapacity(int capacity) {
+    lock_guard<mutex> guard(lock);
+    this->capacity = max(capacity, 0);
+}
+
+bool WriteBuffer::isFull() {
+    lock_guard<mutex> guard(lock);
+    return blocksNumber > capacity;
+}
+
+bool WriteBuffer::fits(int blocks) {
+    lock_guard<mutex> guard(lock);
+    return blocks <= capacity;
+}
+
+bool WriteBuffer::contains(int inodeId) {
+    lock_guard<mutex> guard(lock);
+    return buffers.find(inodeId) != buffers.end();
+}
+
+bool WriteBuffer::contains(int inodeId, int logical) {
+    lock_guard<mutex> guard(lock);
+
+    unordered_map<int, Blocks>::iterator found = buffers.find(inodeId);
+    return found != buffers.end() && found->second.find(logical) != found->second.end();
+}
+
+void WriteBuffer::put(int inodeId, int logical, const char* data, bool reserved) {
+    lock_guard<mutex> guard(lock);
+
+    Blocks& blocks = buffers[inodeId];
+    if (blocks.find(logical) == blocks.end()) blocksNumber++;
+
+    Block& block = blocks[logical];
+    block.reserved = reserved;
+    memcpy(block.data, data, BLOCK_SIZE);
+}
+
+void WriteBuffer::update(int inodeId, int logical, const char* data, int size, int shift) {
+    lock_guard<mutex> guard(lock);
+    memcpy(&buffers[inodeId][logical].data[shift], data, size);
+}
+
+void WriteBuffer::overlay(int inodeId, char* buff, int size, int shift) {
+    if (size <= 0) return;
+
+    lock_guard<mutex> guard(lock);
+
+    unordered_map<int, Blocks>::iterator found = buffers.find(inodeId);
+    if (found == buffers.end()) return;
+
+    int lastBlock = (shift + size - 1) / BLOCK_SIZE;
+    Blocks::iterator it = found->second.lower_bound(shift / BLOCK_SIZE);
+
+    for (; it != found->second.end() && it->first <= lastBlock; it++) {
+        // intersection of the block and the range, in file bytes
+        long from = max(static_cast<long>(it->first) * BLOCK_SIZE, static_cast<long>(shift));
+        long to = min(static_cast<long>(it->first + 1) * BLOCK_SIZE, static_cast<long>(shift) + size);
+
+        memcpy(&buff[from - shift], &it->second.data[from % BLOCK_SIZE], to - from);
+    }
+}
+
+void WriteBuffer::take(int inodeId, Blocks& blocks) {
+    lock_guard<mutex> guard(lock);
+
+    blocks.clear();
+
+    unordered_map<int, Blocks>::iterator found = buffers.find(inodeId);
+    if (found == buffers.end()) return;
+
+    blocks.swap(found->second);
+    buffers.erase(found);
+    blocksNumber -= blocks.size();
+}
+
+void WriteBuffer::restore(int inodeId, Blocks& blocks) {
+    if (blocks.empty()) return;
+
+    lock_guard<mutex> guard(lock);
+
+    blocksNumber += blocks.size();
+    buffers[inodeId].swap(blocks);
+}
+
+int WriteBuffer::truncate(int inodeId, int newSize) {
+    lock_guard<mutex> guard(lock);
+
+    unordered_map<int, Blocks>::iterator found = buffers.find(inodeId);
+    if (found == buffers.end()) return 0;
+
+    Blocks& blocks = found->second;
+    int reserved = 0;
+
+    Blocks::iterator it = blocks.lower_bound((newSize + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    while (it != blocks.end()) {
+        if (it->second.reserved) reserved++;
+        blocksNumber--;
+        it = blocks.erase(it);
+    }
+
+    // the file may grow again, bytes past its end must be zeros
+    if (newSize % BLOCK_SIZE != 0) {
+        it = blocks.find(newSize / BLOCK_SIZE);
+        if (it != blocks.end()) memset(&it->second.data[newSize % BLOCK_SIZE], 0, BLOCK_SIZE - newSize % BLOCK_SIZE);
+    }
+
+    if (blocks.empty()) buffers.erase(found);
+    return reserved;
+}
+
+vector<int> WriteBuffer::files() {
+    lock_guard<mutex> guard(lock);
+
+    vector<int> ids;
+    for (unordered_map<int, Blocks>::iterator it = buffers.begin(); it != buffers.end(); it++) {
+        ids.push_back(it->first);
+    }
+
+    return ids;
+}
+
+}       // fs::namespace end
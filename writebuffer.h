@@ -0,0 +1,62 @@
+#ifndef WRITEBUFFER_H
+#define WRITEBUFFER_H
+
+#include "fs.h"
+
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace fs {
+
+/**
+ * @brief The WriteBuffer class keeps data written to regular files in memory,
+ * device blocks for it are allocated, when the file is flushed. Only whole file
+ * blocks are buffered; a reserved block was a hole, when it was buffered, and
+ * has a device block reserved for it. Blocks of a file are changed by the
+ * holder of the file lock only
+ */
+class WriteBuffer {
+public:
+    struct Block {
+        bool reserved;
+        char data[BLOCK_SIZE];
+    };
+
+    typedef std::map<int, Block> Blocks;        // by file block
+
+    WriteBuffer();
+
+    void setCapacity(int capacity);             // 0 disables buffering
+    bool isFull();                              // more blocks than the capacity are buffered
+    bool fits(int blocks);                      // a write of so many blocks may be buffered
+
+    bool contains(int inodeId);
+    bool contains(int inodeId, int logical);
+
+    void put(int inodeId, int logical, const char* data, bool reserved);
+    void update(int inodeId, int logical, const char* data, int size, int shift);
+
+    // copies buffered bytes of [shift, shift + size) of the file over buff
+    void overlay(int inodeId, char* buff, int size, int shift);
+
+    void take(int inodeId, Blocks& blocks);     // removes all the blocks of the file
+    void restore(int inodeId, Blocks& blocks);  // puts taken blocks back
+
+    // drops blocks past newSize and zeros the tail of the last one,
+    // returns the number of reserved blocks dropped
+    int truncate(int inodeId, int newSize);
+
+    std::vector<int> files();                   // files with buffered blocks
+
+private:
+    std::mutex lock;
+    int capacity;                               // max number of buffered blocks
+    int blocksNumber;
+    std::unordered_map<int, Blocks> buffers;
+};
+
+}       // fs::namespace end
+
+#endif // WRITEBUFFER_H